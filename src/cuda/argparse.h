@@ -74,26 +74,38 @@ class ArgumentParser {
         std::vector<std::string>::const_iterator it;
         for (unsigned int i = 0; i != args_.size(); ++i) {
             it = std::find(tokens.begin(), tokens.end(), args_[i].option());
-            if ((it == tokens.end() || ++it == tokens.end()) &&
-                args_[i].required()) {
-                PrintHelp();
-                std::cerr << "Error: Missing required option: "
-                          << args_[i].option() << std::endl;
-                return 1;
-            } else {
-                parsed_args_.insert(std::make_pair(
-                    args_[i].option(), ParsedArgument(args_[i], *it)));
+            if (it == tokens.end() || ++it == tokens.end()) {
+                if (args_[i].required()) {
+                    PrintHelp();
+                    std::cerr << "Error: Missing required option: "
+                              << args_[i].option() << std::endl;
+                    return 1;
+                }
+                continue; // Optional argument not given
             }
+            parsed_args_.insert(std::make_pair(
+                args_[i].option(), ParsedArgument(args_[i], *it)));
         }
         return 0;
     }
 
+    bool IsSet(std::string option) const {
+        return parsed_args_.find(option) != parsed_args_.end();
+    }
+
     template <typename T> T GetValue(std::string option) const {
         std::map<std::string, ParsedArgument>::const_iterator it;
         it = parsed_args_.find(option);
         return it->second.value<T>();
     }
 
+    template <typename T>
+    T GetValue(std::string option, const T &default_value) const {
+        if (!IsSet(option))
+            return default_value;
+        return GetValue<T>(option);
+    }
+
     void PrintHelp() const {
         std::cerr << prog_name_ << ": " << prog_desc_ << std::endl << std::endl;
         std::cerr << "Usage:\n\t" << prog_name_ << " [options]\n" << std::endl;
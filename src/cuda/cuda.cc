@@ -1,17 +1,41 @@
 #include <cstdlib>
 #include <iostream>
+#include <string>
 
 #include "argparse.h"
 #include "heat_transfer.h"
 using namespace std;
 using namespace heat_transfer;
 
+// Runs the simulation with the given storage and compute types after the
+// double precision one and reports the error of the final grid against the
+// double one
+template <typename Storage, typename Compute>
+static int ComparePrecision(int height, int width, int steps) {
+    HeatTransfer reference;
+    BasicHeatTransfer<Storage, Compute> simulation;
+    reference.Init(height, width, steps);
+    simulation.Init(height, width, steps);
+    reference.Run();
+    simulation.Run();
+    int err = simulation.ReportError(reference);
+    simulation.Destroy();
+    reference.Destroy();
+    return err;
+}
+
 int main(int argc, char *argv[]) {
     // Setup and parse arguments
     ArgumentParser parser("mpi_heat", "HeatTransfer implementation in MPI");
     parser.AddArgument("-h", "Grid height", true);
     parser.AddArgument("-w", "Grid width", true);
     parser.AddArgument("-s", "Time steps", true);
+    parser.AddArgument("-P", "Precision: double, float or mixed (float "
+                             "storage, double arithmetic)",
+                       false);
+    parser.AddArgument("-i", "Initial condition: a grid file, eg. a "
+                             "checkpoint of the MPI version",
+                       false);
     if (parser.Parse(argc, argv))
         exit(EXIT_FAILURE);
 
@@ -19,9 +43,26 @@ int main(int argc, char *argv[]) {
     int width = parser.GetValue<int>("-w");
     int steps = parser.GetValue<int>("-s");
 
+    // Reduced precision, compared against double precision
+    string precision = parser.GetValue<string>("-P", "double");
+    if (precision == "float")
+        exit(ComparePrecision<float, float>(height, width, steps)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+    if (precision == "mixed")
+        exit(ComparePrecision<float, double>(height, width, steps)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+
     // Setup and run simulation with given arguments
     HeatTransfer simulation;
     simulation.Init(height, width, steps);
+    string initial_condition = parser.GetValue<string>("-i", "");
+    if (!initial_condition.empty() &&
+        simulation.LoadInitialCondition(initial_condition.c_str())) {
+        simulation.Destroy();
+        exit(EXIT_FAILURE);
+    }
     simulation.Run();
 
     // Bye, bye...
@@ -1,7 +1,10 @@
 #ifndef __HEAT_TRANSFER_H_
 #define __HEAT_TRANSFER_H_
 
+#include "grid_file.h"
 #include "macros.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
@@ -13,9 +16,46 @@ extern "C" int updateGPU(double *host_array, unsigned int height,
                          unsigned int width, unsigned int steps_,
                          float *elapsed_time);
 
-class HeatTransfer {
+extern "C" int updateGPUFloat(float *host_array, unsigned int height,
+                              unsigned int width, unsigned int steps_,
+                              float *elapsed_time);
+
+extern "C" int updateGPUMixed(float *host_array, unsigned int height,
+                              unsigned int width, unsigned int steps_,
+                              float *elapsed_time);
+
+// GPU update of a grid of the storage type, in the compute type
+template <typename Storage, typename Compute> struct GPUUpdate;
+
+template <> struct GPUUpdate<double, double> {
+    static int Run(double *grid, unsigned int height, unsigned int width,
+                   unsigned int steps, float *elapsed_time) {
+        return updateGPU(grid, height, width, steps, elapsed_time);
+    }
+};
+
+template <> struct GPUUpdate<float, float> {
+    static int Run(float *grid, unsigned int height, unsigned int width,
+                   unsigned int steps, float *elapsed_time) {
+        return updateGPUFloat(grid, height, width, steps, elapsed_time);
+    }
+};
+
+template <> struct GPUUpdate<float, double> {
+    static int Run(float *grid, unsigned int height, unsigned int width,
+                   unsigned int steps, float *elapsed_time) {
+        return updateGPUMixed(grid, height, width, steps, elapsed_time);
+    }
+};
+
+/*
+ * The simulation on a grid stored as Storage and updated in Compute
+ * arithmetic on the GPU. HeatTransfer runs in double precision.
+ */
+template <typename Storage, typename Compute = Storage>
+class BasicHeatTransfer {
   public:
-    HeatTransfer() : grid_(NULL) {
+    BasicHeatTransfer() : grid_(NULL) {
     }
 
     int Init(unsigned int height, unsigned int width, unsigned int steps) {
@@ -26,6 +66,21 @@ class HeatTransfer {
         return 0;
     }
 
+    /*
+     * Replaces the initial condition with the grid in the grid file at path
+     * (see grid_file.h). Call after Init. Returns non-zero on failure.
+     */
+    int LoadInitialCondition(const char *path) {
+        GridFile file;
+        if (file.Open(path, height_, width_))
+            return 1;
+        file.WillRead(0, height_);
+        for (unsigned int i = 0; i != height_; ++i)
+            std::copy(file.Row(i), file.Row(i) + width_,
+                      grid_ + (size_t)i * width_);
+        return 0;
+    }
+
     int Destroy() {
         if (grid_ != NULL)
             delete[] grid_;
@@ -34,13 +89,38 @@ class HeatTransfer {
 
     int Run() {
         float elapsed_time = 0.0;
-        updateGPU(grid_, height_, width_, steps_, &elapsed_time);
+        GPUUpdate<Storage, Compute>::Run(grid_, height_, width_, steps_,
+                                         &elapsed_time);
         std::fprintf(stderr, "\nElapsed time: %.2f sec\n", elapsed_time);
         return 0;
     }
 
+    /*
+     * Reports the difference of the grid from that of a reference simulation
+     * of the same grid, eg. the double precision one
+     */
+    template <typename S, typename C>
+    int ReportError(const BasicHeatTransfer<S, C> &reference) const {
+        if (height_ != reference.height_ || width_ != reference.width_) {
+            std::fprintf(stderr, "Cannot compare different grids\n");
+            return 1;
+        }
+        double error = 0.0, max = 0.0, val = 0.0, reference_val = 0.0;
+        for (unsigned int i = 0; i != height_; ++i)
+            for (unsigned int j = 0; j != width_; ++j) {
+                GetCellValue(i, j, &val);
+                reference.GetCellValue(i, j, &reference_val);
+                error = std::max(error, std::fabs(val - reference_val));
+                max = std::max(max, std::fabs(reference_val));
+            }
+        std::fprintf(stderr, "Max error: %.3e (%.3e of the max value)\n",
+                     error, max > 0.0 ? error / max : 0.0);
+        return 0;
+    }
+
   private:
-    int GetCellValue(unsigned int i, unsigned int j, double *val) const {
+    template <typename V>
+    int GetCellValue(unsigned int i, unsigned int j, V *val) const {
         // Out of bounds
         if (!(i < height_) || i < 0 || !(j < width_) || j < 0)
             return 1;
@@ -48,17 +128,19 @@ class HeatTransfer {
         return 0;
     }
 
-    int SetCellValue(unsigned int i, unsigned int j, double val) const {
+    template <typename V>
+    int SetCellValue(unsigned int i, unsigned int j, V val) const {
         // Out of bounds
         if (!(i < height_) || i < 0 || !(j < width_) || j < 0)
             return 1;
-        *(grid_ + i * width_ + j) = val; // grid_[i][j] = val
+        // grid_[i][j] = val
+        *(grid_ + i * width_ + j) = static_cast<Storage>(val);
         return 0;
     }
 
     int InitGrid() {
         unsigned int block_size = height_ * width_;
-        grid_ = new double[block_size];
+        grid_ = new Storage[block_size];
         // Initialize grid values
         for (unsigned int i = 0; i != height_; ++i)
             for (unsigned int j = 0; j != width_; ++j) {
@@ -84,11 +166,15 @@ class HeatTransfer {
 
     unsigned int height_;
     unsigned int width_;
-    double *grid_;
+    Storage *grid_;
+
+    template <typename S, typename C> friend class BasicHeatTransfer;
 
-    DISALLOW_COPY_AND_ASSIGN(HeatTransfer);
+    DISALLOW_COPY_AND_ASSIGN(BasicHeatTransfer);
 };
 
+typedef BasicHeatTransfer<double> HeatTransfer;
+
 } // namespace heat_transfer
 
 #endif // __HEAT_TRANSFER_H_
@@ -9,41 +9,44 @@
 #define BLOCK_SIZE 16  // The conservative approach
 
 
+// Grids are stored as Storage and updated in Compute arithmetic
+template <typename Storage, typename Compute>
 __global__ void updateKernel(unsigned int height, unsigned int width,
-                             double *wgrid, double *ogrid) {
+                             Storage *wgrid, Storage *ogrid) {
   // Determine coordinates of block within the data array and launch updates
   int i = blockIdx.x * blockDim.x + threadIdx.x;
   int j = blockIdx.y * blockDim.y + threadIdx.y;
   if (!(i < height) || i < 0 || !(j < width) || j < 0) return;
 
-  double old_val = *(ogrid + i*width + j);
-  double left = j ? *(ogrid + i*width + (j-1)) : 0.0f;
-  double top = i ? *(ogrid + (i-1)*width + j) : 0.0f;
-  double right = (j != width-1) ? *(ogrid + i*width + (j+1)) : 0.0f;
-  double bottom = (i != height-1) ? *(ogrid + (i+1)*width + j) : 0.0f;
+  const Compute zero = 0, coefficient = 0.1, two = 2;
+  Compute old_val = *(ogrid + i*width + j);
+  Compute left = j ? *(ogrid + i*width + (j-1)) : zero;
+  Compute top = i ? *(ogrid + (i-1)*width + j) : zero;
+  Compute right = (j != width-1) ? *(ogrid + i*width + (j+1)) : zero;
+  Compute bottom = (i != height-1) ? *(ogrid + (i+1)*width + j) : zero;
 
   *(wgrid + i*width + j) = old_val
-                           + 0.1 * (top + bottom - 2.0 * old_val)
-                           + 0.1 * (right + left - 2.0 * old_val);
+                           + coefficient * (top + bottom - two * old_val)
+                           + coefficient * (right + left - two * old_val);
 }
 
 
-extern "C"
-int updateGPU(double *host_array, unsigned int height, unsigned int width,
-              unsigned int steps, float *elapsed_time) {
+template <typename Storage, typename Compute>
+static int update(Storage *host_array, unsigned int height, unsigned int width,
+                  unsigned int steps, float *elapsed_time) {
 
   unsigned int block_size = height * width;
-  double *grids[2];
+  Storage *grids[2];
 
   // Allocate space for the the two grids in the GPU
   for (unsigned int i = 0; i != 2; ++i)
-    CUDA_SAFE_CALL(cudaMalloc(&grids[i], block_size * sizeof(double)));
+    CUDA_SAFE_CALL(cudaMalloc(&grids[i], block_size * sizeof(Storage)));
 
   // grids[0] will hold the initial data
-  CUDA_SAFE_CALL(cudaMemcpy(grids[0], host_array, block_size * sizeof(double),
+  CUDA_SAFE_CALL(cudaMemcpy(grids[0], host_array, block_size * sizeof(Storage),
                             cudaMemcpyHostToDevice));
   // grids[1] initialized to zeroes
-  CUDA_SAFE_CALL(cudaMemset(grids[1], 0, block_size * sizeof(double)));
+  CUDA_SAFE_CALL(cudaMemset(grids[1], 0, block_size * sizeof(Storage)));
 
   // Determine grid dimensions according to input array
   // x = ceil(height / BLOCK_SIZE)
@@ -60,8 +63,8 @@ int updateGPU(double *host_array, unsigned int height, unsigned int width,
 
   for (unsigned int i = 0; i != steps; ++i) {
     // Fire update in kernel
-    updateKernel<<<blocks, threads>>>(height, width,
-                                      grids[wgrid], grids[1-wgrid]);
+    updateKernel<Storage, Compute><<<blocks, threads>>>(
+        height, width, grids[wgrid], grids[1-wgrid]);
     // Wait for threads to reach this point
     CUDA_SAFE_CALL(cudaThreadSynchronize());
     wgrid = 1 - wgrid;
@@ -71,7 +74,7 @@ int updateGPU(double *host_array, unsigned int height, unsigned int width,
 
   // Get results back
   CUDA_SAFE_CALL(cudaMemcpy(host_array, grids[1-wgrid],
-                            block_size * sizeof(double),
+                            block_size * sizeof(Storage),
                             cudaMemcpyDeviceToHost));
 
   // Free space allocated in the GPU
@@ -80,3 +83,27 @@ int updateGPU(double *host_array, unsigned int height, unsigned int width,
 
   return 0;
 }
+
+
+extern "C"
+int updateGPU(double *host_array, unsigned int height, unsigned int width,
+              unsigned int steps, float *elapsed_time) {
+  return update<double, double>(host_array, height, width, steps,
+                                elapsed_time);
+}
+
+
+extern "C"
+int updateGPUFloat(float *host_array, unsigned int height, unsigned int width,
+                   unsigned int steps, float *elapsed_time) {
+  return update<float, float>(host_array, height, width, steps, elapsed_time);
+}
+
+
+// Float storage, double arithmetic
+extern "C"
+int updateGPUMixed(float *host_array, unsigned int height, unsigned int width,
+                   unsigned int steps, float *elapsed_time) {
+  return update<float, double>(host_array, height, width, steps,
+                               elapsed_time);
+}
@@ -2,6 +2,7 @@
 #define __HEAT_MAP_H_
 
 #include "mpi_wrapper.h"
+#include <algorithm>
 #include <cmath>
 #include <omp.h>
 #include <vector>
@@ -10,7 +11,9 @@ namespace heat_transfer {
 
 class HeatMap {
   public:
-    HeatMap() : working_grid_(0), block_height_(0), block_width_(0) {
+    HeatMap()
+        : working_grid_(0), block_height_(0), block_width_(0),
+          in_place_(false), max_change_(0.0) {
         for (int i = 0; i != 2; ++i)
             grids_[i] = NULL;
         mpi_wrapper_ = NULL;
@@ -28,10 +31,25 @@ class HeatMap {
         // and initialize to zeroes
         unsigned int block_size = (block_height_ + 2) * (block_width_ + 2);
         for (unsigned int g = 0; g != 2; ++g) {
+            if (in_place_ && g) {
+                // A single grid, updated in place
+                grids_[g] = grids_[0];
+                break;
+            }
             grids_[g] = new double[block_size];
             for (unsigned int i = 0; i != block_size; ++i)
                 grids_[g][i] = 0.0;
         }
+        if (in_place_) {
+            // Three rows per thread, see HeatMap::InPlaceStandaloneUpdate
+            lines_.resize(3 * omp_get_max_threads() * (block_width_ + 2));
+            for (int k = 0; k != 2; ++k) {
+                saved_rows_[k].resize(block_width_ + 2);
+                saved_cols_[k].resize(block_height_ + 2);
+            }
+            for (int k = 0; k != 4; ++k)
+                edges_[k].resize(1 + std::max(block_height_, block_width_));
+        }
 
         // Initialize block
         // Calculate total size and offsets
@@ -51,12 +69,28 @@ class HeatMap {
     }
 
     int Destroy() {
+        if (grids_[1] == grids_[0])
+            grids_[1] = NULL; // In place, a single grid
         for (int i = 0; i != 2; ++i)
             if (grids_[i] != NULL)
                 delete[] grids_[i];
         return 0;
     }
 
+    /*
+     * SetInPlace: Selects the in-place update (call before HeatMap::Init).
+     *
+     * Instead of a second grid, each thread keeps copies of the previous
+     * values of the row above and of the current row, rolling them as it
+     * sweeps down its rows of the block, so the results are identical to the
+     * two-grid update. The interior sweep also keeps the previous values of
+     * the rows and columns next to the edges, which are only updated once the
+     * halos arrive.
+     */
+    void SetInPlace(bool in_place) {
+        in_place_ = in_place;
+    }
+
     int ExchangeMessages() {
         double *addr;
         // Send/Receive LEFT
@@ -101,6 +135,8 @@ class HeatMap {
     }
 
     int StandaloneUpdate() {
+        if (in_place_)
+            return InPlaceStandaloneUpdate();
         double *grid0 = grids_[0], *grid1 = grids_[1];
 #pragma omp parallel for shared(grid0, grid1) schedule(auto) collapse(2)
         for (unsigned int i = 2; i < block_height_; ++i) {
@@ -124,6 +160,8 @@ class HeatMap {
     }
 
     int CollaborativeUpdate() {
+        if (in_place_)
+            return InPlaceCollaborativeUpdate();
         double *grid0 = grids_[0], *grid1 = grids_[1];
 // Update top and bottom rows
 #pragma omp parallel for shared(grid0, grid1) schedule(auto) collapse(1)
@@ -141,6 +179,12 @@ class HeatMap {
     }
 
     int CheckConvergence(int *converged) const {
+        if (in_place_) {
+            // The previous values are gone, use the change recorded by the
+            // update instead
+            *converged = !(max_change_ > 0.001f);
+            return 0;
+        }
         double val1, val2;
         *converged = 1;
         for (unsigned int i = 1; i != 1 + block_height_; ++i)
@@ -178,6 +222,109 @@ class HeatMap {
     }
 
   private:
+    int InPlaceStandaloneUpdate() {
+        double *grid = grids_[0];
+        unsigned int row = block_width_ + 2; // Row length, with halos
+        unsigned int rows = block_height_ > 2 ? block_height_ - 2 : 0;
+        double max_change = 0.0;
+#pragma omp parallel reduction(max : max_change)
+        {
+            // Each thread sweeps a contiguous range of rows
+            unsigned int t = omp_get_thread_num(), n = omp_get_num_threads();
+            unsigned int first = 2 + rows * t / n;
+            unsigned int last = 2 + rows * (t + 1) / n;
+            double *prev = &lines_[3 * t * row], *cur = prev + row;
+            double *next = cur + row;
+            // Keep the rows around the range, before the neighboring threads
+            // update them
+            if (first != last) {
+                std::copy(grid + (first - 1) * row, grid + first * row, prev);
+                std::copy(grid + last * row, grid + (last + 1) * row, next);
+            }
+#pragma omp barrier
+            for (unsigned int i = first; i != last; ++i) {
+                double *line = grid + i * row;
+                const double *below = i + 1 == last ? next : line + row;
+                std::copy(line, line + row, cur);
+                // Keep what the edge update will need
+                if (i == 2)
+                    saved_rows_[0].assign(cur, cur + row);
+                if (i == block_height_ - 1)
+                    saved_rows_[1].assign(cur, cur + row);
+                saved_cols_[0][i] = cur[2];
+                saved_cols_[1][i] = cur[block_width_ - 1];
+
+                for (unsigned int j = 2; j < block_width_; ++j) {
+                    double old_val = cur[j];
+                    double new_val =
+                        old_val + 0.1 * (prev[j] + below[j] - 2.0 * old_val) +
+                        0.1 * (cur[j + 1] + cur[j - 1] - 2.0 * old_val);
+                    max_change =
+                        std::max(max_change, std::fabs(new_val - old_val));
+                    line[j] = new_val;
+                }
+                std::swap(prev, cur);
+            }
+        }
+        max_change_ = max_change;
+        return 0;
+    }
+
+    int InPlaceCollaborativeUpdate() {
+        unsigned int h = block_height_, w = block_width_;
+        double max_change = max_change_;
+// Compute all the edges from previous values, then write them
+#pragma omp parallel for schedule(auto) reduction(max : max_change)
+        for (unsigned int j = 1; j < 1 + w; ++j) {
+            edges_[TOP][j] = InPlaceCellUpdate(1, j, &max_change);
+            edges_[BOTTOM][j] = InPlaceCellUpdate(h, j, &max_change);
+        }
+#pragma omp parallel for schedule(auto) reduction(max : max_change)
+        for (unsigned int i = 1; i < 1 + h; ++i) {
+            edges_[LEFT][i] = InPlaceCellUpdate(i, 1, &max_change);
+            edges_[RIGHT][i] = InPlaceCellUpdate(i, w, &max_change);
+        }
+        for (unsigned int j = 1; j != 1 + w; ++j) {
+            SetCellValue(1, j, 0, edges_[TOP][j]);
+            SetCellValue(h, j, 0, edges_[BOTTOM][j]);
+        }
+        for (unsigned int i = 1; i != 1 + h; ++i) {
+            SetCellValue(i, 1, 0, edges_[LEFT][i]);
+            SetCellValue(i, w, 0, edges_[RIGHT][i]);
+        }
+        max_change_ = max_change;
+        return 0;
+    }
+
+    // New value of an edge cell, after the in-place interior sweep
+    double InPlaceCellUpdate(unsigned int i, unsigned int j,
+                             double *max_change) const {
+        double old_val = PreviousValue(i, j);
+        double new_val =
+            old_val +
+            0.1 * (PreviousValue(i - 1, j) + PreviousValue(i + 1, j) -
+                   2.0 * old_val) +
+            0.1 * (PreviousValue(i, j + 1) + PreviousValue(i, j - 1) -
+                   2.0 * old_val);
+        *max_change = std::max(*max_change, std::fabs(new_val - old_val));
+        return new_val;
+    }
+
+    // Value of a cell before the in-place interior sweep
+    double PreviousValue(unsigned int i, unsigned int j) const {
+        if (i >= 2 && i < block_height_ && j >= 2 && j < block_width_) {
+            // Overwritten by the sweep
+            if (i == 2)
+                return saved_rows_[0][j];
+            if (i == block_height_ - 1)
+                return saved_rows_[1][j];
+            if (j == 2)
+                return saved_cols_[0][i];
+            return saved_cols_[1][i];
+        }
+        return grids_[0][i * (block_width_ + 2) + j];
+    }
+
     int GetCellValue(unsigned int i, unsigned int j, int grid,
                      double *val) const {
         // Out of bounds
@@ -214,6 +361,14 @@ class HeatMap {
     unsigned int block_width_;
 
     MPIWrapper *mpi_wrapper_;
+
+    // In-place update, see HeatMap::SetInPlace
+    bool in_place_;
+    double max_change_;                 // Maximum change in the last step
+    std::vector<double> lines_;         // Rolling previous rows, per thread
+    std::vector<double> saved_rows_[2]; // Previous rows 2 and height - 1
+    std::vector<double> saved_cols_[2]; // Previous columns 2 and width - 1
+    std::vector<double> edges_[4];      // New edge values, per channel
 };
 
 } // namespace heat_transfer
@@ -25,6 +25,14 @@ class HeatTransfer {
         return 0;
     }
 
+    /*
+     * Selects the in-place update of HeatMap::SetInPlace, which halves the
+     * memory of the grids. Call before Init.
+     */
+    void SetInPlace(bool in_place) {
+        heat_map_.SetInPlace(in_place);
+    }
+
     int Destroy() {
         mpi_wrapper_.Destroy();
         heat_map_.Destroy();
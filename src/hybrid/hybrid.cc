@@ -14,6 +14,7 @@ int main(int argc, char *argv[]) {
     parser.AddArgument("-h", "Grid height", true);
     parser.AddArgument("-w", "Grid width", true);
     parser.AddArgument("-s", "Time steps", true);
+    parser.AddArgument("-r", "In-place update with rolling rows, 0/1", false);
     if (parser.Parse(argc, argv))
         exit(EXIT_FAILURE);
 
@@ -23,6 +24,7 @@ int main(int argc, char *argv[]) {
 
     // Setup and run simulation with given arguments
     HeatTransfer simulation;
+    simulation.SetInPlace(parser.GetValue<int>("-r", 0));
     simulation.Init(height, width, steps);
     simulation.Run();
 
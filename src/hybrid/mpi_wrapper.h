@@ -254,9 +254,9 @@ class MPIWrapper {
     int comm_sz_; // Communicator size
     char processor_name_[MPI_MAX_PROCESSOR_NAME];
 
-    int topology_height_; // Cartesian topology height
-    int topology_width_;  // Cartesian topology width
-    int topology_comm_;   // Cartesian topology communicator
+    int topology_height_;    // Cartesian topology height
+    int topology_width_;     // Cartesian topology width
+    MPI_Comm topology_comm_; // Cartesian topology communicator
 
     int topology_coord_x_; // Worker's topology X coordinate
     int topology_coord_y_; // Worker's topology Y coordinate
@@ -0,0 +1,230 @@
+#ifndef __ENSEMBLE_H_
+#define __ENSEMBLE_H_
+
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace heat_transfer {
+
+// A member of an ensemble: one simulation of the batch
+struct Member {
+    double coefficient; // Diffusion coefficient of the update
+    int steps;          // The maximum number of simulation steps
+};
+
+/*
+ * Ensemble: runs many small simulations of the same grid shape together.
+ *
+ * Members are packed kLanes at a time into a batch, whose grids are stored
+ * interleaved: the kLanes values of a cell are contiguous. The update of a
+ * cell is then a loop over the lanes, which the compiler turns into SIMD
+ * instructions advancing all the members of the batch at once, each with its
+ * own coefficient. Members that converge or run out of steps are masked out
+ * (their updates are multiplied by zero) until the whole batch is done.
+ * Batches are distributed round-robin over the workers; grids are not split.
+ */
+class Ensemble {
+  public:
+    static const int kLanes = 4;
+
+    Ensemble() {
+    }
+
+    int Init(int height, int width, const std::vector<Member> &members) {
+        height_ = height;
+        width_ = width;
+        members_ = members;
+        mpi_wrapper_.Init();
+        if (members_.empty()) {
+            mpi_wrapper_.PrintRoot(stderr, "Invalid or empty ensemble\n");
+            mpi_wrapper_.Destroy();
+            return 1;
+        }
+
+        unsigned int size = (height_ + 2) * (width_ + 2) * kLanes;
+        for (int g = 0; g != 2; ++g)
+            grids_[g].resize(size);
+        return 0;
+    }
+
+    int Destroy() {
+        mpi_wrapper_.Destroy();
+        return 0;
+    }
+
+    /*
+     * Ensemble::Run - executes the batches of the worker, writing each
+     * member's final grid to <prefix>.<member> when a prefix is given
+     */
+    int Run(const std::string &prefix) {
+        double time_start = MPI_Wtime(), local_time, global_time;
+        int batches = (members_.size() + kLanes - 1) / kLanes;
+        for (int b = mpi_wrapper_.rank(); b < batches;
+             b += mpi_wrapper_.communication_size())
+            RunBatch(b, prefix);
+
+        local_time = MPI_Wtime() - time_start;
+        std::fprintf(stderr, "worker%d@%s, time: %.2f\n", mpi_wrapper_.rank(),
+                     mpi_wrapper_.processor_name(), local_time);
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        mpi_wrapper_.PrintRoot(stdout, "\nElapsed time: %.2f sec\n",
+                               global_time);
+        return 0;
+    }
+
+  private:
+    int RunBatch(int batch, const std::string &prefix) {
+        double coefficient[kLanes], active[kLanes];
+        int steps = 0;
+        for (int l = 0; l != kLanes; ++l) {
+            unsigned int m = batch * kLanes + l;
+            // Padding lanes stay inactive
+            coefficient[l] = active[l] = 0.0;
+            if (m < members_.size()) {
+                coefficient[l] = members_[m].coefficient;
+                active[l] = 1.0;
+                steps = std::max(steps, members_[m].steps);
+            }
+        }
+
+        InitGrids();
+        int wg = 0, convergence_check = std::sqrt(steps), i;
+        for (i = 0; i != steps; ++i) {
+            // Mask out the members out of steps
+            for (int l = 0; l != kLanes; ++l) {
+                unsigned int m = batch * kLanes + l;
+                if (m < members_.size() && members_[m].steps == i &&
+                    active[l] != 0.0)
+                    Finish(m, i, active + l);
+            }
+            if (!AnyActive(active))
+                break;
+
+            Update(&grids_[wg][0], &grids_[1 - wg][0], coefficient, active);
+            wg = 1 - wg;
+
+            if (!(i % convergence_check))
+                CheckConvergence(batch, i + 1, &grids_[wg][0],
+                                 &grids_[1 - wg][0], active);
+        }
+        for (int l = 0; l != kLanes; ++l)
+            if (active[l] != 0.0)
+                Finish(batch * kLanes + l, i, active + l);
+
+        if (!prefix.empty())
+            for (int l = 0; l != kLanes; ++l)
+                if (batch * kLanes + l < (int)members_.size())
+                    WriteMember(prefix, batch * kLanes + l, &grids_[wg][0], l);
+        return 0;
+    }
+
+    // The kLanes values of cell (i, j)
+    unsigned int Cell(unsigned int i, unsigned int j) const {
+        return (i * (width_ + 2) + j) * kLanes;
+    }
+
+    void InitGrids() {
+        for (int g = 0; g != 2; ++g)
+            std::fill(grids_[g].begin(), grids_[g].end(), 0.0);
+        double x = height_, y = width_;
+        for (int i = 1; i != 1 + height_; ++i)
+            for (int j = 1; j != 1 + width_; ++j) {
+                double val = i * (x - (i - 1)) * j * (y - (j - 1));
+                for (int l = 0; l != kLanes; ++l)
+                    grids_[0][Cell(i, j) + l] = val;
+            }
+    }
+
+    /*
+     * Advances all the active members of the batch by one step
+     */
+    void Update(const double *ogrid, double *wgrid, const double *coefficient,
+                const double *active) const {
+        int row = (width_ + 2) * kLanes;
+        double c[kLanes];
+        for (int l = 0; l != kLanes; ++l)
+            c[l] = coefficient[l] * active[l];
+        for (int i = 1; i != 1 + height_; ++i)
+            for (int j = 1; j != 1 + width_; ++j) {
+                const double *old_val = ogrid + Cell(i, j);
+                double *new_val = wgrid + Cell(i, j);
+                for (int l = 0; l != kLanes; ++l)
+                    new_val[l] = old_val[l] +
+                                 c[l] * (old_val[l - row] + old_val[l + row] -
+                                         2.0 * old_val[l]) +
+                                 c[l] * (old_val[l + kLanes] +
+                                         old_val[l - kLanes] -
+                                         2.0 * old_val[l]);
+            }
+    }
+
+    void CheckConvergence(int batch, int step, const double *wgrid,
+                          const double *ogrid, double *active) {
+        double change[kLanes] = {0.0};
+        for (int i = 1; i != 1 + height_; ++i)
+            for (int j = 1; j != 1 + width_; ++j)
+                for (int l = 0; l != kLanes; ++l) {
+                    double diff = std::fabs(wgrid[Cell(i, j) + l] -
+                                            ogrid[Cell(i, j) + l]);
+                    // Infinite once not finite, which the maximum would drop
+                    change[l] = std::max(change[l],
+                                         diff <= DBL_MAX ? diff : HUGE_VAL);
+                }
+        for (int l = 0; l != kLanes; ++l)
+            if (active[l] != 0.0 && change[l] <= 0.001f) {
+                std::printf("Member %d: convergence was reached after %d "
+                            "iterations!\n",
+                            batch * kLanes + l, step);
+                active[l] = 0.0;
+            }
+    }
+
+    void Finish(int member, int step, double *active) const {
+        std::printf("Member %d: stopped after %d iterations\n", member, step);
+        *active = 0.0;
+    }
+
+    bool AnyActive(const double *active) const {
+        for (int l = 0; l != kLanes; ++l)
+            if (active[l] != 0.0)
+                return true;
+        return false;
+    }
+
+    int WriteMember(const std::string &prefix, int member, const double *grid,
+                    int lane) const {
+        char path[4096];
+        std::snprintf(path, sizeof(path), "%s.%d", prefix.c_str(), member);
+        FILE *fp = std::fopen(path, "w");
+        if (fp == NULL) {
+            std::fprintf(stderr, "Cannot open %s for writing\n", path);
+            return 1;
+        }
+        for (int i = 1; i != 1 + height_; ++i) {
+            for (int j = 1; j != 1 + width_; ++j)
+                std::fprintf(fp, " %.10e", grid[Cell(i, j) + lane]);
+            std::fprintf(fp, "\n");
+        }
+        std::fclose(fp);
+        return 0;
+    }
+
+    int height_;
+    int width_;
+    std::vector<Member> members_;
+    std::vector<double> grids_[2]; // Interleaved grids of the current batch
+
+    MPIWrapper mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(Ensemble);
+};
+
+} // namespace heat_transfer
+
+#endif // __ENSEMBLE_H_
@@ -0,0 +1,124 @@
+#ifndef __GRID_FILE_H_
+#define __GRID_FILE_H_
+
+#include "macros.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace heat_transfer {
+
+/*
+ * Grid files: a header of four ints (the magic number, the grid height and
+ * width, and the step the grid was saved at), padded to GRID_FILE_HEADER
+ * bytes, then the grid row by row, in double. Checkpoints are grid files,
+ * so any of them can serve as an initial condition.
+ */
+enum GRID_FILE { GRID_FILE_MAGIC = 0x48544350, GRID_FILE_HEADER = 32 };
+
+/*
+ * GridFile: A grid file mapped into memory, read only. A worker copies its
+ * rows straight from the mapping, so only the pages of its own cells are
+ * read from disk, once, and no worker has to read and scatter the grid.
+ */
+class GridFile {
+  public:
+    GridFile() : map_(NULL), size_(0) {
+    }
+
+    ~GridFile() {
+        Close();
+    }
+
+    /*
+     * Maps the file at path, which must hold a grid of the given dimensions.
+     * Returns non-zero otherwise, and prints why if report is set (on one
+     * worker only).
+     */
+    int Open(const char *path, int height, int width, bool report) {
+        Close();
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) {
+            if (report)
+                std::fprintf(stderr, "Cannot open %s: %s\n", path,
+                             std::strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return 1;
+        }
+        size_ = st.st_size;
+        void *map = size_ >= GRID_FILE_HEADER
+                        ? mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0)
+                        : MAP_FAILED;
+        close(fd);
+        if (map != MAP_FAILED)
+            map_ = static_cast<const char *>(map);
+        const int *header = reinterpret_cast<const int *>(map_);
+        width_ = width;
+        size_t grid_size = (size_t)height * width * sizeof(double);
+        if (map_ == NULL || header[0] != GRID_FILE_MAGIC ||
+            header[1] != height || header[2] != width ||
+            size_ < GRID_FILE_HEADER + grid_size) {
+            if (report)
+                std::fprintf(stderr,
+                             "%s is not a grid file of a %dx%d grid\n", path,
+                             height, width);
+            Close();
+            return 1;
+        }
+        return 0;
+    }
+
+    void Close() {
+        if (map_ != NULL)
+            munmap(const_cast<char *>(map_), size_);
+        map_ = NULL;
+    }
+
+    /*
+     * Row i (0-based) of the grid
+     */
+    const double *Row(int i) const {
+        return reinterpret_cast<const double *>(map_ + GRID_FILE_HEADER) +
+               (size_t)i * width_;
+    }
+
+    /*
+     * Cell (i, j) (0-based) of the grid
+     */
+    double Value(int i, int j) const {
+        return Row(i)[j];
+    }
+
+    /*
+     * Advises the kernel that the given rows are about to be read, in order,
+     * so that it reads them ahead
+     */
+    void WillRead(int first_row, int rows) const {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = reinterpret_cast<const char *>(Row(first_row)) - map_;
+        size_t end = reinterpret_cast<const char *>(Row(first_row + rows)) -
+                     map_;
+        start -= start % page;
+        void *addr = const_cast<char *>(map_ + start);
+        madvise(addr, end - start, MADV_SEQUENTIAL);
+        madvise(addr, end - start, MADV_WILLNEED);
+    }
+
+  private:
+    const char *map_;
+    size_t size_;
+    int width_;
+
+    DISALLOW_COPY_AND_ASSIGN(GridFile);
+};
+
+} // namespace heat_transfer
+
+#endif // __GRID_FILE_H_
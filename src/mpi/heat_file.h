@@ -0,0 +1,406 @@
+#ifndef __HEAT_FILE_H_
+#define __HEAT_FILE_H_
+
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <aio.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * HeatFile: The grid block of a worker, kept in scratch files instead of
+ * memory, for grids larger than the memory of the workers.
+ *
+ * Each grid is a file of the block rows, without halos. A pass streams the
+ * block through memory in bands of whole rows and advances it by several
+ * steps at once (temporal blocking): a band is read together with the rows
+ * its steps depend on, and updated in a window that shrinks by one cell on
+ * every side per step, so that it reaches the last step of the pass with a
+ * single read and a single write (the margins are recomputed by the
+ * neighboring bands). The halos of a pass are a frame as deep as its steps,
+ * exchanged once per pass, with the corners passed on through the left and
+ * right halos. While a band is updated, the next one is read and the
+ * previous one written asynchronously (POSIX AIO).
+ *
+ * The results are those of HeatMap.
+ */
+class HeatFile {
+  public:
+    HeatFile()
+        : working_file_(0), band_(0), depth_(0), coefficient_(0.1),
+          traffic_(0.0) {
+        for (int g = 0; g != 2; ++g) {
+            files_[g] = -1;
+            pending_[g] = false;
+        }
+        mpi_wrapper_ = NULL;
+    }
+
+    /*
+     * Creates the files of the block in dir (unlinked once open, so they go
+     * away with the worker) and writes the initial condition into them.
+     * Passes update bands of band rows, for up to depth steps, which must
+     * not exceed the block dimensions. Returns non-zero on failure.
+     */
+    int Init(int block_height, int block_width, MPIWrapper *mpi_wrapper,
+             const std::string &dir, int band, int depth) {
+        block_height_ = block_height;
+        block_width_ = block_width;
+        mpi_wrapper_ = mpi_wrapper;
+        band_ = band;
+        depth_ = depth;
+        row_ = block_width_ + 2 * depth_;
+        working_file_ = 0;
+        traffic_ = 0.0;
+
+        for (int g = 0; g != 2; ++g) {
+            std::ostringstream path;
+            path << dir << "/heat_" << mpi_wrapper_->rank() << "_" << g
+                 << ".tmp";
+            files_[g] = open(path.str().c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                             0600);
+            if (files_[g] < 0) {
+                std::fprintf(stderr, "Cannot create %s: %s\n",
+                             path.str().c_str(), std::strerror(errno));
+                return 1;
+            }
+            unlink(path.str().c_str());
+        }
+
+        int window_rows = band_ + 2 * depth_;
+        for (int g = 0; g != 2; ++g) {
+            windows_[g].assign(window_rows * row_, 0.0);
+            staged_[g].assign(window_rows * block_width_, 0.0);
+            outgoing_[g].assign(band_ * block_width_, 0.0);
+        }
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            halos_[ch].assign(FrameLength(ch), 0.0);
+            edges_[ch].assign(FrameLength(ch), 0.0);
+        }
+        return FillInitialCondition();
+    }
+
+    int Destroy() {
+        for (int g = 0; g != 2; ++g)
+            if (files_[g] >= 0) {
+                close(files_[g]);
+                files_[g] = -1;
+            }
+        return 0;
+    }
+
+    /*
+     * HeatFile::Pass - advances the block by the given number of steps (up
+     * to the depth of HeatFile::Init), band by band, and sets converged when
+     * no cell changed by more than the threshold of HeatMap in the last step.
+     * Returns non-zero on an I/O error.
+     */
+    int Pass(int steps, int *converged) {
+        int bands = (block_height_ + band_ - 1) / band_;
+        ExchangeFrame();
+        *converged = 1;
+        if (Read(0))
+            return 1;
+        for (int b = 0; b != bands; ++b) {
+            if (Complete(&reads_[b % 2], NULL))
+                return 1;
+            // Prefetch the next band while this one is updated
+            if (b + 1 != bands && Read(b + 1))
+                return 1;
+            LoadWindow(b);
+            for (int s = 1; s <= steps; ++s)
+                UpdateWindow(b, s);
+            if (Complete(&writes_[b % 2], &pending_[b % 2]))
+                return 1;
+            StoreBand(b, &windows_[steps % 2][0],
+                      &windows_[(steps - 1) % 2][0], converged);
+            if (Write(b, files_[1 - working_file_]))
+                return 1;
+        }
+        for (int g = 0; g != 2; ++g)
+            if (Complete(&writes_[g], &pending_[g]))
+                return 1;
+        working_file_ = 1 - working_file_;
+        return 0;
+    }
+
+    /*
+     * Reads block row i (0-based) of the working grid into buf
+     */
+    int ReadRow(int i, double *buf) const {
+        size_t bytes = block_width_ * sizeof(double);
+        return pread(files_[working_file_], buf, bytes, (off_t)i * bytes) !=
+               (ssize_t)bytes;
+    }
+
+    void SetCoefficient(double coefficient) {
+        coefficient_ = coefficient;
+    }
+
+    /*
+     * Bytes read from and written to the files so far
+     */
+    double traffic() const {
+        return traffic_;
+    }
+
+    /*
+     * Bytes of the windows, buffers and frame held in memory
+     */
+    double resident_size() const {
+        double cells = 0.0;
+        for (int g = 0; g != 2; ++g)
+            cells += windows_[g].size() + staged_[g].size() +
+                     outgoing_[g].size();
+        for (int c = 0; c != 4; ++c)
+            cells += halos_[c].size() + edges_[c].size();
+        return cells * sizeof(double);
+    }
+
+  private:
+    // Writes the initial condition of HeatMap to the working file, band by
+    // band, through the first window
+    int FillInitialCondition() {
+        double x = mpi_wrapper_->topology_height() * block_height_;
+        double y = mpi_wrapper_->topology_width() * block_width_;
+        int off_x = mpi_wrapper_->topology_coord_x() * block_height_;
+        int off_y = mpi_wrapper_->topology_coord_y() * block_width_;
+        int bands = (block_height_ + band_ - 1) / band_;
+        for (int b = 0; b != bands; ++b) {
+            int r0 = b * band_, r1 = std::min(r0 + band_, block_height_);
+            for (int i = r0; i != r1; ++i) {
+                double *cells =
+                    &windows_[0][(i - r0 + depth_) * row_ + depth_];
+                for (int j = 0; j != block_width_; ++j) {
+                    double fi = i + off_x + 1.0, fj = j + off_y + 1.0;
+                    cells[j] = fi * (x - (fi - 1)) * fj * (y - (fj - 1));
+                }
+            }
+            if (Complete(&writes_[b % 2], &pending_[b % 2]))
+                return 1;
+            StoreBand(b, &windows_[0][0], NULL, NULL);
+            if (Write(b, files_[working_file_]))
+                return 1;
+        }
+        for (int g = 0; g != 2; ++g)
+            if (Complete(&writes_[g], &pending_[g]))
+                return 1;
+        return 0;
+    }
+
+    // Exchanges the frame of halos: the left and right ones first, which
+    // then complete the top and bottom edges with the corners
+    void ExchangeFrame() {
+        static const int send_tags[4] = {LEFT_SEND, UP_SEND, RIGHT_SEND,
+                                         DOWN_SEND};
+        static const int recv_tags[4] = {LEFT_RECV, UP_RECV, RIGHT_RECV,
+                                         DOWN_RECV};
+        static const CHANNEL phases[2][2] = {{LEFT, RIGHT}, {TOP, BOTTOM}};
+        int d = depth_, h = block_height_;
+        for (int p = 0; p != 2; ++p) {
+            if (p == 1)
+                for (int r = 0; r != d; ++r) {
+                    CopyCorners(r, &edges_[TOP][r * row_]);
+                    CopyCorners(h - d + r, &edges_[BOTTOM][r * row_]);
+                }
+            for (int k = 0; k != 2; ++k) {
+                CHANNEL ch = phases[p][k];
+                if (!mpi_wrapper_->HasNeighbor(ch))
+                    continue;
+                mpi_wrapper_->PostSend(&edges_[ch][0], FrameLength(ch), ch,
+                                       send_tags[ch]);
+                mpi_wrapper_->PostReceive(&halos_[ch][0], FrameLength(ch), ch,
+                                          recv_tags[ch]);
+            }
+            for (int k = 0; k != 2; ++k)
+                mpi_wrapper_->Wait(phases[p][k]);
+        }
+    }
+
+    // Copies the left and right halos of block row i around a frame row
+    void CopyCorners(int i, double *row) const {
+        int d = depth_;
+        std::copy(&halos_[LEFT][i * d], &halos_[LEFT][i * d] + d, row);
+        std::copy(&halos_[RIGHT][i * d], &halos_[RIGHT][i * d] + d,
+                  row + d + block_width_);
+    }
+
+    // Fills the first window with band b and the frame around it. The parts
+    // from the frame go into the second window too, so that the cells beyond
+    // the global grid, which are never updated, read as zero in both.
+    void LoadWindow(int b) {
+        int d = depth_, w = block_width_, h = block_height_;
+        int r0 = b * band_, r1 = std::min(r0 + band_, h);
+        int first = std::max(r0 - d, 0);
+        const double *staged = &staged_[b % 2][0];
+        for (int r = 0; r != r1 - r0 + 2 * d; ++r) {
+            int i = r0 - d + r;
+            double *cells[2] = {&windows_[0][r * row_], &windows_[1][r * row_]};
+            if (i < 0 || i >= h) {
+                const double *src = i < 0 ? &halos_[TOP][(i + d) * row_]
+                                          : &halos_[BOTTOM][(i - h) * row_];
+                for (int g = 0; g != 2; ++g)
+                    std::copy(src, src + row_, cells[g]);
+                continue;
+            }
+            for (int g = 0; g != 2; ++g)
+                CopyCorners(i, cells[g]);
+            const double *src = staged + (i - first) * w;
+            std::copy(src, src + w, cells[0] + d);
+        }
+    }
+
+    // Step s of the pass over the window of band b: the cells within s - 1
+    // of the band's own rows are read, those within s rows and columns of
+    // the band are updated, except the ones beyond the global grid
+    void UpdateWindow(int b, int s) {
+        int d = depth_, w = block_width_, h = block_height_;
+        int r0 = b * band_, r1 = std::min(r0 + band_, h);
+        // Block rows and window columns to update
+        int first_row = r0 - d + s, last_row = r1 + d - s;
+        if (!mpi_wrapper_->HasNeighbor(TOP))
+            first_row = std::max(first_row, 0);
+        if (!mpi_wrapper_->HasNeighbor(BOTTOM))
+            last_row = std::min(last_row, h);
+        int first_col = mpi_wrapper_->HasNeighbor(LEFT) ? s : d;
+        int last_col = mpi_wrapper_->HasNeighbor(RIGHT) ? row_ - s : d + w;
+
+        const double coefficient = coefficient_;
+        const double *grid_in = &windows_[(s - 1) % 2][0];
+        double *grid_out = &windows_[s % 2][0];
+        for (int i = first_row; i < last_row; ++i) {
+            const double *in = grid_in + (i - r0 + d) * row_;
+            const double *above = in - row_, *below = in + row_;
+            double *out = grid_out + (i - r0 + d) * row_;
+            for (int j = first_col; j < last_col; ++j) {
+                double old_val = in[j];
+                out[j] = old_val +
+                         coefficient * (above[j] + below[j] - 2 * old_val) +
+                         coefficient * (in[j + 1] + in[j - 1] - 2 * old_val);
+            }
+        }
+    }
+
+    // Packs the rows of band b from the window into its outgoing buffer and
+    // keeps the cells of the frame edges. With a previous window, clears
+    // converged if a cell changed by more than the threshold.
+    void StoreBand(int b, const double *window, const double *previous,
+                   int *converged) {
+        int d = depth_, w = block_width_, h = block_height_;
+        int r0 = b * band_, r1 = std::min(r0 + band_, h);
+        for (int i = r0; i != r1; ++i) {
+            const double *cells = window + (i - r0 + d) * row_ + d;
+            std::copy(cells, cells + w, &outgoing_[b % 2][(i - r0) * w]);
+            if (i < d)
+                std::copy(cells, cells + w, &edges_[TOP][i * row_ + d]);
+            if (i >= h - d)
+                std::copy(cells, cells + w,
+                          &edges_[BOTTOM][(i - h + d) * row_ + d]);
+            std::copy(cells, cells + d, &edges_[LEFT][i * d]);
+            std::copy(cells + w - d, cells + w, &edges_[RIGHT][i * d]);
+            if (previous == NULL || !*converged)
+                continue;
+            const double *old = previous + (i - r0 + d) * row_ + d;
+            for (int j = 0; j != w; ++j)
+                if (!(std::fabs(cells[j] - old[j]) <= 0.001f)) {
+                    *converged = 0;
+                    break;
+                }
+        }
+    }
+
+    // Posts the read of the rows band b depends on into its staging buffer
+    int Read(int b) {
+        int r0 = b * band_, r1 = std::min(r0 + band_, block_height_);
+        int first = std::max(r0 - depth_, 0);
+        int last = std::min(r1 + depth_, block_height_);
+        return Post(&reads_[b % 2], files_[working_file_], &staged_[b % 2][0],
+                    first, last - first, false);
+    }
+
+    // Posts the write of the outgoing buffer of band b to the given file
+    int Write(int b, int file) {
+        int r0 = b * band_, r1 = std::min(r0 + band_, block_height_);
+        pending_[b % 2] = true;
+        return Post(&writes_[b % 2], file, &outgoing_[b % 2][0], r0, r1 - r0,
+                    true);
+    }
+
+    int Post(struct aiocb *cb, int file, double *buf, int first_row,
+             int rows, bool write) {
+        size_t bytes = (size_t)rows * block_width_ * sizeof(double);
+        std::memset(cb, 0, sizeof(*cb));
+        cb->aio_fildes = file;
+        cb->aio_buf = buf;
+        cb->aio_nbytes = bytes;
+        cb->aio_offset = (off_t)first_row * block_width_ * sizeof(double);
+        traffic_ += bytes;
+        if ((write ? aio_write(cb) : aio_read(cb)) == 0)
+            return 0;
+        std::perror("aio");
+        return 1;
+    }
+
+    // Waits for a posted transfer, if pending (reads always are)
+    int Complete(struct aiocb *cb, bool *pending) {
+        if (pending != NULL) {
+            if (!*pending)
+                return 0;
+            *pending = false;
+        }
+        const struct aiocb *list[1] = {cb};
+        while (aio_error(cb) == EINPROGRESS)
+            aio_suspend(list, 1, NULL);
+        if (aio_return(cb) == (ssize_t)cb->aio_nbytes)
+            return 0;
+        std::fprintf(stderr, "Worker %d: I/O error on its grid files\n",
+                     mpi_wrapper_->rank());
+        return 1;
+    }
+
+    int FrameLength(CHANNEL ch) const {
+        return (ch == LEFT || ch == RIGHT) ? block_height_ * depth_
+                                           : depth_ * row_;
+    }
+
+    int files_[2]; // Grid files, the working one and the next
+    int working_file_;
+
+    int block_height_;
+    int block_width_;
+    int band_;  // Rows per band
+    int depth_; // Steps per pass at most, and frame depth
+    int row_;   // Window row length, with the frame
+
+    std::vector<double> windows_[2];  // Band and frame, at alternate steps
+    std::vector<double> staged_[2];   // Rows read, per alternate band
+    std::vector<double> outgoing_[2]; // Rows written, per alternate band
+    struct aiocb reads_[2];
+    struct aiocb writes_[2];
+    bool pending_[2]; // Whether a write is in flight, per outgoing buffer
+
+    std::vector<double> halos_[4]; // Frame received, per channel
+    std::vector<double> edges_[4]; // Frame sent, per channel
+
+    double coefficient_; // Diffusion coefficient of the update
+    double traffic_;     // Bytes transferred to and from the files
+
+    MPIWrapper *mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(HeatFile);
+};
+
+} // namespace heat_transfer
+
+#endif // __HEAT_FILE_H_
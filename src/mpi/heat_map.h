@@ -1,90 +1,382 @@
 #ifndef __HEAT_MAP_H_
 #define __HEAT_MAP_H_
 
+#include "grid_file.h"
 #include "mpi_wrapper.h"
+#include "render.h"
+#include "statistics.h"
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <utility>
 #include <vector>
 
 namespace heat_transfer {
 
-class HeatMap {
+// A cell of the global grid, in 1-based coordinates
+struct Probe {
+    int row;
+    int col;
+};
+
+/*
+ * The diffusivity field of a checkerboard of two materials, in 8x8 squares
+ * of the global grid, the first of unit diffusivity and the second of the
+ * given one, see HeatMap::EnableDiffusivity
+ */
+struct CheckerboardDiffusivity {
+    CheckerboardDiffusivity(double diffusivity, int height, int width)
+        : diffusivity(diffusivity), height(height), width(width) {
+    }
+
+    // Of cell (row, col) of the global grid, 0-based
+    double Value(int row, int col) const {
+        return ((row * 8 / height + col * 8 / width) % 2) ? diffusivity : 1.0;
+    }
+
+    double diffusivity;
+    int height;
+    int width;
+};
+
+/*
+ * The grid block of a worker, stored as Storage and updated in Compute
+ * arithmetic. HeatMap stores and computes in double. Float storage halves the
+ * memory traffic and the halo messages (which are sent in the storage type),
+ * while double computation of a float grid avoids accumulating the rounding
+ * of each step's arithmetic.
+ */
+template <typename Storage, typename Compute = Storage> class BasicHeatMap {
   public:
-    HeatMap() : working_grid_(0), block_height_(0), block_width_(0) {
+    BasicHeatMap()
+        : working_grid_(0), pitch_(0), requested_pitch_(0), block_height_(0),
+          block_width_(0), coefficient_(0.1), tile_size_(0), updates_(0),
+          in_place_(false), max_change_(0.0), collecting_(false) {
         for (int i = 0; i != 2; ++i)
-            grids_[i] = NULL;
+            grids_[i] = buffers_[i] = NULL;
         mpi_wrapper_ = NULL;
     }
 
     /*
      * Init: Initializes the heat map (grid).
+     *
+     * A stride greater than one initializes a coarse version of the grid, each
+     * cell sampling the initial condition of the fine grid at its center.
      */
-    int Init(int block_height, int block_width, MPIWrapper *mpi_wrapper) {
+    int Init(int block_height, int block_width,
+             BasicMPIWrapper<Storage> *mpi_wrapper, int stride = 1) {
         block_height_ = block_height;
         block_width_ = block_width;
         mpi_wrapper_ = mpi_wrapper;
+        working_grid_ = 0;
 
         // Allocate space for the heat map, plus the incoming message buffers
-        // and initialize to zeroes
-        unsigned int block_size = (block_height_ + 2) * (block_width_ + 2);
+        // and initialize to zeroes. The first block cell of each row starts
+        // a cache line, and the second grid is one line further along, so
+        // that the same rows of the two grids do not share cache sets.
+        pitch_ = RowPitch();
+        mpi_wrapper_->SetRowPitch(pitch_);
+        unsigned int block_size = (block_height_ + 2) * pitch_;
         for (unsigned int g = 0; g != 2; ++g) {
-            grids_[g] = new double[block_size];
-            for (unsigned int i = 0; i != block_size; ++i)
-                grids_[g][i] = 0.0;
+            if (in_place_ && g) {
+                // A single grid, updated in place
+                grids_[g] = grids_[0];
+                break;
+            }
+            buffers_[g] = new Storage[block_size + 3 * kLine];
+            std::fill(buffers_[g], buffers_[g] + block_size + 3 * kLine,
+                      Storage(0));
+            unsigned int misalignment =
+                (reinterpret_cast<size_t>(buffers_[g] + 1) / sizeof(Storage)) %
+                kLine;
+            grids_[g] = buffers_[g] + (kLine - misalignment) % kLine +
+                        g * kLine;
+        }
+        if (in_place_) {
+            for (int k = 0; k != 2; ++k) {
+                lines_[k].resize(block_width_ + 2);
+                saved_rows_[k].resize(block_width_ + 2);
+                saved_cols_[k].resize(block_height_ + 2);
+            }
+            for (int k = 0; k != 4; ++k)
+                edges_[k].resize(1 + std::max(block_height_, block_width_));
         }
 
         // Initialize block
-        // Calculate total size and offsets
-        unsigned int x = mpi_wrapper_->topology_height() * block_height_;
-        unsigned int y = mpi_wrapper_->topology_width() * block_width_;
-        unsigned int off_x = mpi_wrapper_->topology_coord_x() * block_height_;
-        unsigned int off_y = mpi_wrapper_->topology_coord_y() * block_width_;
+        // Calculate total (fine) size and offsets
+        global_height_ =
+            mpi_wrapper_->topology_height() * block_height_ * stride;
+        global_width_ = mpi_wrapper_->topology_width() * block_width_ * stride;
+        off_x_ = mpi_wrapper_->topology_coord_x() * block_height_;
+        off_y_ = mpi_wrapper_->topology_coord_y() * block_width_;
+        mirror_ = false;
         // Fill initial values
-        for (unsigned int i = 1; i != 1 + block_height_; ++i)
+        FillInitialCondition(stride);
+
+        return 0;
+    }
+
+    /*
+     * Reset: Restores the initial condition of the full-resolution grid,
+     * reusing the allocated grids
+     */
+    int Reset() {
+        unsigned int block_size = (block_height_ + 2) * pitch_;
+        for (unsigned int g = 0; g != 2; ++g)
+            std::fill(grids_[g], grids_[g] + block_size, 0.0);
+        working_grid_ = 0;
+        FillInitialCondition(1);
+        return 0;
+    }
+
+    /*
+     * EnableMirror: Treats the grid as the top left quadrant of a grid with
+     * the given dimensions, which is symmetric about both centerlines. The
+     * bottom and right edges of the quadrant become reflective (their halos
+     * mirror the block) and the initial condition is that of the full grid.
+     */
+    int EnableMirror(int height, int width) {
+        global_height_ = height;
+        global_width_ = width;
+        mirror_ = true;
+        FillInitialCondition(1);
+        return 0;
+    }
+
+    /*
+     * ReflectHalos: Fills the halos on the symmetry axes of a mirrored grid.
+     * Call after HeatMap::WaitForMessages, before the collaborative update.
+     * When the full dimension is odd, the last row (column) of the quadrant
+     * lies on the axis, so the halo mirrors the one before it.
+     */
+    int ReflectHalos() {
+        if (!mirror_)
+            return 0;
+        double val = 0.0;
+        if (!mpi_wrapper_->HasNeighbor(BOTTOM)) {
+            unsigned int src = block_height_ - global_height_ % 2;
             for (unsigned int j = 1; j != 1 + block_width_; ++j) {
-                double val = (i + off_x) * (x - (i - 1 + off_x)) * (j + off_y) *
-                             (y - (j - 1 + off_y));
-                SetCellValue(i, j, 0, val);
+                GetCellValue(src, j, working_grid_, &val);
+                SetCellValue(block_height_ + 1, j, working_grid_, val);
             }
-
+        }
+        if (!mpi_wrapper_->HasNeighbor(RIGHT)) {
+            unsigned int src = block_width_ - global_width_ % 2;
+            for (unsigned int i = 1; i != 1 + block_height_; ++i) {
+                GetCellValue(i, src, working_grid_, &val);
+                SetCellValue(i, block_width_ + 1, working_grid_, val);
+            }
+        }
         return 0;
     }
 
     int Destroy() {
-        for (int i = 0; i != 2; ++i)
-            if (grids_[i] != NULL)
-                delete[] grids_[i];
+        for (int i = 0; i != 2; ++i) {
+            if (buffers_[i] != NULL)
+                delete[] buffers_[i]; // A single one, in place
+            grids_[i] = buffers_[i] = NULL;
+        }
         return 0;
     }
 
+    /*
+     * SetRowPitch: Sets the distance between the rows of the grids, in cells
+     * (call before HeatMap::Init). Zero, the default, chooses it: the row
+     * length with halos, rounded up to whole cache lines, plus one line when
+     * the rows would otherwise be a multiple of the page size apart (eg. on
+     * power-of-two widths), where consecutive rows fall into the same cache
+     * sets. Pitches shorter than a row give unpadded rows.
+     */
+    void SetRowPitch(unsigned int pitch) {
+        requested_pitch_ = pitch;
+    }
+
+    unsigned int row_pitch() const {
+        return pitch_;
+    }
+
+    /*
+     * SetInPlace: Selects the in-place update (call before HeatMap::Init).
+     *
+     * Instead of a second grid, the update keeps copies of the previous values
+     * of the row above and of the current row, rolling them as it sweeps down
+     * the block, so the results are identical to the two-grid update. Since
+     * the edges are only updated once the halos arrive, the interior sweep
+     * also keeps the previous values of the rows and columns next to the
+     * edges.
+     */
+    void SetInPlace(bool in_place) {
+        in_place_ = in_place;
+    }
+
+    bool in_place() const {
+        return in_place_;
+    }
+
     int ExchangeMessages() {
-        double *addr;
-        // Send/Receive LEFT
-        addr = grids_[working_grid_] + (block_width_ + 2) + 1;
-        mpi_wrapper_->Send(addr, LEFT, LEFT_SEND);
-        addr = grids_[working_grid_] + (block_width_ + 2);
-        mpi_wrapper_->Receive(addr, LEFT, LEFT_RECV);
-        // Send/Receive TOP
-        addr = grids_[working_grid_] + (block_width_ + 2) + 1;
-        mpi_wrapper_->Send(addr, TOP, UP_SEND);
-        addr = grids_[working_grid_] + 1;
-        mpi_wrapper_->Receive(addr, TOP, UP_RECV);
-        // Send/Receive RIGHT
-        addr = grids_[working_grid_] + 2 * (block_width_ + 2) - 2;
-        mpi_wrapper_->Send(addr, RIGHT, RIGHT_SEND);
-        addr = grids_[working_grid_] + 2 * (block_width_ + 2) - 1;
-        mpi_wrapper_->Receive(addr, RIGHT, RIGHT_RECV);
-        // Send/Receive BOTTOM
-        addr = grids_[working_grid_] + (block_height_ * (block_width_ + 2)) + 1;
-        mpi_wrapper_->Send(addr, BOTTOM, DOWN_SEND);
-        addr = grids_[working_grid_] +
-               ((block_height_ + 1) * (block_width_ + 2)) + 1;
-        mpi_wrapper_->Receive(addr, BOTTOM, DOWN_RECV);
+        // Send/Receive LEFT, TOP, RIGHT and BOTTOM
+        for (int c = 0; c != 4; ++c)
+            ExchangeChannel(static_cast<CHANNEL>(c), true, true);
+        return 0;
+    }
+
+    /*
+     * ExchangeCone: Exchanges the halos needed to advance the dependency cone
+     * of the probes from the given radius to the next smaller one. A halo is
+     * only sent when the receiving block has cells left to update next to it.
+     */
+    int ExchangeCone(const std::vector<Probe> &probes, int radius) {
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            int row = off_x_, col = off_y_;
+            row += (ch == TOP) ? -block_height_ : (ch == BOTTOM) ? block_height_
+                                                                 : 0;
+            col += (ch == LEFT) ? -block_width_ : (ch == RIGHT) ? block_width_
+                                                                : 0;
+            bool send = BlockInCone(row, col, probes, radius - 1) &&
+                        BlockInCone(off_x_, off_y_, probes, radius);
+            bool recv = BlockInCone(off_x_, off_y_, probes, radius - 1) &&
+                        BlockInCone(row, col, probes, radius);
+            ExchangeChannel(ch, send, recv);
+        }
+        return 0;
+    }
+
+    /*
+     * ConeUpdate: Updates only the cells of the block within the given
+     * (Manhattan) distance from a probe, returning how many were updated.
+     * The columns the cones of the probes cover on a row are merged first,
+     * so that each cell is updated once however many cones it is in.
+     */
+    unsigned int ConeUpdate(const std::vector<Probe> &probes, int radius) {
+        unsigned int updates = 0;
+        std::vector<std::pair<int, int> > columns; // First and last, per cone
+        for (unsigned int i = 1; i != 1 + block_height_; ++i) {
+            columns.clear();
+            for (unsigned int p = 0; p != probes.size(); ++p) {
+                int reach = radius - std::abs(probes[p].row - (int)i - off_x_);
+                int first = std::max(probes[p].col - reach - off_y_, 1);
+                int last = std::min(probes[p].col + reach - off_y_,
+                                    (int)block_width_);
+                if (reach >= 0 && first <= last)
+                    columns.push_back(std::make_pair(first, last));
+            }
+            std::sort(columns.begin(), columns.end());
+            int next = 1; // First column not updated yet
+            for (unsigned int k = 0; k != columns.size(); ++k) {
+                int first = std::max(columns[k].first, next);
+                for (int j = first; j <= columns[k].second; ++j)
+                    CellUpdate(i, j);
+                updates += std::max(columns[k].second - first + 1, 0);
+                next = std::max(next, columns[k].second + 1);
+            }
+        }
+        return updates;
+    }
+
+    /*
+     * ProbeValue: Gets the working grid value of a cell given in global
+     * coordinates, if it belongs to the block
+     */
+    bool ProbeValue(const Probe &probe, double *val) const {
+        int i = probe.row - off_x_, j = probe.col - off_y_;
+        if (i < 1 || i > (int)block_height_ || j < 1 || j > (int)block_width_)
+            return false;
+        GetCellValue(i, j, working_grid_, val);
+        return true;
+    }
+
+    /*
+     * StartAsyncExchange: Posts the receives of the asynchronous iteration.
+     * From then on, halos are only refreshed by HeatMap::AsyncExchange.
+     */
+    int StartAsyncExchange() {
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            sent_[ch] = received_[ch] = 0;
+            unsent_[ch] = true;
+            if (!mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            send_buf_[ch].resize(EdgeLength(ch));
+            recv_buf_[ch].resize(EdgeLength(ch));
+            mpi_wrapper_->PostReceive(&recv_buf_[ch][0], EdgeLength(ch), ch,
+                                      RecvTag(ch));
+        }
+        return 0;
+    }
+
+    /*
+     * AsyncExchange: Never blocks. Copies any halo that has arrived into both
+     * grids and reposts its receive, and sends the current edges on the
+     * channels whose previous send has completed, unless they have not been
+     * swept since they were last sent.
+     */
+    int AsyncExchange(bool swept) {
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            if (!mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            unsent_[ch] = unsent_[ch] || swept;
+            if (mpi_wrapper_->Test(ch, IN)) {
+                UnpackHalo(ch, &recv_buf_[ch][0]);
+                ++received_[ch];
+                mpi_wrapper_->PostReceive(&recv_buf_[ch][0], EdgeLength(ch), ch,
+                                          RecvTag(ch));
+            }
+            if (unsent_[ch] && mpi_wrapper_->Test(ch, OUT)) {
+                PackEdge(ch, &send_buf_[ch][0]);
+                mpi_wrapper_->PostSend(&send_buf_[ch][0], EdgeLength(ch), ch,
+                                       SendTag(ch));
+                ++sent_[ch];
+                unsent_[ch] = false;
+            }
+        }
+        return 0;
+    }
+
+    /*
+     * WaitAsyncExchange: Blocks until a halo arrives, a send of edges still
+     * to be sent completes or the non-blocking convergence reduction does,
+     * for a worker with no sweeps left to overlap them with
+     */
+    int WaitAsyncExchange() {
+        return mpi_wrapper_->WaitAny(unsent_);
+    }
+
+    /*
+     * FinishAsyncExchange: Drains the asynchronous exchange. Neighbors trade
+     * the number of messages they have sent, so that every message in flight
+     * is received and the remaining receives can be cancelled.
+     */
+    int FinishAsyncExchange() {
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            if (!mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            int expected = 0;
+            mpi_wrapper_->ExchangeCount(ch, sent_[ch], CountSendTag(ch),
+                                        CountRecvTag(ch), &expected);
+            while (received_[ch] != expected) {
+                mpi_wrapper_->Wait(ch, IN);
+                UnpackHalo(ch, &recv_buf_[ch][0]);
+                if (++received_[ch] != expected)
+                    mpi_wrapper_->PostReceive(&recv_buf_[ch][0],
+                                              EdgeLength(ch), ch, RecvTag(ch));
+            }
+            mpi_wrapper_->Cancel(ch, IN);
+            mpi_wrapper_->Wait(ch, OUT);
+        }
         return 0;
     }
 
     int CellUpdate(unsigned int i, unsigned int j) {
-        double val[4] = {0.0}; // Four values, LEFT, TOP, RIGHT, BOTTOM cell
-        double old_val = 0.0, new_val = 0.0;
+        if (!east_.empty())
+            return SweepUpdate(i, i, j, j);
+        Compute val[4] = {0}; // Four values, LEFT, TOP, RIGHT, BOTTOM cell
+        Compute old_val = 0, new_val = 0;
+        const Compute coefficient = coefficient_, two = 2;
         int wg = working_grid_, g = 1 - working_grid_;
 
         GetCellValue(i, j, wg, &old_val);
@@ -92,18 +384,26 @@ class HeatMap {
         GetCellValue(i - 1, j, wg, &val[TOP]);
         GetCellValue(i, j + 1, wg, &val[RIGHT]);
         GetCellValue(i + 1, j, wg, &val[BOTTOM]);
-        new_val = old_val + 0.1 * (val[TOP] + val[BOTTOM] - 2.0 * old_val) +
-                  0.1 * (val[RIGHT] + val[LEFT] - 2.0 * old_val);
+        new_val = old_val +
+                  coefficient * (val[TOP] + val[BOTTOM] - two * old_val) +
+                  coefficient * (val[RIGHT] + val[LEFT] - two * old_val);
         SetCellValue(i, j, g, new_val);
 
         return 0;
     }
 
     int StandaloneUpdate() {
-        for (unsigned int i = 2; i != block_height_; ++i)
-            for (unsigned int j = 2; j != block_width_; ++j)
-                CellUpdate(i, j);
-        return 0;
+        if (in_place_)
+            return InPlaceStandaloneUpdate();
+        if (!row_spans_.empty())
+            return SweepSpans(2, block_height_ - 1, 2, block_width_ - 1);
+        if (tile_size_) {
+            // Start a new step of change tracking
+            std::fill(tile_change_.begin(), tile_change_.end(), 0.0);
+            updates_ = 0;
+            return TiledUpdate(2, block_height_ - 1, 2, block_width_ - 1);
+        }
+        return SweepUpdate(2, block_height_ - 1, 2, block_width_ - 1);
     }
 
     int WaitForMessages() {
@@ -119,6 +419,34 @@ class HeatMap {
     }
 
     int CollaborativeUpdate() {
+        if (in_place_)
+            return InPlaceCollaborativeUpdate();
+        if (!row_spans_.empty()) {
+            unsigned int h = block_height_, w = block_width_;
+            SweepSpans(1, 1, 1, w);
+            SweepSpans(h, h, 1, w);
+            SweepSpans(2, h - 1, 1, 1);
+            SweepSpans(2, h - 1, w, w);
+            return 0;
+        }
+        if (tile_size_) {
+            TiledUpdate(1, 1, 1, block_width_);
+            TiledUpdate(block_height_, block_height_, 1, block_width_);
+            TiledUpdate(2, block_height_ - 1, 1, 1);
+            TiledUpdate(2, block_height_ - 1, block_width_, block_width_);
+            return 0;
+        }
+        if (collecting_) {
+            // Each edge cell once, for the statistics
+            unsigned int h = block_height_, w = block_width_;
+            SweepUpdate(1, 1, 1, w);
+            if (h > 1)
+                SweepUpdate(h, h, 1, w);
+            SweepUpdate(2, h - 1, 1, 1);
+            if (w > 1)
+                SweepUpdate(2, h - 1, w, w);
+            return 0;
+        }
         // Update top and bottom rows
         for (unsigned int j = 1; j != 1 + block_width_; ++j) {
             CellUpdate(1, j);
@@ -133,13 +461,19 @@ class HeatMap {
     }
 
     int CheckConvergence(int *converged) const {
+        if (in_place_) {
+            // The previous values are gone, use the change recorded by the
+            // update instead
+            *converged = max_change_ <= 0.001f;
+            return 0;
+        }
         double val1 = 0.0, val2 = 0.0;
         *converged = 1;
         for (unsigned int i = 1; i != 1 + block_height_; ++i)
             for (unsigned int j = 1; j != 1 + block_width_; ++j) {
                 GetCellValue(i, j, working_grid_, &val1);
                 GetCellValue(i, j, 1 - working_grid_, &val2);
-                if (std::fabs(val1 - val2) > 0.001f) {
+                if (!(std::fabs(val1 - val2) <= 0.001f)) {
                     *converged = 0;
                     return 0;
                 }
@@ -147,6 +481,322 @@ class HeatMap {
         return 0;
     }
 
+    /*
+     * EnableTiles: Splits the block into square tiles of the given size, whose
+     * cells are only updated while the tile is active. A tile is frozen when
+     * the maximum change of its cells, and of the cells of the neighboring
+     * tiles (or halos), falls below the threshold, and is reactivated as soon
+     * as one of them changes more than that.
+     */
+    int EnableTiles(unsigned int tile_size, double threshold) {
+        if ((in_place_ || !row_spans_.empty()) && tile_size)
+            return 1; // Not combined with the in-place update or a mask
+        tile_size_ = tile_size;
+        tile_threshold_ = threshold;
+        if (!tile_size_)
+            return 0; // Disabled
+        tile_rows_ = (block_height_ + tile_size_ - 1) / tile_size_;
+        tile_cols_ = (block_width_ + tile_size_ - 1) / tile_size_;
+        tile_change_.assign(tile_rows_ * tile_cols_, 0.0);
+        tile_active_.assign(tile_rows_ * tile_cols_, 1);
+        return 0;
+    }
+
+    /*
+     * EnableDiffusivity: Gives each cell the diffusivity (relative to the
+     * diffusion coefficient) of the given field, whose Value(row, col) is
+     * that of a cell of the global grid, 0-based, eg. a GridFile or a
+     * CheckerboardDiffusivity. The flux through each face is then scaled by
+     * the harmonic mean of the diffusivities of the two cells, kept per face
+     * beside the grids, with the same row length, so the update streams them
+     * along the cells. The halos of the diffusivity are exchanged once, here,
+     * so call after HeatMap::Init, on every worker. Returns non-zero if a
+     * diffusivity of the block is not positive, or if that of a face is so
+     * large that the update is unstable, ie. above 1 / (4 * coefficient).
+     */
+    template <typename Field> int EnableDiffusivity(const Field &field) {
+        if (in_place_ || mirror_)
+            return 1; // Needs the two-grid update of a whole grid
+        unsigned int row = pitch_;
+        unsigned int block_size = (block_height_ + 2) * row;
+        std::vector<Storage> cells(block_size, 0.0);
+        bool valid = true;
+        for (unsigned int i = 1; i != 1 + block_height_; ++i)
+            for (unsigned int j = 1; j != 1 + block_width_; ++j) {
+                double val = field.Value(i - 1 + off_x_, j - 1 + off_y_);
+                valid = valid && val > 0.0;
+                cells[i * row + j] = val;
+            }
+
+        // Halos from the neighbors, or the edge itself on the boundary
+        for (int c = 0; c != 4; ++c)
+            ExchangeChannel(&cells[0], static_cast<CHANNEL>(c), true, true);
+        WaitForMessages();
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            if (mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            unsigned int i, j, hi, hj;
+            for (unsigned int k = 0; k != EdgeLength(ch); ++k) {
+                EdgeCell(ch, k, false, &i, &j);
+                EdgeCell(ch, k, true, &hi, &hj);
+                cells[hi * row + hj] = cells[i * row + j];
+            }
+        }
+
+        east_.assign(block_size, 0.0);
+        south_.assign(block_size, 0.0);
+        double max_face = 0.0;
+        for (unsigned int i = 0; i != 1 + block_height_; ++i)
+            for (unsigned int j = 0; j != 1 + block_width_; ++j) {
+                unsigned int k = i * row + j;
+                if (i)
+                    east_[k] = HarmonicMean(cells[k], cells[k + 1]);
+                if (j)
+                    south_[k] = HarmonicMean(cells[k], cells[k + row]);
+                max_face = std::max(max_face, (double)east_[k]);
+                max_face = std::max(max_face, (double)south_[k]);
+            }
+        // A cell takes coefficient * (the sum of its face diffusivities) of
+        // its own value away in a step, which must not exceed all of it
+        valid = valid && 4.0 * coefficient_ * max_face <= 1.0;
+        if (!valid) {
+            east_.clear();
+            south_.clear();
+        }
+        return !valid;
+    }
+
+    /*
+     * EnableMask: Restricts the grid to the cells set in the mask, given for
+     * the global grid, row by row. The cells of the block outside it are
+     * zeroed and never updated again, so they act like the boundary, and the
+     * updates only sweep the runs of consecutive active cells of each row. A
+     * block with no cell set has nothing left to update (see
+     * HeatMap::active_cells), but the map does not leave the exchanges by
+     * itself. Call after HeatMap::Init.
+     */
+    int EnableMask(const std::vector<char> &mask) {
+        if (in_place_ || mirror_ || tile_size_ ||
+            mask.size() != (size_t)global_height_ * global_width_)
+            return 1; // Needs the two-grid update of a whole grid
+        spans_.clear();
+        row_spans_.assign(1, 0); // Row 0, the halo, has no spans
+        active_cells_ = 0;
+        for (unsigned int i = 1; i != 1 + block_height_; ++i) {
+            row_spans_.push_back(spans_.size());
+            // Mask of the row, indexed by block column
+            const char *cell =
+                &mask[0] + (i - 1 + off_x_) * global_width_ + off_y_ - 1;
+            for (unsigned int j = 1; j != 1 + block_width_; ++j) {
+                if (!cell[j]) {
+                    SetCellValue(i, j, working_grid_, 0.0);
+                    continue;
+                }
+                if (j == 1 || !cell[j - 1]) {
+                    Span span = {j, j};
+                    spans_.push_back(span);
+                }
+                spans_.back().last = j;
+                ++active_cells_;
+            }
+        }
+        row_spans_.push_back(spans_.size());
+        return 0;
+    }
+
+    /*
+     * Number of cells of the block updated at each step
+     */
+    unsigned int active_cells() const {
+        return row_spans_.empty() ? block_size() : active_cells_;
+    }
+
+    bool tiles_enabled() const {
+        return tile_size_ != 0;
+    }
+
+    /*
+     * Number of cells updated in the last step, when tiles are enabled
+     */
+    unsigned int updates() const {
+        return updates_;
+    }
+
+    /*
+     * UpdateActiveTiles: Freezes and reactivates tiles according to the
+     * changes of the last step. Call after the update, before changing grids.
+     */
+    int UpdateActiveTiles() {
+        if (!tile_size_)
+            return 0;
+        int g = 1 - working_grid_;
+        std::vector<double> change(tile_change_);
+
+        // Account for the change of the halos next to the edge tiles
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            if (!mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            unsigned int i, j;
+            double val1 = 0.0, val2 = 0.0;
+            for (unsigned int k = 0; k != EdgeLength(ch); ++k) {
+                EdgeCell(ch, k, true, &i, &j);
+                GetCellValue(i, j, working_grid_, &val1);
+                GetCellValue(i, j, g, &val2);
+                unsigned int t = Tile(std::max(std::min(i, block_height_), 1u),
+                                      std::max(std::min(j, block_width_), 1u));
+                change[t] = std::max(change[t], std::fabs(val1 - val2));
+            }
+        }
+
+        for (unsigned int ti = 0; ti != tile_rows_; ++ti)
+            for (unsigned int tj = 0; tj != tile_cols_; ++tj) {
+                unsigned int t = ti * tile_cols_ + tj;
+                double max_change = change[t];
+                if (ti)
+                    max_change = std::max(max_change, change[t - tile_cols_]);
+                if (ti + 1 != tile_rows_)
+                    max_change = std::max(max_change, change[t + tile_cols_]);
+                if (tj)
+                    max_change = std::max(max_change, change[t - 1]);
+                if (tj + 1 != tile_cols_)
+                    max_change = std::max(max_change, change[t + 1]);
+
+                bool active = max_change > tile_threshold_;
+                if (tile_active_[t] && !active) {
+                    // Freeze the tile with its latest values in both grids
+                    for (unsigned int i = ti * tile_size_ + 1;
+                         i <= std::min((ti + 1) * tile_size_, block_height_);
+                         ++i)
+                        for (unsigned int j = tj * tile_size_ + 1;
+                             j <= std::min((tj + 1) * tile_size_, block_width_);
+                             ++j) {
+                            double val = 0.0;
+                            GetCellValue(i, j, g, &val);
+                            SetCellValue(i, j, working_grid_, val);
+                        }
+                }
+                tile_active_[t] = active;
+            }
+        return 0;
+    }
+
+    /*
+     * Prolong: Fills the working grid by bilinear interpolation of a heat map
+     * with half the resolution. The halos of the coarse map must be up to date.
+     */
+    int Prolong(const BasicHeatMap &coarse) {
+        int cg = coarse.working_grid_;
+        for (unsigned int i = 1; i != 1 + block_height_; ++i)
+            for (unsigned int j = 1; j != 1 + block_width_; ++j) {
+                // Nearest coarse cell and the neighbor on the side of (i, j)
+                unsigned int ci = (i + 1) / 2, cj = (j + 1) / 2;
+                unsigned int ni = (i % 2) ? ci - 1 : ci + 1;
+                unsigned int nj = (j % 2) ? cj - 1 : cj + 1;
+                double c = 0.0, ci_n = 0.0, cj_n = 0.0, cij_n = 0.0;
+                coarse.GetCellValue(ci, cj, cg, &c);
+                coarse.GetCellValue(ni, cj, cg, &ci_n);
+                coarse.GetCellValue(ci, nj, cg, &cj_n);
+                // Corner halos are not exchanged, so extrapolate them when
+                // they lie inside the global grid
+                CHANNEL ch_i = ni ? BOTTOM : TOP, ch_j = nj ? RIGHT : LEFT;
+                bool corner = (ni == 0 || ni == coarse.block_height_ + 1) &&
+                              (nj == 0 || nj == coarse.block_width_ + 1);
+                if (corner && mpi_wrapper_->HasNeighbor(ch_i) &&
+                    mpi_wrapper_->HasNeighbor(ch_j))
+                    cij_n = ci_n + cj_n - c;
+                else
+                    coarse.GetCellValue(ni, nj, cg, &cij_n);
+                double val = (9.0 * c + 3.0 * (ci_n + cj_n) + cij_n) / 16.0;
+                SetCellValue(i, j, working_grid_, val);
+            }
+        return 0;
+    }
+
+    /*
+     * CopyBlock: Copies the block cells (no halos) of the working grid into
+     * buf, row by row
+     */
+    int CopyBlock(double *buf) const {
+        for (unsigned int i = 1; i != 1 + block_height_; ++i) {
+            const Storage *row = grids_[working_grid_] + i * pitch_ + 1;
+            buf = std::copy(row, row + block_width_, buf);
+        }
+        return 0;
+    }
+
+    /*
+     * CollectStatistics: With collect set, makes the updates accumulate the
+     * statistics of the new values of the block as they sweep it, from the
+     * next step on, see HeatMap::statistics. Only the plain update of a
+     * whole grid does; returns non-zero for any other.
+     */
+    int CollectStatistics(bool collect) {
+        if (collect && (in_place_ || mirror_ || tile_size_ ||
+                        !row_spans_.empty() || !east_.empty()))
+            return 1;
+        collecting_ = collect;
+        statistics_ = GridStatistics();
+        return 0;
+    }
+
+    /*
+     * The statistics of the block collected since
+     * HeatMap::CollectStatistics
+     */
+    const GridStatistics &statistics() const {
+        return statistics_;
+    }
+
+    /*
+     * DownsampleBlock: Adds the block cells of the working grid to the tile
+     * of the given renderer, row by row
+     */
+    int DownsampleBlock(Renderer *renderer) const {
+        for (unsigned int i = 0; i != block_height_; ++i)
+            renderer->AddRow(i, grids_[working_grid_] + (i + 1) * pitch_ + 1);
+        return 0;
+    }
+
+    /*
+     * LoadBlock: Overwrites the block cells of the working grid with buf,
+     * which is laid out as in HeatMap::CopyBlock
+     */
+    int LoadBlock(const double *buf) {
+        for (unsigned int i = 1; i != 1 + block_height_; ++i)
+            for (unsigned int j = 1; j != 1 + block_width_; ++j)
+                SetCellValue(i, j, working_grid_, *buf++);
+        return 0;
+    }
+
+    /*
+     * LoadInitialCondition: Overwrites the block cells of the working grid
+     * with those of the global grid in the given file, copying them row by
+     * row from its mapping
+     */
+    int LoadInitialCondition(const GridFile &file) {
+        file.WillRead(off_x_, block_height_);
+        for (unsigned int i = 0; i != block_height_; ++i) {
+            const double *src = file.Row(off_x_ + i) + off_y_;
+            std::copy(src, src + block_width_,
+                      grids_[working_grid_] + (i + 1) * pitch_ + 1);
+        }
+        return 0;
+    }
+
+    /*
+     * SetCoefficient: Sets the diffusion coefficient of the update, ie. the
+     * time step in units of h^2 / alpha (stable up to 0.25)
+     */
+    void SetCoefficient(double coefficient) {
+        coefficient_ = coefficient;
+    }
+
+    unsigned int block_size() const {
+        return block_height_ * block_width_;
+    }
+
     void ExchangeGrids() {
         working_grid_ = 1 - working_grid_;
     }
@@ -170,8 +820,363 @@ class HeatMap {
     }
 
   private:
-    int GetCellValue(unsigned int i, unsigned int j, int grid,
-                     double *val) const {
+    int InPlaceStandaloneUpdate() {
+        Storage *grid = grids_[0];
+        unsigned int row = pitch_, length = block_width_ + 2;
+        Storage *prev = &lines_[0][0], *cur = &lines_[1][0];
+        const Compute coefficient = coefficient_, two = 2;
+        max_change_ = 0;
+        std::copy(grid + row, grid + row + length, prev);
+        for (unsigned int i = 2; i < block_height_; ++i) {
+            Storage *line = grid + i * row;
+            const Storage *below = line + row; // Not updated yet
+            std::copy(line, line + length, cur);
+            // Keep what the edge update will need
+            if (i == 2)
+                saved_rows_[0].assign(cur, cur + length);
+            if (i == block_height_ - 1)
+                saved_rows_[1].assign(cur, cur + length);
+            saved_cols_[0][i] = cur[2];
+            saved_cols_[1][i] = cur[block_width_ - 1];
+
+            for (unsigned int j = 2; j < block_width_; ++j) {
+                Compute old_val = cur[j];
+                Compute new_val =
+                    old_val +
+                    coefficient * (prev[j] + below[j] - two * old_val) +
+                    coefficient * (cur[j + 1] + cur[j - 1] - two * old_val);
+                max_change_ =
+                    std::max(max_change_, Change(old_val, new_val));
+                line[j] = new_val;
+            }
+            std::swap(prev, cur);
+        }
+        return 0;
+    }
+
+    int InPlaceCollaborativeUpdate() {
+        unsigned int h = block_height_, w = block_width_;
+        // Compute all the edges from previous values, then write them
+        for (unsigned int j = 1; j != 1 + w; ++j) {
+            edges_[TOP][j] = InPlaceCellUpdate(1, j);
+            edges_[BOTTOM][j] = InPlaceCellUpdate(h, j);
+        }
+        for (unsigned int i = 1; i != 1 + h; ++i) {
+            edges_[LEFT][i] = InPlaceCellUpdate(i, 1);
+            edges_[RIGHT][i] = InPlaceCellUpdate(i, w);
+        }
+        for (unsigned int j = 1; j != 1 + w; ++j) {
+            SetCellValue(1, j, 0, edges_[TOP][j]);
+            SetCellValue(h, j, 0, edges_[BOTTOM][j]);
+        }
+        for (unsigned int i = 1; i != 1 + h; ++i) {
+            SetCellValue(i, 1, 0, edges_[LEFT][i]);
+            SetCellValue(i, w, 0, edges_[RIGHT][i]);
+        }
+        return 0;
+    }
+
+    // New value of an edge cell, after the in-place interior sweep
+    Compute InPlaceCellUpdate(unsigned int i, unsigned int j) {
+        const Compute coefficient = coefficient_, two = 2;
+        Compute old_val = PreviousValue(i, j);
+        Compute new_val =
+            old_val +
+            coefficient * (PreviousValue(i - 1, j) + PreviousValue(i + 1, j) -
+                           two * old_val) +
+            coefficient * (PreviousValue(i, j + 1) + PreviousValue(i, j - 1) -
+                           two * old_val);
+        max_change_ = std::max(max_change_, Change(old_val, new_val));
+        return new_val;
+    }
+
+    // Value of a cell before the in-place interior sweep
+    Compute PreviousValue(unsigned int i, unsigned int j) const {
+        if (i >= 2 && i < block_height_ && j >= 2 && j < block_width_) {
+            // Overwritten by the sweep
+            if (i == 2)
+                return saved_rows_[0][j];
+            if (i == block_height_ - 1)
+                return saved_rows_[1][j];
+            if (j == 2)
+                return saved_cols_[0][i];
+            return saved_cols_[1][i];
+        }
+        return grids_[0][i * pitch_ + j];
+    }
+
+    // Fills the working grid with the initial condition of the global grid,
+    // sampled at the cell centers of a grid coarsened by stride
+    void FillInitialCondition(int stride) {
+        double x = global_height_, y = global_width_;
+        for (unsigned int i = 1; i != 1 + block_height_; ++i)
+            for (unsigned int j = 1; j != 1 + block_width_; ++j) {
+                // Fine grid coordinates of the cell center
+                double fi = (i - 1.0 + off_x_) * stride + (stride + 1) / 2.0;
+                double fj = (j - 1.0 + off_y_) * stride + (stride + 1) / 2.0;
+                double val = fi * (x - (fi - 1)) * fj * (y - (fj - 1));
+                SetCellValue(i, j, working_grid_, val);
+            }
+    }
+
+    /*
+     * Updates the cells of the given (inclusive) range row by row, with the
+     * rows of the grids, and of the face diffusivities if enabled, addressed
+     * directly. Gives the same results as HeatMap::CellUpdate.
+     */
+    int SweepUpdate(unsigned int first_row, unsigned int last_row,
+                    unsigned int first_col, unsigned int last_col) {
+        unsigned int row = pitch_;
+        const Compute coefficient = coefficient_, two = 2;
+        for (unsigned int i = first_row; i <= last_row; ++i) {
+            const Storage *in = grids_[working_grid_] + i * row;
+            const Storage *above = in - row, *below = in + row;
+            Storage *out = grids_[1 - working_grid_] + i * row;
+            if (east_.empty() && collecting_) {
+                CollectingRowUpdate(i, first_col, last_col);
+                continue;
+            }
+            if (east_.empty()) {
+                for (unsigned int j = first_col; j <= last_col; ++j) {
+                    Compute old_val = in[j];
+                    out[j] = old_val +
+                             coefficient * ((Compute)above[j] + below[j] -
+                                            two * old_val) +
+                             coefficient * ((Compute)in[j + 1] + in[j - 1] -
+                                            two * old_val);
+                }
+                continue;
+            }
+            // Faces to the east and south of each cell of the row, and to the
+            // south of each cell of the row above
+            const Storage *east = &east_[i * row];
+            const Storage *south = &south_[i * row];
+            const Storage *north = south - row;
+            for (unsigned int j = first_col; j <= last_col; ++j) {
+                Compute old_val = in[j];
+                out[j] = old_val +
+                         coefficient * (north[j] * (above[j] - old_val) +
+                                        south[j] * (below[j] - old_val)) +
+                         coefficient * (east[j] * (in[j + 1] - old_val) +
+                                        east[j - 1] * (in[j - 1] - old_val));
+            }
+        }
+        return 0;
+    }
+
+    // Updates a row of a uniform grid as HeatMap::SweepUpdate does, and
+    // accumulates the statistics of the new values on the way
+    void CollectingRowUpdate(unsigned int i, unsigned int first_col,
+                             unsigned int last_col) {
+        unsigned int row = pitch_;
+        const Compute coefficient = coefficient_, two = 2;
+        const Storage *in = grids_[working_grid_] + i * row;
+        const Storage *above = in - row, *below = in + row;
+        Storage *out = grids_[1 - working_grid_] + i * row;
+        double sum = 0.0, min = DBL_MAX, max = -DBL_MAX;
+        unsigned int max_col = first_col;
+        for (unsigned int j = first_col; j <= last_col; ++j) {
+            Compute old_val = in[j];
+            Storage val = old_val +
+                          coefficient * ((Compute)above[j] + below[j] -
+                                         two * old_val) +
+                          coefficient * ((Compute)in[j + 1] + in[j - 1] -
+                                         two * old_val);
+            out[j] = val;
+            sum += val;
+            min = std::min(min, (double)val);
+            if (val > max) {
+                max = val;
+                max_col = j;
+            }
+        }
+        GridStatistics statistics;
+        statistics.cells = last_col - first_col + 1;
+        statistics.sum = sum;
+        statistics.min = min;
+        statistics.max = max;
+        statistics.max_row = off_x_ + i - 1;
+        statistics.max_col = off_y_ + max_col - 1;
+        statistics_.Combine(statistics);
+    }
+
+    // Updates the active cells of the given (inclusive) range, see
+    // HeatMap::EnableMask
+    int SweepSpans(unsigned int first_row, unsigned int last_row,
+                   unsigned int first_col, unsigned int last_col) {
+        for (unsigned int i = first_row; i <= last_row; ++i)
+            for (unsigned int s = row_spans_[i]; s != row_spans_[i + 1]; ++s) {
+                unsigned int first = std::max(spans_[s].first, first_col);
+                unsigned int last = std::min(spans_[s].last, last_col);
+                if (first <= last)
+                    SweepUpdate(i, i, first, last);
+            }
+        return 0;
+    }
+
+    // The row pitch to use, see HeatMap::SetRowPitch
+    unsigned int RowPitch() const {
+        unsigned int length = block_width_ + 2;
+        if (requested_pitch_)
+            return std::max(requested_pitch_, length);
+        unsigned int pitch = (length + kLine - 1) / kLine * kLine;
+        if (!(pitch * sizeof(Storage) % kPage))
+            pitch += kLine;
+        return pitch;
+    }
+
+    // The change of a cell, infinite once it is not finite, so that the
+    // maximum change does not drop it as it would a NaN
+    static Compute Change(Compute old_val, Compute new_val) {
+        Compute change = std::fabs(new_val - old_val);
+        return change <= std::numeric_limits<Compute>::max()
+                   ? change
+                   : std::numeric_limits<Compute>::infinity();
+    }
+
+    static Storage HarmonicMean(Storage a, Storage b) {
+        return 2 * a * b / (a + b);
+    }
+
+    unsigned int Tile(unsigned int i, unsigned int j) const {
+        return ((i - 1) / tile_size_) * tile_cols_ + (j - 1) / tile_size_;
+    }
+
+    // Updates the cells of the given (inclusive) range that belong to active
+    // tiles, recording the maximum change per tile
+    int TiledUpdate(unsigned int first_row, unsigned int last_row,
+                    unsigned int first_col, unsigned int last_col) {
+        int g = 1 - working_grid_;
+        for (unsigned int ti = 0; ti != tile_rows_; ++ti)
+            for (unsigned int tj = 0; tj != tile_cols_; ++tj) {
+                unsigned int t = ti * tile_cols_ + tj;
+                if (!tile_active_[t])
+                    continue;
+                unsigned int i0 = std::max(ti * tile_size_ + 1, first_row);
+                unsigned int i1 = std::min((ti + 1) * tile_size_, last_row);
+                unsigned int j0 = std::max(tj * tile_size_ + 1, first_col);
+                unsigned int j1 = std::min((tj + 1) * tile_size_, last_col);
+                for (unsigned int i = i0; i <= i1; ++i)
+                    for (unsigned int j = j0; j <= j1; ++j) {
+                        double old_val = 0.0, new_val = 0.0;
+                        CellUpdate(i, j);
+                        GetCellValue(i, j, working_grid_, &old_val);
+                        GetCellValue(i, j, g, &new_val);
+                        double change = std::fabs(new_val - old_val);
+                        tile_change_[t] = std::max(tile_change_[t], change);
+                        ++updates_;
+                    }
+            }
+        return 0;
+    }
+
+    int ExchangeChannel(CHANNEL ch, bool send, bool recv) {
+        return ExchangeChannel(grids_[working_grid_], ch, send, recv);
+    }
+
+    // Exchanges the edge of an array laid out as the grids
+    int ExchangeChannel(Storage *grid, CHANNEL ch, bool send, bool recv) {
+        unsigned int row = pitch_;
+        Storage *send_addr = NULL, *recv_addr = NULL;
+        switch (ch) {
+        case LEFT:
+            send_addr = grid + row + 1;
+            recv_addr = grid + row;
+            break;
+        case TOP:
+            send_addr = grid + row + 1;
+            recv_addr = grid + 1;
+            break;
+        case RIGHT:
+            send_addr = grid + row + block_width_;
+            recv_addr = grid + row + block_width_ + 1;
+            break;
+        case BOTTOM:
+            send_addr = grid + block_height_ * row + 1;
+            recv_addr = grid + (block_height_ + 1) * row + 1;
+            break;
+        }
+        if (send)
+            mpi_wrapper_->Send(send_addr, ch, SendTag(ch));
+        if (recv)
+            mpi_wrapper_->Receive(recv_addr, ch, RecvTag(ch));
+        return 0;
+    }
+
+    // Whether a block at the given global offsets has cells within the given
+    // distance from a probe
+    bool BlockInCone(int off_x, int off_y, const std::vector<Probe> &probes,
+                     int radius) const {
+        for (unsigned int p = 0; p != probes.size(); ++p) {
+            int dx = std::max(0, std::max(off_x + 1 - probes[p].row,
+                                          probes[p].row - off_x -
+                                              (int)block_height_));
+            int dy = std::max(0, std::max(off_y + 1 - probes[p].col,
+                                          probes[p].col - off_y -
+                                              (int)block_width_));
+            if (dx + dy <= radius)
+                return true;
+        }
+        return false;
+    }
+
+    static int SendTag(CHANNEL ch) {
+        static const int tags[4] = {LEFT_SEND, UP_SEND, RIGHT_SEND, DOWN_SEND};
+        return tags[ch];
+    }
+
+    static int RecvTag(CHANNEL ch) {
+        static const int tags[4] = {LEFT_RECV, UP_RECV, RIGHT_RECV, DOWN_RECV};
+        return tags[ch];
+    }
+
+    static int CountSendTag(CHANNEL ch) {
+        static const int tags[4] = {LEFT_COUNT_SEND, UP_COUNT_SEND,
+                                    RIGHT_COUNT_SEND, DOWN_COUNT_SEND};
+        return tags[ch];
+    }
+
+    static int CountRecvTag(CHANNEL ch) {
+        static const int tags[4] = {LEFT_COUNT_RECV, UP_COUNT_RECV,
+                                    RIGHT_COUNT_RECV, DOWN_COUNT_RECV};
+        return tags[ch];
+    }
+
+    unsigned int EdgeLength(CHANNEL ch) const {
+        return (ch == LEFT || ch == RIGHT) ? block_height_ : block_width_;
+    }
+
+    // Block cell k of the edge on channel ch, or of its halo
+    void EdgeCell(CHANNEL ch, unsigned int k, bool halo, unsigned int *i,
+                  unsigned int *j) const {
+        unsigned int first = halo ? 0 : 1;
+        unsigned int last_row = halo ? block_height_ + 1 : block_height_;
+        unsigned int last_col = halo ? block_width_ + 1 : block_width_;
+        *i = (ch == TOP) ? first : (ch == BOTTOM) ? last_row : k + 1;
+        *j = (ch == LEFT) ? first : (ch == RIGHT) ? last_col : k + 1;
+    }
+
+    void PackEdge(CHANNEL ch, Storage *buf) const {
+        unsigned int i, j;
+        for (unsigned int k = 0; k != EdgeLength(ch); ++k) {
+            EdgeCell(ch, k, false, &i, &j);
+            GetCellValue(i, j, working_grid_, buf + k);
+        }
+    }
+
+    void UnpackHalo(CHANNEL ch, const Storage *buf) {
+        unsigned int i, j;
+        for (unsigned int k = 0; k != EdgeLength(ch); ++k) {
+            EdgeCell(ch, k, true, &i, &j);
+            SetCellValue(i, j, 0, buf[k]);
+            SetCellValue(i, j, 1, buf[k]);
+        }
+    }
+
+    // Cell values are read and written in any arithmetic type V, converting
+    // from and to the storage type
+    template <typename V>
+    int GetCellValue(unsigned int i, unsigned int j, int grid, V *val) const {
         // Out of bounds
         if (!(i < block_height_ + 2) || i < 0 || !(j < block_width_ + 2) ||
             j < 0)
@@ -179,13 +1184,13 @@ class HeatMap {
         // Invalid grid specifier
         if (grid < 0 || grid > 1)
             return 1;
-        double *gridp = grids_[grid];
-        *val = *(gridp + i * (block_width_ + 2) + j); // *val = grid[i][j]
+        Storage *gridp = grids_[grid];
+        *val = *(gridp + i * pitch_ + j); // *val = grid[i][j]
         return 0;
     }
 
-    int SetCellValue(unsigned int i, unsigned int j, int grid,
-                     double val) const {
+    template <typename V>
+    int SetCellValue(unsigned int i, unsigned int j, int grid, V val) const {
         // Out of bounds
         if (!(i < block_height_ + 2) || i < 0 || !(j < block_width_ + 2) ||
             j < 0)
@@ -193,21 +1198,78 @@ class HeatMap {
         // Invalid grid specifier
         if (grid < 0 || grid > 1)
             return 1;
-        double *gridp = grids_[grid];
-        *(gridp + i * (block_width_ + 2) + j) = val; // grid[i][j] = val
+        Storage *gridp = grids_[grid];
+        // grid[i][j] = val
+        *(gridp + i * pitch_ + j) = static_cast<Storage>(val);
         return 0;
     }
 
     // Two maps (ie. grids),
-    double *grids_[2]; // which are used interchangeably at each time step
-    int working_grid_; // Working grid indicator
+    Storage *grids_[2];   // which are used interchangeably at each time step
+    int working_grid_;    // Working grid indicator
+    Storage *buffers_[2]; // Allocations of the grids
+
+    // Row pitch, see HeatMap::SetRowPitch
+    enum { kLine = 64 / sizeof(Storage), kPage = 4096 }; // In cells, bytes
+    unsigned int pitch_;
+    unsigned int requested_pitch_;
 
     unsigned int block_height_;
     unsigned int block_width_;
+    int off_x_;         // Global row offset of the block
+    int off_y_;         // Global column offset of the block
+    int global_height_; // Global (fine) grid height
+    int global_width_;  // Global (fine) grid width
+    bool mirror_;       // Whether the grid is a mirrored quadrant
 
-    MPIWrapper *mpi_wrapper_;
+    double coefficient_; // Diffusion coefficient of the update
+
+    // Active-region tracking, see HeatMap::EnableTiles
+    unsigned int tile_size_; // Tile side, zero when disabled
+    unsigned int tile_rows_;
+    unsigned int tile_cols_;
+    double tile_threshold_;
+    std::vector<double> tile_change_; // Maximum change per tile in last step
+    std::vector<char> tile_active_;
+    unsigned int updates_; // Cells updated in the last step
+
+    // In-place update, see HeatMap::SetInPlace
+    bool in_place_;
+    Compute max_change_;                 // Maximum change in the last step
+    std::vector<Storage> lines_[2];      // Rolling previous rows
+    std::vector<Storage> saved_rows_[2]; // Previous rows 2 and height - 1
+    std::vector<Storage> saved_cols_[2]; // Previous columns 2 and width - 1
+    std::vector<Storage> edges_[4];      // New edge values, per channel
+
+    // Face diffusivities, see HeatMap::EnableDiffusivity, empty when disabled
+    std::vector<Storage> east_;  // Of the face to the right of each cell
+    std::vector<Storage> south_; // Of the face below each cell
+
+    // Statistics of the new values, see HeatMap::CollectStatistics
+    bool collecting_;
+    GridStatistics statistics_;
+
+    // Domain mask, see HeatMap::EnableMask, empty when disabled
+    struct Span {
+        unsigned int first; // First and last column of a run of active
+        unsigned int last;  // cells
+    };
+    std::vector<Span> spans_;             // Of all the rows, in order
+    std::vector<unsigned int> row_spans_; // First span of each row, and end
+    unsigned int active_cells_;
+
+    // Asynchronous exchange buffers and message counters, per channel
+    std::vector<Storage> send_buf_[4];
+    std::vector<Storage> recv_buf_[4];
+    int sent_[4];
+    int received_[4];
+    bool unsent_[4]; // Whether the edges were swept since they were sent
+
+    BasicMPIWrapper<Storage> *mpi_wrapper_;
 };
 
+typedef BasicHeatMap<double> HeatMap;
+
 } // namespace heat_transfer
 
 #endif // __HEAT_MAP_H_
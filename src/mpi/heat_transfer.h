@@ -2,30 +2,315 @@
 #define __HEAT_TRANSFER_H_
 
 #include "heat_map.h"
+#include "layout.h"
 #include "macros.h"
 #include "mpi_wrapper.h"
+#include "render.h"
+#include "snapshot.h"
+#include "stencil.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
 
 namespace heat_transfer {
 
-class HeatTransfer {
+/*
+ * The simulation on a grid stored as Storage and updated in Compute
+ * arithmetic, see BasicHeatMap. HeatTransfer runs in double precision.
+ */
+template <typename Storage, typename Compute = Storage>
+class BasicHeatTransfer {
   public:
-    HeatTransfer() {
+    BasicHeatTransfer()
+        : iterations_(0), elapsed_(0.0), active_cells_(0.0), out_(stdout),
+          errors_(stderr), tile_updates_(0.0), outputs_failed_(false),
+          first_step_(0), checkpoint_interval_(0), checkpoints_(0),
+          checkpoint_time_(0.0),
+          snapshot_interval_(0), snapshots_(0), snapshot_time_(0.0),
+          render_interval_(0), render_time_(0.0), statistics_file_(NULL),
+          statistics_interval_(0), statistics_records_(0),
+          statistics_step_time_(0.0), plain_step_time_(0.0) {
     }
 
-    int Init(int height, int width, int steps) {
-        steps_ = steps;
+    /*
+     * With mirror set, only the top left quadrant of the (symmetric) grid is
+     * simulated, see HeatMap::EnableMirror
+     */
+    int Init(int height, int width, int steps, bool mirror = false) {
         mpi_wrapper_.Init();
+        return Setup(height, width, steps, mirror);
+    }
 
-        // Create cartesian topology
-        mpi_wrapper_.CreateTopology(height, width);
+    /*
+     * Selects the in-place update of HeatMap::SetInPlace, which halves the
+     * memory of the grids. Call before Init.
+     */
+    void SetInPlace(bool in_place) {
+        heat_map_.SetInPlace(in_place);
+    }
 
-        // Initialize heat map for worker
-        heat_map_.Init(mpi_wrapper_.block_height(), mpi_wrapper_.block_width(),
-                       &mpi_wrapper_);
+    /*
+     * Sets the row pitch of the grids, see HeatMap::SetRowPitch. Call before
+     * Init.
+     */
+    void SetRowPitch(unsigned int pitch) {
+        heat_map_.SetRowPitch(pitch);
+    }
+
+    /*
+     * With reorder unset, the workers keep their ranks in the topology, so
+     * that its root is the first worker of the communicator, see
+     * MPIWrapper::SetReorder. Call before Init.
+     */
+    void SetReorder(bool reorder) {
+        mpi_wrapper_.SetReorder(reorder);
+    }
+
+    /*
+     * Runs the simulation on the workers of the given communicator, within an
+     * already initialized MPI
+     */
+    int InitWithCommunicator(MPI_Comm comm, int height, int width, int steps) {
+        mpi_wrapper_.Init(comm);
+        return Setup(height, width, steps, false);
+    }
+
+    /*
+     * Prepares a new simulation on the same workers. The topology and the
+     * grids are reused when the dimensions match the previous simulation's,
+     * in which case true is returned.
+     */
+    bool Reset(int height, int width, int steps) {
+        steps_ = steps;
+        if (height == height_ && width == width_ && !mirror_) {
+            heat_map_.Reset();
+            return true;
+        }
+        heat_map_.Destroy();
+        Setup(height, width, steps, false);
+        return false;
+    }
+
+    /*
+     * Sets the stream the root worker reports to (stdout by default)
+     */
+    void SetOutput(FILE *fp) {
+        out_ = fp;
+    }
+
+    /*
+     * Sets the stream the root worker reports errors to (stderr by default)
+     */
+    void SetErrorOutput(FILE *fp) {
+        errors_ = fp;
+    }
+
+    /*
+     * Enables active-region tracking in tiles of the given size, see
+     * HeatMap::EnableTiles, or disables it with a size of zero
+     */
+    int EnableTiles(int tile_size, double threshold) {
+        if (tile_size < 0) {
+            mpi_wrapper_.PrintRoot(errors_, "Invalid tile size %d\n",
+                                   tile_size);
+            return 1;
+        }
+        if (heat_map_.EnableTiles(tile_size, threshold)) {
+            mpi_wrapper_.PrintRoot(errors_, "Tiles need the two-grid update "
+                                            "of an unmasked grid\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    /*
+     * Selects the encoding of the halos, see MPIWrapper::SetHaloCodec. Call
+     * after Init.
+     */
+    int SetHaloCodec(HALO_CODEC codec, double error_bound) {
+        return mpi_wrapper_.SetHaloCodec(codec, error_bound);
+    }
+
+    /*
+     * Gives the grid cells the diffusivities of the given field, see
+     * HeatMap::EnableDiffusivity. Call after Init.
+     */
+    template <typename Field> int EnableDiffusivity(const Field &field) {
+        double local_err = heat_map_.EnableDiffusivity(field), err = 0.0;
+        mpi_wrapper_.ReduceMax(&local_err, &err);
+        return err != 0.0;
+    }
+
+    /*
+     * Gives the grid cells the diffusivities in the grid file at path (see
+     * grid_file.h), which every worker maps to read its own cells from. Call
+     * after Init.
+     */
+    int LoadDiffusivity(const std::string &path) {
+        GridFile file;
+        if (OpenGridFile(path, &file))
+            return 1;
+        return EnableDiffusivity(file);
+    }
+
+    /*
+     * Restricts the simulation to the cells set in the mask of the global
+     * grid, see HeatMap::EnableMask. The workers whose blocks have no cells
+     * set leave the communicator of the topology (see
+     * MPIWrapper::ExcludeIdle): their neighbors keep zero halos on their
+     * side, and they return from HeatTransfer::Run and
+     * HeatTransfer::WriteGrid at once, their blocks written as zeros. Call
+     * after Init.
+     */
+    int EnableMask(const std::vector<char> &mask) {
+        int local_err = heat_map_.EnableMask(mask), err = 0;
+        mpi_wrapper_.ReduceConvergenceCheck(&local_err, &err);
+        double local_cells = heat_map_.active_cells(), cells = 0.0;
+        mpi_wrapper_.ReduceSum(&local_cells, &cells);
+        if (err || cells == 0.0) {
+            mpi_wrapper_.PrintRoot(errors_, "Invalid or empty mask\n");
+            return 1;
+        }
+        int workers = mpi_wrapper_.topology_size();
+        mpi_wrapper_.PrintRoot(out_,
+                               "Active cells: %.0f (%.1f%% of the grid)\n",
+                               cells, 100.0 * cells / GlobalCells());
+        mpi_wrapper_.ExcludeIdle(heat_map_.active_cells() != 0);
+        if (mpi_wrapper_.active())
+            mpi_wrapper_.PrintRoot(out_, "Active workers: %d of %d\n",
+                                   mpi_wrapper_.topology_size(), workers);
         return 0;
     }
 
+    /*
+     * Saves the grid and the step reached to a checkpoint at path every
+     * interval steps of HeatTransfer::Run, see MPIWrapper::StartCheckpoint.
+     * Each checkpoint is written in the background while the next steps run.
+     * Returns non-zero if the checkpoint cannot be written at path.
+     */
+    int EnableCheckpoints(const std::string &path, int interval) {
+        if (mpi_wrapper_.ProbeCheckpoint(path.c_str()))
+            return 1;
+        checkpoint_path_ = path;
+        checkpoint_interval_ = interval;
+        return 0;
+    }
+
+    /*
+     * Replaces the initial condition with the grid in the file at path (see
+     * grid_file.h), which every worker maps to copy its own rows from. Call
+     * after Init.
+     */
+    int LoadInitialCondition(const std::string &path) {
+        double time_start = MPI_Wtime(), local_time, global_time;
+        GridFile file;
+        if (OpenGridFile(path, &file))
+            return 1;
+        heat_map_.LoadInitialCondition(file);
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        double bytes = GlobalCells() * sizeof(double);
+        mpi_wrapper_.PrintRoot(out_,
+                               "Initial condition: %.1f MB in %.3f sec "
+                               "(%.0f MB/s)\n",
+                               bytes / 1e6, global_time,
+                               bytes / global_time / 1e6);
+        return 0;
+    }
+
+    /*
+     * Writes a snapshot of the grid every interval steps of
+     * HeatTransfer::Run, to a file per worker, see SnapshotWriter, encoded
+     * with the given codec, see SnapshotCodec. Call after Init.
+     */
+    int EnableSnapshots(const std::string &prefix, int interval,
+                        SNAPSHOT_CODEC codec, double error_bound) {
+        double local_err =
+            snapshot_writer_.Init(prefix, mpi_wrapper_, codec, error_bound);
+        double err = 0.0;
+        mpi_wrapper_.ReduceMax(&local_err, &err);
+        snapshot_interval_ = err ? 0 : interval;
+        return err != 0.0;
+    }
+
+    /*
+     * Renders the grid every interval steps of HeatTransfer::Run, into
+     * images of the given resolution, see Renderer. Call after Init.
+     */
+    int EnableRendering(const std::string &prefix, int interval,
+                        int image_height, int image_width) {
+        render_interval_ = interval;
+        return renderer_.Init(prefix, image_height, image_width,
+                              mpi_wrapper_);
+    }
+
+    /*
+     * Records the statistics of the grid (see GridStatistics) every interval
+     * steps of HeatTransfer::Run, a line per step in the file at path, from
+     * the update of that step and a single reduction. Call after Init.
+     */
+    int EnableStatistics(const std::string &path, int interval) {
+        // Whether the update can collect them
+        if (heat_map_.CollectStatistics(true)) {
+            mpi_wrapper_.PrintRoot(errors_, "Statistics need the plain "
+                                            "update of a whole grid\n");
+            return 1;
+        }
+        heat_map_.CollectStatistics(false);
+        int err = 0;
+        if (!mpi_wrapper_.rank()) {
+            statistics_file_ = std::fopen(path.c_str(), "w");
+            if (statistics_file_ == NULL) {
+                std::fprintf(stderr, "Cannot open %s for writing\n",
+                             path.c_str());
+                err = 1;
+            } else {
+                std::fprintf(statistics_file_, "# step energy min max mean "
+                                               "max_row max_col\n");
+            }
+        }
+        mpi_wrapper_.Broadcast(&err, 1);
+        statistics_interval_ = err ? 0 : interval;
+        return err;
+    }
+
+    /*
+     * Resumes from a checkpoint, which may have been taken on any number of
+     * workers: its grid replaces the initial condition and HeatTransfer::Run
+     * continues from its step, with the results of an uninterrupted run.
+     * Call after Init.
+     */
+    int Restart(const std::string &path) {
+        std::vector<double> block(heat_map_.block_size());
+        int step = 0;
+        if (mpi_wrapper_.ReadCheckpoint(path.c_str(), &block[0], &step))
+            return 1;
+        heat_map_.LoadBlock(&block[0]);
+        first_step_ = step;
+        mpi_wrapper_.PrintRoot(out_, "Restarted from step %d of %s\n", step,
+                               path.c_str());
+        return 0;
+    }
+
+    /*
+     * Cell updates per second of the last HeatTransfer::Run
+     */
+    double throughput() const {
+        return elapsed_ > 0.0 ? iterations_ * active_cells_ / elapsed_ : 0.0;
+    }
+
+    // Row pitch of the worker's grids, in cells
+    unsigned int row_pitch() const {
+        return heat_map_.row_pitch();
+    }
+
     int Destroy() {
+        if (statistics_file_ != NULL)
+            std::fclose(statistics_file_);
+        statistics_file_ = NULL;
+        snapshot_writer_.Destroy();
         mpi_wrapper_.Destroy();
         heat_map_.Destroy();
         return 0;
@@ -36,8 +321,11 @@ class HeatTransfer {
      */
     int Run() {
         double mpi_time_start, mpi_time_end, local_time, global_time;
-        int converged_local = 0, converged_global = 0;
-        int convergence_check = std::sqrt(steps_);
+        double local_cells = heat_map_.active_cells();
+
+        // Workers excluded by a mask have nothing to do
+        if (!mpi_wrapper_.active())
+            return 0;
 
         // Wait until all workers reach this point
         mpi_wrapper_.Barrier();
@@ -46,59 +334,815 @@ class HeatTransfer {
         mpi_time_start = MPI_Wtime();
 
         // Main simulation loop
+        tile_updates_ = 0.0;
+        iterations_ = Solve(&heat_map_, true) - first_step_;
+
+        // Stop timer
+        mpi_time_end = MPI_Wtime();
+
+        // Calculate execution time by reducing local times and taking their max
+        local_time = mpi_time_end - mpi_time_start;
+        std::fprintf(stderr, "worker%d@%s, time: %.2f\n", mpi_wrapper_.rank(),
+                     mpi_wrapper_.processor_name(), local_time);
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        mpi_wrapper_.ReduceSum(&local_cells, &active_cells_);
+        elapsed_ = global_time;
+
+        mpi_wrapper_.PrintRoot(out_, "\nElapsed time: %.2f sec\n",
+                               global_time);
+        if (mpi_wrapper_.halo_codec() != HALO_RAW)
+            mpi_wrapper_.PrintHaloStatistics(out_);
+        if (active_cells_ != GlobalCells())
+            mpi_wrapper_.PrintRoot(out_, "Throughput: %.1f Mcells/s\n",
+                                   throughput() / 1e6);
+        if (heat_map_.tiles_enabled())
+            ReportSkippedUpdates();
+        if (checkpoints_) {
+            double checkpoint_time = 0.0;
+            mpi_wrapper_.ReduceMax(&checkpoint_time_, &checkpoint_time);
+            mpi_wrapper_.PrintRoot(out_,
+                                   "Checkpoints: %d, %.3f sec of the time "
+                                   "loop (%.1f%%)\n",
+                                   checkpoints_, checkpoint_time,
+                                   100.0 * checkpoint_time / global_time);
+        }
+        if (snapshots_)
+            ReportSnapshots();
+        if (renderer_.frames())
+            ReportRendering();
+        if (statistics_records_)
+            ReportStatistics();
+
+        return outputs_failed_;
+    }
+
+    /*
+     * HeatTransfer::RunStencil - executes the simulation with the given
+     * stencil (see stencil.h) instead of the five-point update of the heat
+     * map, which starts from and receives the grid of the heat map. The halos
+     * are exchanged before the whole block is updated.
+     */
+    template <typename Stencil> int RunStencil() {
+        int block_height = mpi_wrapper_.block_height();
+        int block_width = mpi_wrapper_.block_width();
+
+        if (mirror_ || block_height < Stencil::kRadius ||
+            block_width < Stencil::kRadius) {
+            mpi_wrapper_.PrintRoot(errors_,
+                                   "The stencil needs full blocks of at "
+                                   "least %dx%d\n",
+                                   Stencil::kRadius, Stencil::kRadius);
+            return 1;
+        }
+        StencilMap<Stencil, Storage, Compute> map;
+        map.Init(block_height, block_width, &mpi_wrapper_);
+        SolveInMap(&map);
+        map.Destroy();
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::RunLayout - executes the simulation with the grid stored
+     * in the given layout (see layout.h), as HeatTransfer::RunStencil
+     */
+    template <typename Layout> int RunLayout() {
+        LayoutMap<Layout, Storage, Compute> map;
+        int local_fits = !map.Init(mpi_wrapper_.block_height(),
+                                   mpi_wrapper_.block_width(), &mpi_wrapper_);
+        int fits = 0;
+        mpi_wrapper_.ReduceConvergenceCheck(&local_fits, &fits);
+        if (mirror_ || !fits) {
+            mpi_wrapper_.PrintRoot(errors_, "The layout does not fit the "
+                                            "blocks\n");
+            return 1;
+        }
+        SolveInMap(&map);
+        map.Destroy();
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::RunNested - executes a steady-state solve by grid
+     * sequencing: the grid is solved on successively coarser levels (halving
+     * the resolution each time), starting from the coarsest, and each solution
+     * is prolonged as the initial guess of the next finer level. The work is
+     * compared against a cold solve of the fine grid.
+     */
+    int RunNested(int levels) {
+        double time_start, local_time, cold_time, nested_time;
+        int block_height = mpi_wrapper_.block_height();
+        int block_width = mpi_wrapper_.block_width();
+        int factor = 1 << (levels - 1);
+
+        if (mirror_) {
+            mpi_wrapper_.PrintRoot(errors_, "Grid sequencing needs the full "
+                                            "grid\n");
+            return 1;
+        }
+
+        // Check whether the coarsest level can be formed
+        if (block_height % factor || block_width % factor ||
+            block_height / factor < 2 || block_width / factor < 2) {
+            mpi_wrapper_.PrintRoot(
+                errors_, "Cannot coarsen a %dx%d block %d times\n",
+                block_height, block_width, levels - 1);
+            return 1;
+        }
+
+        // Cold start on the fine grid
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+        double cold_work = Solve(&heat_map_, false) * GlobalCells();
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &cold_time);
+
+        // Grid sequence, from the coarsest level to the fine one
+        Map maps[2];
+        double nested_work = 0.0;
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+        for (int l = levels - 1; l >= 0; --l) {
+            int stride = 1 << l;
+            Map *map = &maps[l % 2], *coarse = &maps[1 - l % 2];
+            mpi_wrapper_.SetBlockDimensions(block_height / stride,
+                                            block_width / stride);
+            map->Init(block_height / stride, block_width / stride,
+                      &mpi_wrapper_, stride);
+            if (l != levels - 1) {
+                map->Prolong(*coarse);
+                coarse->Destroy();
+            }
+
+            double work = Solve(map, false) * GlobalCells();
+            nested_work += work;
+            mpi_wrapper_.PrintRoot(out_, "Level %d (%dx%d): %.0f updates\n",
+                                   l, mpi_wrapper_.topology_height() *
+                                          block_height / stride,
+                                   mpi_wrapper_.topology_width() *
+                                       block_width / stride,
+                                   work);
+            if (l) {
+                // Update the halos the next finer level interpolates from
+                map->ExchangeMessages();
+                map->WaitForMessages();
+            }
+        }
+        maps[0].Destroy();
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &nested_time);
+
+        mpi_wrapper_.PrintRoot(out_,
+                               "\nCold start: %.0f updates, %.2f sec\n"
+                               "Nested:     %.0f updates, %.2f sec\n"
+                               "Work ratio: %.2f\n",
+                               cold_work, cold_time, nested_work, nested_time,
+                               nested_work / cold_work);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::RunAsync - executes a steady-state solve by asynchronous
+     * (chaotic) relaxation: workers sweep their blocks without synchronizing,
+     * using the most recent halos that have arrived. Termination is detected
+     * by non-blocking reductions of the local convergence flags, which are
+     * started back to back. The run ends once two consecutive reductions find
+     * every worker converged (or out of steps), so that halos still in flight
+     * during the first one have been taken into account. Workers out of steps
+     * block until a message arrives rather than poll.
+     */
+    int RunAsync() {
+        double time_start, local_time, global_time;
+        int converged_local = 0, converged_global = 0, confirmations = 0;
+        int sweeps = 0;
+        bool swept = false;
+
+        if (mirror_) {
+            mpi_wrapper_.PrintRoot(errors_, "The asynchronous iteration needs "
+                                            "the full grid\n");
+            return 1;
+        }
+
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+
+        heat_map_.StartAsyncExchange();
+        mpi_wrapper_.StartReduceConvergenceCheck(&converged_local,
+                                                 &converged_global);
+        for (;;) {
+            // Refresh halos and send edges, without blocking
+            heat_map_.AsyncExchange(swept);
+            swept = sweeps != steps_;
+            if (swept) {
+                heat_map_.StandaloneUpdate();
+                heat_map_.CollaborativeUpdate();
+                heat_map_.ExchangeGrids();
+                ++sweeps;
+            } else {
+                // Out of steps, sleep until there is a message to handle
+                heat_map_.WaitAsyncExchange();
+            }
+
+            if (!mpi_wrapper_.TestReduceConvergenceCheck())
+                continue;
+            confirmations = converged_global ? confirmations + 1 : 0;
+            if (confirmations == 2)
+                break;
+            // Start the next reduction with the current local state
+            converged_local = 1;
+            if (sweeps != steps_)
+                heat_map_.CheckConvergence(&converged_local);
+            mpi_wrapper_.StartReduceConvergenceCheck(&converged_local,
+                                                     &converged_global);
+        }
+        heat_map_.FinishAsyncExchange();
+
+        local_time = MPI_Wtime() - time_start;
+        std::fprintf(stderr, "worker%d@%s, time: %.2f, sweeps: %d\n",
+                     mpi_wrapper_.rank(), mpi_wrapper_.processor_name(),
+                     local_time, sweeps);
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+
+        mpi_wrapper_.PrintRoot(out_, "\nElapsed time: %.2f sec\n",
+                               global_time);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::RunProbes - computes the values of the given cells after
+     * all the time steps, only updating their dependency cone: a cell at step
+     * N depends on the cells within distance N at step 0, so step t only
+     * updates the cells within distance N - t - 1 of a probe. Workers whose
+     * block misses the cone stay idle.
+     */
+    int RunProbes(const std::vector<Probe> &probes) {
+        double time_start, local_time, global_time;
+        double local_updates = 0.0, global_updates = 0.0;
+        int height =
+            mpi_wrapper_.topology_height() * mpi_wrapper_.block_height();
+        int width = mpi_wrapper_.topology_width() * mpi_wrapper_.block_width();
+
+        if (heat_map_.in_place() || mirror_) {
+            mpi_wrapper_.PrintRoot(errors_, "Probes need the two-grid update "
+                                            "of the full grid\n");
+            return 1;
+        }
+        for (unsigned int p = 0; p != probes.size(); ++p)
+            if (probes[p].row < 1 || probes[p].row > height ||
+                probes[p].col < 1 || probes[p].col > width) {
+                mpi_wrapper_.PrintRoot(errors_,
+                                       "Probe %d:%d is out of the grid\n",
+                                       probes[p].row, probes[p].col);
+                return 1;
+            }
+
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+
         for (int i = 0; i != steps_; ++i) {
+            heat_map_.ExchangeCone(probes, steps_ - i);
+            heat_map_.WaitForMessages();
+            local_updates += heat_map_.ConeUpdate(probes, steps_ - i - 1);
+            heat_map_.ExchangeGrids();
+        }
+
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        mpi_wrapper_.ReduceSum(&local_updates, &global_updates);
+
+        double val = 0.0;
+        for (unsigned int p = 0; p != probes.size(); ++p)
+            if (heat_map_.ProbeValue(probes[p], &val))
+                std::printf("Probe %d:%d at step %d: %.10e\n", probes[p].row,
+                            probes[p].col, steps_, val);
+        mpi_wrapper_.Barrier();
+
+        double full_updates = (double)steps_ * height * width;
+        mpi_wrapper_.PrintRoot(out_,
+                               "\nCell updates: %.0f (%.4f of a full run)\n"
+                               "Elapsed time: %.2f sec\n",
+                               global_updates, global_updates / full_updates,
+                               global_time);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::CheckSnapshots - reads the snapshots of the last
+     * HeatTransfer::Run back, see SnapshotReader, and compares the last of
+     * them, if taken at the final step, with the grid: it must match within
+     * the error bound of the delta codec, or exactly. Returns non-zero on
+     * every worker if a snapshot is missing or corrupt, or does not match.
+     */
+    int CheckSnapshots() {
+        if (!snapshot_interval_) {
+            mpi_wrapper_.PrintRoot(errors_, "There are no snapshots to "
+                                            "check\n");
+            return 1;
+        }
+        snapshot_writer_.Flush();
+        std::vector<double> block(heat_map_.block_size());
+        std::vector<double> grid(heat_map_.block_size());
+        heat_map_.CopyBlock(&grid[0]);
+        SnapshotReader reader;
+        int frames = 0, step = -1;
+        bool end = false;
+        double local_err = reader.Open(snapshot_writer_.path(), block.size());
+        while (!local_err && !end) {
+            local_err = reader.Read(&block[0], &step, &end);
+            frames += !end;
+        }
+        double local_error = 0.0, error = 0.0;
+        if (step == first_step_ + iterations_)
+            for (size_t k = 0; k != block.size(); ++k)
+                local_error =
+                    std::max(local_error, std::fabs(block[k] - grid[k]));
+        const SnapshotCodec &codec = snapshot_writer_.codec();
+        double bound =
+            codec.codec() == SNAPSHOT_DELTA ? codec.error_bound() : 0.0;
+        local_err = local_err || frames != snapshots_ ||
+                    !(local_error <= bound);
+        double err = 0.0;
+        mpi_wrapper_.ReduceMax(&local_err, &err);
+        mpi_wrapper_.ReduceMax(&local_error, &error);
+        if (err) {
+            mpi_wrapper_.PrintRoot(errors_, "The snapshots do not read back "
+                                            "as written\n");
+            return 1;
+        }
+        mpi_wrapper_.PrintRoot(out_,
+                               "Snapshots read back: %d, the last off the "
+                               "grid by %.3e at most\n",
+                               frames, error);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::WriteGrid - gathers the grid to the root worker, which
+     * writes it to the given file as text, one row per line. A mirrored
+     * quadrant is reconstructed into the full grid.
+     */
+    int WriteGrid(const char *path) const {
+        int block_height = mpi_wrapper_.block_height();
+        int block_width = mpi_wrapper_.block_width();
+        int grid_width = mpi_wrapper_.topology_width() * block_width;
+        int block_size = block_height * block_width;
+        bool root = !mpi_wrapper_.rank();
+        std::vector<double> block(block_size), all;
+        if (!mpi_wrapper_.active())
+            return 0; // Excluded by a mask, its block is all zeroes
+        if (root)
+            all.resize(block_size * mpi_wrapper_.topology_size());
+        heat_map_.CopyBlock(&block[0]);
+        mpi_wrapper_.Gather(&block[0], block_size, root ? &all[0] : NULL);
+        if (!root)
+            return 0;
+
+        // Place the blocks in the (possibly reduced) grid
+        std::vector<double> grid(mpi_wrapper_.topology_height() *
+                                 block_height * grid_width);
+        for (int r = 0; r != mpi_wrapper_.topology_size(); ++r) {
+            int x, y;
+            mpi_wrapper_.Coords(r, &x, &y);
+            for (int i = 0; i != block_height; ++i)
+                for (int j = 0; j != block_width; ++j)
+                    grid[(x * block_height + i) * grid_width +
+                         y * block_width + j] =
+                        all[r * block_size + i * block_width + j];
+        }
+
+        FILE *fp = std::fopen(path, "w");
+        if (fp == NULL) {
+            std::fprintf(stderr, "Cannot open %s for writing\n", path);
+            return 1;
+        }
+        for (int i = 0; i != height_; ++i) {
+            // Mirror rows and columns beyond the quadrant
+            int gi = (mirror_ && i >= (height_ + 1) / 2) ? height_ - 1 - i : i;
+            for (int j = 0; j != width_; ++j) {
+                int gj = (mirror_ && j >= (width_ + 1) / 2) ? width_ - 1 - j
+                                                              : j;
+                std::fprintf(fp, " %.10e", grid[gi * grid_width + gj]);
+            }
+            std::fprintf(fp, "\n");
+        }
+        std::fclose(fp);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::ReportError - reports the difference of the grid from
+     * that of a reference simulation of the same grid on the same workers,
+     * eg. the double precision one
+     */
+    template <typename S, typename C>
+    int ReportError(const BasicHeatTransfer<S, C> &reference) const {
+        // Blocks are compared in place, so the topologies must match
+        int local_match = mpi_wrapper_.topology_coord_x() ==
+                              reference.mpi_wrapper_.topology_coord_x() &&
+                          mpi_wrapper_.topology_coord_y() ==
+                              reference.mpi_wrapper_.topology_coord_y() &&
+                          heat_map_.block_size() ==
+                              reference.heat_map_.block_size();
+        int match = 0;
+        mpi_wrapper_.ReduceConvergenceCheck(&local_match, &match);
+        if (!match) {
+            mpi_wrapper_.PrintRoot(errors_, "Cannot compare different grids\n");
+            return 1;
+        }
+
+        std::vector<double> block(heat_map_.block_size());
+        std::vector<double> reference_block(block.size());
+        heat_map_.CopyBlock(&block[0]);
+        reference.heat_map_.CopyBlock(&reference_block[0]);
+        double local_error = 0.0, local_max = 0.0, error = 0.0, max = 0.0;
+        for (unsigned int k = 0; k != block.size(); ++k) {
+            local_error = std::max(local_error,
+                                   std::fabs(block[k] - reference_block[k]));
+            local_max = std::max(local_max, std::fabs(reference_block[k]));
+        }
+        mpi_wrapper_.ReduceMax(&local_error, &error);
+        mpi_wrapper_.ReduceMax(&local_max, &max);
+        mpi_wrapper_.PrintRoot(out_,
+                               "Max error: %.3e (%.3e of the max value)\n",
+                               error, max > 0.0 ? error / max : 0.0);
+        return 0;
+    }
+
+  private:
+    typedef BasicHeatMap<Storage, Compute> Map;
+
+    /*
+     * HeatTransfer::SolveInMap - runs the simulation loop on a map other than
+     * the heat map (see HeatTransfer::RunStencil), which starts from and
+     * hands back the grid of the heat map
+     */
+    template <typename M> int SolveInMap(M *map) {
+        double time_start, local_time, global_time;
+        int converged_local = 0, converged_global = 0;
+        int convergence_check = std::sqrt(steps_);
+        std::vector<double> block(heat_map_.block_size());
+        heat_map_.CopyBlock(&block[0]);
+        map->LoadBlock(&block[0]);
+
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+        for (int i = 0; i != steps_; ++i) {
+            if (converged_global) {
+                mpi_wrapper_.PrintRoot(
+                    out_, "Convergence was reached after %d iterations!\n",
+                    i);
+                break;
+            }
+            map->ExchangeHalos();
+            map->Update();
+            if (!(i % convergence_check))
+                map->CheckConvergence(&converged_local);
+            mpi_wrapper_.ReduceConvergenceCheck(&converged_local,
+                                                &converged_global);
+            map->ExchangeGrids();
+        }
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        mpi_wrapper_.PrintRoot(out_, "\nElapsed time: %.2f sec\n",
+                               global_time);
+
+        map->CopyBlock(&block[0]);
+        heat_map_.LoadBlock(&block[0]);
+        return 0;
+    }
+
+    // Creates the topology and the heat map, once MPI is attached
+    int Setup(int height, int width, int steps, bool mirror) {
+        steps_ = steps;
+        height_ = height;
+        width_ = width;
+        mirror_ = mirror;
+
+        // Create cartesian topology
+        if (mirror_)
+            mpi_wrapper_.CreateTopology((height + 1) / 2, (width + 1) / 2);
+        else
+            mpi_wrapper_.CreateTopology(height, width);
+
+        // Initialize heat map for worker
+        heat_map_.Init(mpi_wrapper_.block_height(), mpi_wrapper_.block_width(),
+                       &mpi_wrapper_);
+        if (mirror_)
+            heat_map_.EnableMirror(height, width);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer::Solve - runs the main simulation loop on the given heat
+     * map and returns the number of iterations performed. With outputs set
+     * (by HeatTransfer::Run only), it also records the statistics and saves
+     * the checkpoints, snapshots and images that are enabled.
+     */
+    int Solve(Map *heat_map, bool outputs) {
+        int converged_local = 0, converged_global = 0;
+        int convergence_check = std::sqrt(steps_);
+        int i;
+
+        for (i = first_step_; i < steps_; ++i) {
             // If convergence has been reached, then there is no reason to go on
             if (converged_global) {
                 mpi_wrapper_.PrintRoot(
-                    stdout, "Convergence was reached after %d iterations!\n",
+                    out_, "Convergence was reached after %d iterations!\n",
                     i);
                 break;
             }
+            bool timed = outputs && statistics_interval_;
+            bool collect = timed && !((i + 1) % statistics_interval_);
+            double step_start = timed ? MPI_Wtime() : 0.0;
+            if (collect)
+                heat_map->CollectStatistics(true);
             // Send and Receive messages (non-blocking)
-            heat_map_.ExchangeMessages();
+            heat_map->ExchangeMessages();
             // Update values of internal cells
-            heat_map_.StandaloneUpdate();
+            heat_map->StandaloneUpdate();
             // Wait for incoming messages
-            heat_map_.WaitForMessages();
+            heat_map->WaitForMessages();
+            // Fill halos on symmetry axes, if mirrored
+            heat_map->ReflectHalos();
             // Update values of edge cells
-            heat_map_.CollaborativeUpdate();
+            heat_map->CollaborativeUpdate();
+            // Freeze or reactivate tiles, if enabled
+            heat_map->UpdateActiveTiles();
+            if (heat_map->tiles_enabled())
+                tile_updates_ += heat_map->updates();
 
-            if (!(i % convergence_check)) {
-                // Check whether convergence has been reached
-                heat_map_.CheckConvergence(&converged_local);
-            }
+            // Check whether convergence has been reached
+            if (!(i % convergence_check))
+                heat_map->CheckConvergence(&converged_local);
 
             // Reduce convergence flags and decide
             mpi_wrapper_.ReduceConvergenceCheck(&converged_local,
                                                 &converged_global);
             // Change grids
-            heat_map_.ExchangeGrids();
+            heat_map->ExchangeGrids();
+
+            if (collect)
+                RecordStatistics(heat_map, i + 1);
+            if (timed)
+                (collect ? statistics_step_time_ : plain_step_time_) +=
+                    MPI_Wtime() - step_start;
+            if (outputs)
+                SaveOutputs(heat_map, i + 1);
+        }
+        if (outputs && checkpoint_interval_) {
+            double time_start = MPI_Wtime();
+            mpi_wrapper_.FinishCheckpoint();
+            checkpoint_time_ += MPI_Wtime() - time_start;
         }
+        return i;
+    }
 
-        // Stop timer
-        mpi_time_end = MPI_Wtime();
+    /*
+     * Maps the grid file at path, of the grid, on every worker. Returns
+     * non-zero on all of them if any worker could not, the root worker
+     * printing why.
+     */
+    int OpenGridFile(const std::string &path, GridFile *file) {
+        bool root = !mpi_wrapper_.rank();
+        double local_err = file->Open(path.c_str(), height_, width_, root);
+        double err = 0.0;
+        mpi_wrapper_.ReduceMax(&local_err, &err);
+        if (err && !local_err && root)
+            std::fprintf(stderr, "Cannot open %s on every worker\n",
+                         path.c_str());
+        return err != 0.0;
+    }
 
-        // Calculate execution time by reducing local times and taking their max
-        local_time = mpi_time_end - mpi_time_start;
-        std::fprintf(stderr, "worker%d@%s, time: %.2f\n", mpi_wrapper_.rank(),
-                     mpi_wrapper_.processor_name(), local_time);
-        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+    /*
+     * Saves the checkpoint, the snapshot and the image due after the given
+     * step, of those enabled
+     */
+    void SaveOutputs(const Map *heat_map, int step) {
+        if (checkpoint_interval_ && !(step % checkpoint_interval_))
+            SaveCheckpoint(heat_map, step);
+        if (snapshot_interval_ && !(step % snapshot_interval_))
+            SaveSnapshot(heat_map, step);
+        if (render_interval_ && !(step % render_interval_))
+            RenderFrame(heat_map, step);
+    }
 
-        mpi_wrapper_.PrintRoot(stdout, "\nElapsed time: %.2f sec\n",
-                               global_time);
+    /*
+     * Copies the working grid and starts writing it to the checkpoint, once
+     * the previous checkpoint has completed. Checkpoints stop at the first
+     * that cannot be started, failing the run.
+     */
+    void SaveCheckpoint(const Map *heat_map, int step) {
+        double time_start = MPI_Wtime();
+        mpi_wrapper_.FinishCheckpoint();
+        checkpoint_block_.resize(heat_map->block_size());
+        heat_map->CopyBlock(&checkpoint_block_[0]);
+        int err = mpi_wrapper_.StartCheckpoint(checkpoint_path_.c_str(),
+                                               &checkpoint_block_[0], step);
+        checkpoint_time_ += MPI_Wtime() - time_start;
+        if (err) {
+            checkpoint_interval_ = 0;
+            outputs_failed_ = true;
+            return;
+        }
+        ++checkpoints_;
+    }
 
-        return 0;
+    /*
+     * Copies the working grid into the staging buffer of the snapshot writer
+     * and hands it over
+     */
+    void SaveSnapshot(const Map *heat_map, int step) {
+        double time_start = MPI_Wtime();
+        heat_map->CopyBlock(snapshot_writer_.Stage());
+        snapshot_writer_.Submit(step);
+        snapshot_time_ += MPI_Wtime() - time_start;
+        ++snapshots_;
     }
 
-  private:
-    int steps_; // The maximum number of simulation steps
+    /*
+     * Reduces the statistics the update of the step collected and writes
+     * them
+     */
+    void RecordStatistics(Map *heat_map, int step) {
+        GridStatistics statistics;
+        mpi_wrapper_.ReduceStatistics(&heat_map->statistics(), &statistics);
+        heat_map->CollectStatistics(false);
+        if (statistics_file_ != NULL)
+            std::fprintf(statistics_file_, "%d %.10e %.10e %.10e %.10e %d %d\n",
+                         step, statistics.sum, statistics.min, statistics.max,
+                         statistics.sum / statistics.cells,
+                         (int)statistics.max_row, (int)statistics.max_col);
+        ++statistics_records_;
+    }
+
+    /*
+     * Prints the overhead of the statistics, as the time of the steps that
+     * collect them against that of the others (the slowest worker's)
+     */
+    void ReportStatistics() {
+        int steps = iterations_;
+        double local_times[2] = {
+            statistics_step_time_ / statistics_records_,
+            steps > statistics_records_
+                ? plain_step_time_ / (steps - statistics_records_)
+                : 0.0};
+        double times[2];
+        for (int k = 0; k != 2; ++k)
+            mpi_wrapper_.ReduceMax(&local_times[k], &times[k]);
+        mpi_wrapper_.PrintRoot(out_,
+                               "Statistics: %d records, %.3f ms per step "
+                               "with them, %.3f ms without\n",
+                               statistics_records_, times[0] * 1e3,
+                               times[1] * 1e3);
+    }
+
+    /*
+     * Downsamples the working grid into the tile of the worker and
+     * composites the image of the step. Images stop at the first that cannot
+     * be written, failing the run.
+     */
+    void RenderFrame(const Map *heat_map, int step) {
+        double time_start = MPI_Wtime();
+        heat_map->DownsampleBlock(&renderer_);
+        int err = renderer_.Composite(step, mpi_wrapper_);
+        // Only the root worker knows whether the image was written
+        mpi_wrapper_.Broadcast(&err, 1);
+        render_time_ += MPI_Wtime() - time_start;
+        if (err) {
+            render_interval_ = 0;
+            outputs_failed_ = true;
+        }
+    }
 
-    HeatMap heat_map_;
-    MPIWrapper mpi_wrapper_;
+    /*
+     * Prints the cost of an image to the time loop, and of its compositing
+     * (the slowest worker's)
+     */
+    void ReportRendering() {
+        double local_costs[2] = {render_time_ / renderer_.frames(),
+                                 renderer_.composite_time() /
+                                     renderer_.frames()};
+        double costs[2];
+        for (int k = 0; k != 2; ++k)
+            mpi_wrapper_.ReduceMax(&local_costs[k], &costs[k]);
+        mpi_wrapper_.PrintRoot(out_,
+                               "Images: %d of %dx%d, %.2f ms each in the "
+                               "time loop, %.2f ms of which compositing\n",
+                               renderer_.frames(), renderer_.image_height(),
+                               renderer_.image_width(), costs[0] * 1e3,
+                               costs[1] * 1e3);
+    }
 
-    DISALLOW_COPY_AND_ASSIGN(HeatTransfer);
+    /*
+     * Prints the cost of a snapshot, to the time loop and to the writing
+     * thread, once they have all been written (the slowest worker's), and
+     * how well they were compressed
+     */
+    void ReportSnapshots() {
+        snapshot_writer_.Flush();
+        int frames = snapshot_writer_.frames_written();
+        const SnapshotCodec &codec = snapshot_writer_.codec();
+        double local_costs[4] = {snapshot_time_ / snapshots_,
+                                 snapshot_writer_.write_time() / frames,
+                                 snapshot_writer_.encode_time() / frames,
+                                 codec.max_error()};
+        double costs[4];
+        for (int k = 0; k != 4; ++k)
+            mpi_wrapper_.ReduceMax(&local_costs[k], &costs[k]);
+        double local_bytes = snapshot_writer_.bytes_written(), bytes = 0.0;
+        mpi_wrapper_.ReduceSum(&local_bytes, &bytes);
+        // Bytes written per snapshot and worker, on average
+        bytes /= (double)frames * mpi_wrapper_.topology_size();
+        mpi_wrapper_.PrintRoot(out_,
+                               "Snapshots: %d of %.1f MB per worker, %.2f ms "
+                               "each in the time loop, %.2f ms each to write "
+                               "(%.0f MB/s)\n",
+                               snapshots_,
+                               snapshot_writer_.frame_size() / 1e6,
+                               costs[0] * 1e3, costs[1] * 1e3,
+                               bytes / costs[1] / 1e6);
+        if (codec.codec() != SNAPSHOT_RAW)
+            mpi_wrapper_.PrintRoot(out_,
+                                   "Snapshot compression: %.2fx (%.1f MB per "
+                                   "worker), %.2f ms each to encode (%.0f "
+                                   "MB/s), max error %.3e\n",
+                                   snapshot_writer_.frame_size() / bytes,
+                                   bytes / 1e6, costs[2] * 1e3,
+                                   snapshot_writer_.frame_size() / costs[2] /
+                                       1e6,
+                                   costs[3]);
+    }
+
+    /*
+     * Prints the fraction of the cell updates of the last HeatTransfer::Run
+     * skipped thanks to frozen tiles
+     */
+    void ReportSkippedUpdates() const {
+        double global_updates = 0.0;
+        mpi_wrapper_.ReduceSum(&tile_updates_, &global_updates);
+        double full_updates = (double)iterations_ * GlobalCells();
+        mpi_wrapper_.PrintRoot(out_,
+                               "Frozen tiles: %.1f%% of updates skipped "
+                               "over %d steps\n",
+                               full_updates > 0.0
+                                   ? 100.0 * (1.0 - global_updates /
+                                                        full_updates)
+                                   : 0.0,
+                               iterations_);
+    }
+
+    /*
+     * Number of cells in the global grid, for the current block dimensions
+     */
+    double GlobalCells() const {
+        return (double)mpi_wrapper_.topology_height() *
+               mpi_wrapper_.block_height() * mpi_wrapper_.topology_width() *
+               mpi_wrapper_.block_width();
+    }
+
+    int steps_;           // The maximum number of simulation steps
+    int height_;          // Grid height
+    int width_;           // Grid width
+    bool mirror_;         // Whether only a quadrant of the grid is simulated
+    int iterations_;      // Iterations of the last HeatTransfer::Run
+    double elapsed_;      // Elapsed time of the last HeatTransfer::Run
+    double active_cells_; // Cells updated at each step of the last run
+    FILE *out_;           // Stream of the root worker's reports
+    FILE *errors_;        // And of its errors
+    double tile_updates_; // Cells updated with tiles enabled, over the run
+    bool outputs_failed_; // Whether saving an output failed, see SaveOutputs
+
+    int first_step_;                       // Step of the restart, if any
+    std::string checkpoint_path_;          // See EnableCheckpoints
+    int checkpoint_interval_;              // Steps, zero when disabled
+    int checkpoints_;                      // Checkpoints started
+    double checkpoint_time_;               // Spent on them in the time loop
+    std::vector<double> checkpoint_block_; // Being written
+
+    SnapshotWriter snapshot_writer_;
+    int snapshot_interval_; // Steps, zero when disabled
+    int snapshots_;         // Snapshots handed to the writer
+    double snapshot_time_;  // Spent on them in the time loop
+
+    Renderer renderer_;
+    int render_interval_; // Steps, zero when disabled
+    double render_time_;  // Spent on images in the time loop
+
+    FILE *statistics_file_;       // Of the root worker
+    int statistics_interval_;     // Steps, zero when disabled
+    int statistics_records_;      // Steps whose statistics were recorded
+    double statistics_step_time_; // Spent on these steps
+    double plain_step_time_;      // Spent on the other steps
+
+    Map heat_map_;
+    BasicMPIWrapper<Storage> mpi_wrapper_;
+
+    template <typename S, typename C> friend class BasicHeatTransfer;
+
+    DISALLOW_COPY_AND_ASSIGN(BasicHeatTransfer);
 };
 
+typedef BasicHeatTransfer<double> HeatTransfer;
+
 } // namespace heat_transfer
 
 #endif // __HEAT_TRANSFER_H_
@@ -0,0 +1,159 @@
+#ifndef __HEAT_TRANSFER_3D_H_
+#define __HEAT_TRANSFER_3D_H_
+
+#include "heat_volume.h"
+#include "macros.h"
+#include "mpi_wrapper_3d.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * HeatTransfer3D: The simulation of a volume, see HeatVolume
+ */
+class HeatTransfer3D {
+  public:
+    HeatTransfer3D() {
+    }
+
+    int Init(int depth, int height, int width, int steps) {
+        steps_ = steps;
+        depth_ = depth;
+        height_ = height;
+        width_ = width;
+        mpi_wrapper_.Init();
+        mpi_wrapper_.CreateTopology(depth, height, width);
+        heat_volume_.Init(mpi_wrapper_.block_dim(0), mpi_wrapper_.block_dim(1),
+                          mpi_wrapper_.block_dim(2), &mpi_wrapper_);
+        return 0;
+    }
+
+    /*
+     * Enables the 2.5D blocking of HeatVolume::SetBlocking
+     */
+    int SetBlocking(int tile) {
+        if (heat_volume_.SetBlocking(tile)) {
+            mpi_wrapper_.PrintRoot(stderr, "A band needs at least one row\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    int Destroy() {
+        heat_volume_.Destroy();
+        mpi_wrapper_.Destroy();
+        return 0;
+    }
+
+    /*
+     * HeatTransfer3D::Run - executes the simulation, as HeatTransfer::Run
+     */
+    int Run() {
+        double time_start, local_time, global_time;
+        int converged_local = 0, converged_global = 0;
+        int convergence_check = std::sqrt(steps_);
+        int i;
+
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+
+        for (i = 0; i != steps_; ++i) {
+            if (converged_global) {
+                mpi_wrapper_.PrintRoot(
+                    stdout, "Convergence was reached after %d iterations!\n",
+                    i);
+                break;
+            }
+            // Post the face transfers, update the interior meanwhile
+            heat_volume_.ExchangeMessages();
+            heat_volume_.StandaloneUpdate();
+            // Update the faces once their halos have arrived
+            heat_volume_.WaitForMessages();
+            heat_volume_.CollaborativeUpdate();
+
+            if (!(i % convergence_check))
+                heat_volume_.CheckConvergence(&converged_local);
+            mpi_wrapper_.ReduceConvergenceCheck(&converged_local,
+                                                &converged_global);
+            heat_volume_.ExchangeGrids();
+        }
+
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        mpi_wrapper_.PrintRoot(stdout,
+                               "\nElapsed time: %.2f sec\n"
+                               "Throughput: %.1f Mcells/s\n",
+                               global_time,
+                               (double)i * depth_ * height_ * width_ /
+                                   global_time / 1e6);
+        return 0;
+    }
+
+    /*
+     * HeatTransfer3D::WriteGrid - gathers the volume to the root worker,
+     * which writes it to the given file as text, one row per line, with an
+     * empty line after each plane
+     */
+    int WriteGrid(const char *path) const {
+        int block_size = heat_volume_.block_size();
+        bool root = !mpi_wrapper_.rank();
+        std::vector<double> block(block_size), all;
+        if (root)
+            all.resize(block_size * mpi_wrapper_.communication_size());
+        heat_volume_.CopyBlock(&block[0]);
+        mpi_wrapper_.Gather(&block[0], block_size, root ? &all[0] : NULL);
+        if (!root)
+            return 0;
+
+        // Place the blocks in the volume
+        int n[3] = {mpi_wrapper_.block_dim(0), mpi_wrapper_.block_dim(1),
+                    mpi_wrapper_.block_dim(2)};
+        std::vector<double> volume(all.size());
+        for (int r = 0; r != mpi_wrapper_.communication_size(); ++r) {
+            int c[3];
+            mpi_wrapper_.Coords(r, c);
+            const double *src = &all[r * block_size];
+            for (int k = 0; k != n[0]; ++k)
+                for (int i = 0; i != n[1]; ++i, src += n[2])
+                    std::copy(src, src + n[2],
+                              &volume[((c[0] * n[0] + k) * height_ +
+                                       c[1] * n[1] + i) *
+                                          width_ +
+                                      c[2] * n[2]]);
+        }
+
+        FILE *fp = std::fopen(path, "w");
+        if (fp == NULL) {
+            std::fprintf(stderr, "Cannot open %s for writing\n", path);
+            return 1;
+        }
+        for (int k = 0; k != depth_; ++k) {
+            for (int i = 0; i != height_; ++i) {
+                for (int j = 0; j != width_; ++j)
+                    std::fprintf(fp, " %.10e",
+                                 volume[(k * height_ + i) * width_ + j]);
+                std::fprintf(fp, "\n");
+            }
+            std::fprintf(fp, "\n");
+        }
+        std::fclose(fp);
+        return 0;
+    }
+
+  private:
+    int steps_;  // The maximum number of simulation steps
+    int depth_;  // Volume depth
+    int height_; // Volume height
+    int width_;  // Volume width
+
+    HeatVolume heat_volume_;
+    MPIWrapper3D mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(HeatTransfer3D);
+};
+
+} // namespace heat_transfer
+
+#endif // __HEAT_TRANSFER_3D_H_
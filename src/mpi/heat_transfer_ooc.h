@@ -0,0 +1,181 @@
+#ifndef __HEAT_TRANSFER_OOC_H_
+#define __HEAT_TRANSFER_OOC_H_
+
+#include "heat_file.h"
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * OutOfCoreHeatTransfer: The simulation of a grid kept on disk, see HeatFile
+ */
+class OutOfCoreHeatTransfer {
+  public:
+    OutOfCoreHeatTransfer() {
+    }
+
+    /*
+     * Creates the grid files of the workers in dir. Passes update bands of
+     * band rows and fuse up to depth steps. Returns non-zero on failure.
+     */
+    int Init(int height, int width, int steps, const std::string &dir,
+             int band, int depth) {
+        steps_ = steps;
+        height_ = height;
+        width_ = width;
+        depth_ = depth;
+        mpi_wrapper_.Init();
+        mpi_wrapper_.CreateTopology(height, width);
+
+        int block_height = mpi_wrapper_.block_height();
+        int block_width = mpi_wrapper_.block_width();
+        if (band < 1 || depth < 1 || depth > block_height ||
+            depth > block_width) {
+            mpi_wrapper_.PrintRoot(stderr,
+                                   "Bands need at least a row, and passes "
+                                   "from 1 to %d steps\n",
+                                   std::min(block_height, block_width));
+            return 1;
+        }
+        double local_err = heat_file_.Init(block_height, block_width,
+                                           &mpi_wrapper_, dir, band, depth);
+        double err = 0.0;
+        mpi_wrapper_.ReduceMax(&local_err, &err);
+        if (err)
+            return 1;
+
+        double local_size = heat_file_.resident_size(), size = 0.0;
+        mpi_wrapper_.ReduceMax(&local_size, &size);
+        mpi_wrapper_.PrintRoot(stdout,
+                               "Block on disk: %.1f MB, in memory: %.1f MB "
+                               "per worker\n",
+                               (double)block_height * block_width *
+                                   sizeof(double) / 1e6,
+                               size / 1e6);
+        return 0;
+    }
+
+    int Destroy() {
+        heat_file_.Destroy();
+        mpi_wrapper_.Destroy();
+        return 0;
+    }
+
+    /*
+     * OutOfCoreHeatTransfer::Run - executes the simulation, a pass of up to
+     * depth steps at a time. Convergence is checked at the end of each pass.
+     */
+    int Run() {
+        double time_start, local_time, global_time;
+        int converged_local = 0, converged_global = 0;
+        int i, passes = 0;
+
+        mpi_wrapper_.Barrier();
+        time_start = MPI_Wtime();
+
+        for (i = 0; i != steps_ && !converged_global; ++passes) {
+            int steps = std::min(depth_, steps_ - i);
+            double local_err = heat_file_.Pass(steps, &converged_local);
+            double err = 0.0;
+            mpi_wrapper_.ReduceMax(&local_err, &err);
+            if (err)
+                return 1;
+            i += steps;
+            mpi_wrapper_.ReduceConvergenceCheck(&converged_local,
+                                                &converged_global);
+        }
+        if (converged_global)
+            mpi_wrapper_.PrintRoot(
+                stdout, "Convergence was reached after %d iterations!\n", i);
+
+        local_time = MPI_Wtime() - time_start;
+        mpi_wrapper_.ReduceTime(&local_time, &global_time);
+        double local_traffic = heat_file_.traffic(), traffic = 0.0;
+        mpi_wrapper_.ReduceMax(&local_traffic, &traffic);
+        mpi_wrapper_.PrintRoot(stdout,
+                               "\nElapsed time: %.2f sec\n"
+                               "Throughput: %.1f Mcells/s\n"
+                               "Passes: %d, disk traffic: %.2f GB per "
+                               "worker\n",
+                               global_time,
+                               (double)i * height_ * width_ / global_time /
+                                   1e6,
+                               passes, traffic / 1e9);
+        return 0;
+    }
+
+    /*
+     * OutOfCoreHeatTransfer::WriteGrid - writes the grid to the given file
+     * as HeatTransfer::WriteGrid does, gathering it to the root worker a
+     * global row at a time
+     */
+    int WriteGrid(const char *path) const {
+        int block_height = mpi_wrapper_.block_height();
+        int block_width = mpi_wrapper_.block_width();
+        int workers = mpi_wrapper_.topology_size();
+        bool root = !mpi_wrapper_.rank();
+        std::vector<double> row(block_width, 0.0), all;
+        std::vector<int> ranks(workers); // By topology coordinates
+        FILE *fp = NULL;
+        int err = 0;
+        if (root) {
+            all.resize(block_width * workers);
+            for (int r = 0; r != workers; ++r) {
+                int x, y;
+                mpi_wrapper_.Coords(r, &x, &y);
+                ranks[x * mpi_wrapper_.topology_width() + y] = r;
+            }
+            fp = std::fopen(path, "w");
+            if (fp == NULL) {
+                std::fprintf(stderr, "Cannot open %s for writing\n", path);
+                err = 1;
+            }
+        }
+        mpi_wrapper_.Broadcast(&err, 1);
+        if (err)
+            return 1;
+
+        // Only the workers of the topology row of each global row send it
+        for (int x = 0; x != mpi_wrapper_.topology_height(); ++x)
+            for (int i = 0; i != block_height; ++i) {
+                if (mpi_wrapper_.topology_coord_x() == x &&
+                    heat_file_.ReadRow(i, &row[0]))
+                    std::fprintf(stderr, "Cannot read row %d\n", i);
+                mpi_wrapper_.Gather(&row[0], block_width,
+                                    root ? &all[0] : NULL);
+                if (!root)
+                    continue;
+                for (int y = 0; y != mpi_wrapper_.topology_width(); ++y) {
+                    const double *cells =
+                        &all[ranks[x * mpi_wrapper_.topology_width() + y] *
+                             block_width];
+                    for (int j = 0; j != block_width; ++j)
+                        std::fprintf(fp, " %.10e", cells[j]);
+                }
+                std::fprintf(fp, "\n");
+            }
+        if (root)
+            std::fclose(fp);
+        return 0;
+    }
+
+  private:
+    int steps_;  // The maximum number of simulation steps
+    int height_; // Grid height
+    int width_;  // Grid width
+    int depth_;  // Steps fused per pass
+
+    HeatFile heat_file_;
+    MPIWrapper mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(OutOfCoreHeatTransfer);
+};
+
+} // namespace heat_transfer
+
+#endif // __HEAT_TRANSFER_OOC_H_
@@ -0,0 +1,216 @@
+#ifndef __HEAT_VOLUME_H_
+#define __HEAT_VOLUME_H_
+
+#include "macros.h"
+#include "mpi_wrapper_3d.h"
+#include <algorithm>
+#include <cmath>
+
+namespace heat_transfer {
+
+/*
+ * HeatVolume: The 3D block of a worker, updated with the seven-point stencil.
+ * As in HeatMap, the interior is updated while the halos are in flight and
+ * the faces once they have arrived.
+ *
+ * With blocking enabled, the interior is swept in bands of a few whole rows,
+ * each streamed through the depth (2.5D blocking). The three planes of the
+ * band that the stencil reads stay in cache as the sweep advances, so each
+ * cell is loaded from memory once per step, instead of up to three times
+ * once whole planes outgrow the cache. The rows are kept whole so that the
+ * inner loop stays long and contiguous.
+ */
+class HeatVolume {
+  public:
+    HeatVolume() : working_grid_(0), coefficient_(0.1), tile_(0) {
+        for (int i = 0; i != 2; ++i)
+            grids_[i] = NULL;
+        mpi_wrapper_ = NULL;
+    }
+
+    int Init(int depth, int height, int width, MPIWrapper3D *mpi_wrapper) {
+        depth_ = depth;
+        height_ = height;
+        width_ = width;
+        mpi_wrapper_ = mpi_wrapper;
+        working_grid_ = 0;
+        row_ = width_ + 2;
+        plane_ = (height_ + 2) * row_;
+
+        int size = (depth_ + 2) * plane_;
+        for (int g = 0; g != 2; ++g) {
+            grids_[g] = new double[size];
+            std::fill(grids_[g], grids_[g] + size, 0.0);
+        }
+        FillInitialCondition();
+        return 0;
+    }
+
+    int Destroy() {
+        for (int i = 0; i != 2; ++i)
+            if (grids_[i] != NULL) {
+                delete[] grids_[i];
+                grids_[i] = NULL;
+            }
+        return 0;
+    }
+
+    /*
+     * SetBlocking: Sweeps the interior in bands of the given number of rows
+     * (at least one), see HeatVolume, instead of whole planes
+     */
+    int SetBlocking(int tile) {
+        if (tile < 1)
+            return 1;
+        tile_ = tile;
+        return 0;
+    }
+
+    int ExchangeMessages() {
+        for (int f = 0; f != 6; ++f)
+            mpi_wrapper_->Exchange(grids_[working_grid_],
+                                   static_cast<FACE>(f));
+        return 0;
+    }
+
+    int StandaloneUpdate() {
+        if (!tile_)
+            return UpdateRange(2, depth_ - 1, 2, height_ - 1, 2, width_ - 1);
+        for (int i = 2; i <= height_ - 1; i += tile_)
+            UpdateRange(2, depth_ - 1, i, std::min(i + tile_ - 1, height_ - 1),
+                        2, width_ - 1);
+        return 0;
+    }
+
+    int WaitForMessages() {
+        for (int f = 0; f != 6; ++f)
+            mpi_wrapper_->Wait(static_cast<FACE>(f));
+        return 0;
+    }
+
+    int CollaborativeUpdate() {
+        int d = depth_, h = height_, w = width_;
+        // Front and back planes
+        UpdateRange(1, 1, 1, h, 1, w);
+        UpdateRange(d, d, 1, h, 1, w);
+        // Top and bottom rows of the planes between them
+        UpdateRange(2, d - 1, 1, 1, 1, w);
+        UpdateRange(2, d - 1, h, h, 1, w);
+        // Left and right columns of the rows between those
+        UpdateRange(2, d - 1, 2, h - 1, 1, 1);
+        UpdateRange(2, d - 1, 2, h - 1, w, w);
+        return 0;
+    }
+
+    int CheckConvergence(int *converged) const {
+        *converged = 1;
+        for (int k = 1; k <= depth_; ++k)
+            for (int i = 1; i <= height_; ++i) {
+                const double *val1 = Cell(working_grid_, k, i, 0);
+                const double *val2 = Cell(1 - working_grid_, k, i, 0);
+                for (int j = 1; j <= width_; ++j)
+                    if (!(std::fabs(val1[j] - val2[j]) <= 0.001f)) {
+                        *converged = 0;
+                        return 0;
+                    }
+            }
+        return 0;
+    }
+
+    void ExchangeGrids() {
+        working_grid_ = 1 - working_grid_;
+    }
+
+    /*
+     * CopyBlock: Copies the block cells (no halos) of the working grid into
+     * buf, plane by plane, row by row
+     */
+    int CopyBlock(double *buf) const {
+        for (int k = 1; k <= depth_; ++k)
+            for (int i = 1; i <= height_; ++i)
+                buf = std::copy(Cell(working_grid_, k, i, 1),
+                                Cell(working_grid_, k, i, 1 + width_), buf);
+        return 0;
+    }
+
+    /*
+     * SetCoefficient: Sets the diffusion coefficient of the update (stable up
+     * to 1/6 in three dimensions)
+     */
+    void SetCoefficient(double coefficient) {
+        coefficient_ = coefficient;
+    }
+
+    int block_size() const {
+        return depth_ * height_ * width_;
+    }
+
+  private:
+    // Updates the cells of the given (inclusive) range, streaming through the
+    // planes, and row by row within each plane
+    int UpdateRange(int first_plane, int last_plane, int first_row,
+                    int last_row, int first_col, int last_col) {
+        const double coefficient = coefficient_;
+        for (int k = first_plane; k <= last_plane; ++k)
+            for (int i = first_row; i <= last_row; ++i) {
+                const double *in = Cell(working_grid_, k, i, 0);
+                const double *above = in - row_, *below = in + row_;
+                const double *front = in - plane_, *back = in + plane_;
+                double *out = Cell(1 - working_grid_, k, i, 0);
+                for (int j = first_col; j <= last_col; ++j) {
+                    double old_val = in[j], two_old_val = 2 * old_val;
+                    out[j] = old_val +
+                             coefficient * (above[j] + below[j] - two_old_val) +
+                             coefficient * (in[j + 1] + in[j - 1] -
+                                            two_old_val) +
+                             coefficient * (front[j] + back[j] - two_old_val);
+                }
+            }
+        return 0;
+    }
+
+    // Fills the working grid with the initial condition of the global volume,
+    // the product of that of the 2D grid with the same along the depth
+    void FillInitialCondition() {
+        int n[3] = {depth_, height_, width_};
+        double factors[3][2]; // Global dimension and block offset
+        for (int d = 0; d != 3; ++d) {
+            factors[d][0] = mpi_wrapper_->topology_dim(d) * n[d];
+            factors[d][1] = mpi_wrapper_->coord(d) * n[d];
+        }
+        for (int k = 1; k <= depth_; ++k)
+            for (int i = 1; i <= height_; ++i)
+                for (int j = 1; j <= width_; ++j) {
+                    double fk = k + factors[0][1], fi = i + factors[1][1];
+                    double fj = j + factors[2][1];
+                    *Cell(working_grid_, k, i, j) =
+                        fk * (factors[0][0] - (fk - 1)) * fi *
+                        (factors[1][0] - (fi - 1)) * fj *
+                        (factors[2][0] - (fj - 1));
+                }
+    }
+
+    double *Cell(int grid, int k, int i, int j) const {
+        return grids_[grid] + k * plane_ + i * row_ + j;
+    }
+
+    double *grids_[2];
+    int working_grid_;
+
+    int depth_; // Block dimensions
+    int height_;
+    int width_;
+    int row_;   // Row length, with halos
+    int plane_; // Plane size, with halos
+
+    double coefficient_; // Diffusion coefficient of the update
+    int tile_;           // Band rows of the 2.5D blocking, zero when off
+
+    MPIWrapper3D *mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(HeatVolume);
+};
+
+} // namespace heat_transfer
+
+#endif // __HEAT_VOLUME_H_
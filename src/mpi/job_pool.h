@@ -0,0 +1,169 @@
+#ifndef __JOB_POOL_H_
+#define __JOB_POOL_H_
+
+#include "heat_transfer.h"
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <cstdio>
+#include <vector>
+
+namespace heat_transfer {
+
+// A simulation of the job list
+struct Job {
+    int height;
+    int width;
+    int steps;
+    int workers; // Workers to run on, zero for a whole group
+};
+
+enum JOB_TAG { JOB_REQUEST = 30, JOB_REPLY };
+
+/*
+ * JobPool: runs a list of independent simulations concurrently.
+ *
+ * The first worker is the scheduler, while the rest are split into groups of
+ * the given size. Whenever a group finishes a job, its leader asks the
+ * scheduler for the next one, so jobs are handed out dynamically to the group
+ * that frees up first. A job needing fewer workers than the group runs on a
+ * subcommunicator of the group, and the rest of the group waits for it. Jobs
+ * needing more workers than the group size are rejected, and a job that only
+ * the last, smaller group has too few workers for runs on all of them.
+ */
+class JobPool {
+  public:
+    JobPool() {
+    }
+
+    int Init(const std::vector<Job> &jobs, int group_size) {
+        jobs_ = jobs;
+        world_.Init();
+        int workers = world_.communication_size() - 1;
+        if (workers < 1 || group_size < 1) {
+            world_.PrintRoot(stderr,
+                             "Need a scheduler and at least one group\n");
+            world_.Destroy();
+            return 1;
+        }
+        if (jobs.empty()) {
+            world_.PrintRoot(stderr, "Invalid or empty job list\n");
+            world_.Destroy();
+            return 1;
+        }
+        for (unsigned int k = 0; k != jobs.size(); ++k)
+            if (jobs[k].workers > group_size) {
+                world_.PrintRoot(stderr,
+                                 "Job %u needs %d workers, more than the "
+                                 "group size %d\n",
+                                 k, jobs[k].workers, group_size);
+                world_.Destroy();
+                return 1;
+            }
+        groups_ = (workers + group_size - 1) / group_size;
+
+        // The scheduler belongs to no group
+        group_ = world_.rank() ? (world_.rank() - 1) / group_size : -1;
+        world_.Split(group_ < 0 ? MPI_UNDEFINED : group_, world_.rank(),
+                     &group_comm_);
+        if (group_comm_ != MPI_COMM_NULL)
+            group_wrapper_.Init(group_comm_);
+        return 0;
+    }
+
+    int Destroy() {
+        if (group_comm_ != MPI_COMM_NULL) {
+            group_wrapper_.Destroy();
+            MPI_Comm_free(&group_comm_);
+        }
+        world_.Destroy();
+        return 0;
+    }
+
+    int Run() {
+        return group_ < 0 ? Schedule() : Work();
+    }
+
+  private:
+    /*
+     * JobPool::Schedule - hands out the jobs in order, one per request, and
+     * tells every group to stop once they run out
+     */
+    int Schedule() {
+        double time_start = MPI_Wtime();
+        unsigned int next = 0;
+        int stopped = 0;
+        while (stopped != groups_) {
+            int group, leader, job = -1;
+            world_.ReceiveFrom(&group, 1, MPI_ANY_SOURCE, JOB_REQUEST, &leader);
+            if (next != jobs_.size())
+                job = next++;
+            else
+                ++stopped;
+            world_.SendTo(&job, 1, leader, JOB_REPLY);
+        }
+        std::printf("\n%u jobs on %d groups, elapsed time: %.2f sec\n", next,
+                    groups_, MPI_Wtime() - time_start);
+        return 0;
+    }
+
+    /*
+     * JobPool::Work - runs the jobs assigned to the group until told to stop
+     */
+    int Work() {
+        for (;;) {
+            int job = -1;
+            if (!group_wrapper_.rank()) {
+                world_.SendTo(&group_, 1, 0, JOB_REQUEST);
+                world_.ReceiveFrom(&job, 1, 0, JOB_REPLY);
+            }
+            group_wrapper_.Broadcast(&job, 1);
+            if (job < 0)
+                break;
+            RunJob(job);
+        }
+        return 0;
+    }
+
+    int RunJob(int job) {
+        const Job &j = jobs_[job];
+        int size = group_wrapper_.communication_size();
+        int workers = (j.workers > 0 && j.workers < size) ? j.workers : size;
+
+        // Workers of the group that take part in the job
+        MPI_Comm job_comm;
+        group_wrapper_.Split(group_wrapper_.rank() < workers ? 0
+                                                             : MPI_UNDEFINED,
+                             group_wrapper_.rank(), &job_comm);
+        if (job_comm == MPI_COMM_NULL)
+            return 0;
+
+        double time_start = MPI_Wtime();
+        HeatTransfer simulation;
+        simulation.InitWithCommunicator(job_comm, j.height, j.width, j.steps);
+        simulation.Run();
+        simulation.Destroy();
+        MPI_Comm_free(&job_comm);
+
+        if (!group_wrapper_.rank())
+            std::printf("Job %d (%dx%d, %d steps) on group %d, %d workers%s: "
+                        "%.2f sec\n",
+                        job, j.height, j.width, j.steps, group_, workers,
+                        j.workers > workers ? " (fewer than requested)" : "",
+                        MPI_Wtime() - time_start);
+        return 0;
+    }
+
+    std::vector<Job> jobs_;
+    int groups_; // Number of worker groups
+    int group_;  // Group of the worker, -1 for the scheduler
+
+    MPIWrapper world_;         // All workers
+    MPIWrapper group_wrapper_; // Workers of the same group
+    MPI_Comm group_comm_;
+
+    DISALLOW_COPY_AND_ASSIGN(JobPool);
+};
+
+} // namespace heat_transfer
+
+#endif // __JOB_POOL_H_
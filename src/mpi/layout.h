@@ -0,0 +1,335 @@
+#ifndef __LAYOUT_H_
+#define __LAYOUT_H_
+
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * Storage layouts of a grid block (without halos). A layout stores the block
+ * in tiles, whose rows are contiguous and stored one after the other, and
+ * gives the position of any cell. The tiles are visited in storage order by
+ * LayoutMap.
+ */
+
+// Whole rows, one after the other, as in HeatMap
+class RowMajorLayout {
+  public:
+    int Init(int height, int width) {
+        height_ = height;
+        width_ = width;
+        return 0;
+    }
+
+    int size() const {
+        return height_ * width_;
+    }
+
+    int Index(int i, int j) const {
+        return i * width_ + j;
+    }
+
+    // Tiles, in storage order, by their first cell
+    int tiles() const {
+        return 1;
+    }
+
+    void Tile(int, int *i, int *j) const {
+        *i = *j = 0;
+    }
+
+    int tile_height() const {
+        return height_;
+    }
+
+    int tile_width() const {
+        return width_;
+    }
+
+  private:
+    int height_;
+    int width_;
+};
+
+/*
+ * Square tiles of kSide x kSide cells, each row of which fills a cache line
+ * of doubles. The rows of a tile are stored one after the other, so that the
+ * vertical neighbors of a cell are a cache line away (rather than a block
+ * row) and the edge columns of the block take one line per row of tiles.
+ * The tiles are placed row by row or, with kMorton set, along the Z-order
+ * curve of their coordinates, which keeps neighboring tiles close in memory
+ * in both directions. Block dimensions must be multiples of kSide.
+ */
+template <bool kMorton> class BasicTiledLayout {
+  public:
+    enum { kSide = 8 };
+
+    BasicTiledLayout() : tile_rows_(0), tile_cols_(0) {
+    }
+
+    int Init(int height, int width) {
+        if (height % kSide || width % kSide)
+            return 1;
+        tile_rows_ = height / kSide;
+        tile_cols_ = width / kSide;
+        int tiles = tile_rows_ * tile_cols_;
+
+        // Storage slot of each tile, and the tile of each slot
+        std::vector<std::pair<unsigned long long, int> > order(tiles);
+        for (int t = 0; t != tiles; ++t) {
+            int ti = t / tile_cols_, tj = t % tile_cols_;
+            order[t].first = kMorton ? Interleave(ti, tj) : t;
+            order[t].second = t;
+        }
+        std::sort(order.begin(), order.end());
+        slots_.resize(tiles);
+        tiles_.resize(tiles);
+        for (int s = 0; s != tiles; ++s) {
+            slots_[order[s].second] = s;
+            tiles_[s] = order[s].second;
+        }
+        return 0;
+    }
+
+    int size() const {
+        return tile_rows_ * tile_cols_ * kSide * kSide;
+    }
+
+    int Index(int i, int j) const {
+        int slot = slots_[(i / kSide) * tile_cols_ + j / kSide];
+        return (slot * kSide + i % kSide) * kSide + j % kSide;
+    }
+
+    int tiles() const {
+        return tiles_.size();
+    }
+
+    void Tile(int slot, int *i, int *j) const {
+        *i = tiles_[slot] / tile_cols_ * kSide;
+        *j = tiles_[slot] % tile_cols_ * kSide;
+    }
+
+    int tile_height() const {
+        return kSide;
+    }
+
+    int tile_width() const {
+        return kSide;
+    }
+
+  private:
+    // Morton code of the tile coordinates, row bits in the odd positions
+    static unsigned long long Interleave(unsigned int i, unsigned int j) {
+        unsigned long long code = 0;
+        for (int b = 0; b != 32; ++b)
+            code |= ((unsigned long long)((j >> b) & 1) << (2 * b)) |
+                    ((unsigned long long)((i >> b) & 1) << (2 * b + 1));
+        return code;
+    }
+
+    int tile_rows_;
+    int tile_cols_;
+    std::vector<int> slots_; // Storage slot of each tile, row by row
+    std::vector<int> tiles_; // Tile of each storage slot
+
+    DISALLOW_COPY_AND_ASSIGN(BasicTiledLayout);
+};
+
+typedef BasicTiledLayout<false> TiledLayout;
+typedef BasicTiledLayout<true> MortonLayout;
+
+/*
+ * LayoutMap: The grid block of a worker stored in the given layout, updated
+ * with the five-point stencil of HeatMap (with identical results).
+ *
+ * The halos are kept apart from the block, in contiguous arrays, which are
+ * received as they are; only the edges are packed for sending. The update
+ * sweeps the tiles in storage order, row by row: the row of a tile and the
+ * rows above and below it are contiguous runs (in the block or in a halo),
+ * and only the cells at the ends of the row need their horizontal neighbors
+ * looked up. The block is stored as Storage and updated in Compute
+ * arithmetic, as in BasicHeatMap.
+ */
+template <typename Layout, typename Storage = double,
+          typename Compute = Storage>
+class LayoutMap {
+  public:
+    LayoutMap() : working_grid_(0), coefficient_(0.1) {
+        mpi_wrapper_ = NULL;
+    }
+
+    /*
+     * Returns non-zero when the layout does not support the dimensions
+     */
+    int Init(int block_height, int block_width,
+             BasicMPIWrapper<Storage> *mpi_wrapper) {
+        block_height_ = block_height;
+        block_width_ = block_width;
+        mpi_wrapper_ = mpi_wrapper;
+        working_grid_ = 0;
+        if (layout_.Init(block_height, block_width))
+            return 1;
+        for (int g = 0; g != 2; ++g)
+            grids_[g].assign(layout_.size(), 0.0);
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            halos_[ch].assign(EdgeLength(ch), 0.0);
+            edges_[ch].assign(EdgeLength(ch), 0.0);
+        }
+        return 0;
+    }
+
+    int Destroy() {
+        for (int g = 0; g != 2; ++g)
+            std::vector<Storage>().swap(grids_[g]);
+        return 0;
+    }
+
+    int ExchangeHalos() {
+        const std::vector<Storage> &grid = grids_[working_grid_];
+        int h = block_height_, w = block_width_;
+        for (int j = 0; j != w; ++j) {
+            edges_[TOP][j] = grid[layout_.Index(0, j)];
+            edges_[BOTTOM][j] = grid[layout_.Index(h - 1, j)];
+        }
+        for (int i = 0; i != h; ++i) {
+            edges_[LEFT][i] = grid[layout_.Index(i, 0)];
+            edges_[RIGHT][i] = grid[layout_.Index(i, w - 1)];
+        }
+        static const int send_tags[4] = {LEFT_SEND, UP_SEND, RIGHT_SEND,
+                                         DOWN_SEND};
+        static const int recv_tags[4] = {LEFT_RECV, UP_RECV, RIGHT_RECV,
+                                         DOWN_RECV};
+        for (int c = 0; c != 4; ++c) {
+            CHANNEL ch = static_cast<CHANNEL>(c);
+            if (!mpi_wrapper_->HasNeighbor(ch))
+                continue;
+            mpi_wrapper_->PostSend(&edges_[ch][0], EdgeLength(ch), ch,
+                                   send_tags[ch]);
+            mpi_wrapper_->PostReceive(&halos_[ch][0], EdgeLength(ch), ch,
+                                      recv_tags[ch]);
+        }
+        for (int c = 0; c != 4; ++c)
+            mpi_wrapper_->Wait(static_cast<CHANNEL>(c));
+        return 0;
+    }
+
+    int Update() {
+        const Storage *in = &grids_[working_grid_][0];
+        Storage *out = &grids_[1 - working_grid_][0];
+        int tile_height = layout_.tile_height(), n = layout_.tile_width();
+        int h = block_height_, w = block_width_;
+        const Compute coefficient = coefficient_;
+        for (int t = 0; t != layout_.tiles(); ++t) {
+            int ti, tj;
+            layout_.Tile(t, &ti, &tj);
+            int k = layout_.Index(ti, tj);
+            // Neighboring tiles, at the cells next to the first row of this
+            // one (or NULL at the edges of the block)
+            const Storage *up = ti ? in + layout_.Index(ti - 1, tj) : NULL;
+            const Storage *down =
+                ti + tile_height != h ? in + layout_.Index(ti + tile_height, tj)
+                                      : NULL;
+            const Storage *left = tj ? in + layout_.Index(ti, tj - 1) : NULL;
+            const Storage *right =
+                tj + n != w ? in + layout_.Index(ti, tj + n) : NULL;
+
+            for (int r = 0; r != tile_height; ++r, k += n) {
+                const Storage *cur = in + k;
+                const Storage *above =
+                    r ? cur - n : up ? up : &halos_[TOP][tj];
+                const Storage *below = r != tile_height - 1
+                                           ? cur + n
+                                           : down ? down : &halos_[BOTTOM][tj];
+                Compute left_val = left ? left[r * n] : halos_[LEFT][ti + r];
+                Compute right_val =
+                    right ? right[r * n] : halos_[RIGHT][ti + r];
+                // Ends of the row, then the cells between them
+                out[k] = Cell(cur[0], above[0], below[0], left_val,
+                              n > 1 ? cur[1] : right_val, coefficient);
+                if (n > 1)
+                    out[k + n - 1] =
+                        Cell(cur[n - 1], above[n - 1], below[n - 1],
+                             cur[n - 2], right_val, coefficient);
+                for (int j = 1; j < n - 1; ++j)
+                    out[k + j] = Cell(cur[j], above[j], below[j], cur[j - 1],
+                                      cur[j + 1], coefficient);
+            }
+        }
+        return 0;
+    }
+
+    int CheckConvergence(int *converged) const {
+        const std::vector<Storage> &val1 = grids_[working_grid_];
+        const std::vector<Storage> &val2 = grids_[1 - working_grid_];
+        *converged = 1;
+        for (unsigned int k = 0; k != val1.size(); ++k)
+            if (!(std::fabs(val1[k] - val2[k]) <= 0.001f)) {
+                *converged = 0;
+                return 0;
+            }
+        return 0;
+    }
+
+    void ExchangeGrids() {
+        working_grid_ = 1 - working_grid_;
+    }
+
+    /*
+     * CopyBlock, LoadBlock: As HeatMap::CopyBlock and HeatMap::LoadBlock
+     */
+    int CopyBlock(double *buf) const {
+        for (int i = 0; i != block_height_; ++i)
+            for (int j = 0; j != block_width_; ++j)
+                *buf++ = grids_[working_grid_][layout_.Index(i, j)];
+        return 0;
+    }
+
+    int LoadBlock(const double *buf) {
+        for (int i = 0; i != block_height_; ++i)
+            for (int j = 0; j != block_width_; ++j)
+                grids_[working_grid_][layout_.Index(i, j)] =
+                    static_cast<Storage>(*buf++);
+        return 0;
+    }
+
+    void SetCoefficient(double coefficient) {
+        coefficient_ = coefficient;
+    }
+
+  private:
+    // The update of HeatMap::CellUpdate
+    static Storage Cell(Compute old_val, Compute top, Compute bottom,
+                        Compute left, Compute right, Compute coefficient) {
+        return static_cast<Storage>(
+            old_val + coefficient * (top + bottom - 2 * old_val) +
+            coefficient * (right + left - 2 * old_val));
+    }
+
+    int EdgeLength(CHANNEL ch) const {
+        return (ch == LEFT || ch == RIGHT) ? block_height_ : block_width_;
+    }
+
+    Layout layout_;
+    std::vector<Storage> grids_[2];
+    int working_grid_;
+    std::vector<Storage> halos_[4]; // Received, per channel
+    std::vector<Storage> edges_[4]; // Packed for sending, per channel
+
+    int block_height_;
+    int block_width_;
+
+    double coefficient_; // Diffusion coefficient of the update
+
+    BasicMPIWrapper<Storage> *mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(LayoutMap);
+};
+
+} // namespace heat_transfer
+
+#endif // __LAYOUT_H_
@@ -1,31 +1,635 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <mpi.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "argparse.h"
+#include "ensemble.h"
 #include "heat_transfer.h"
+#include "heat_transfer_3d.h"
+#include "heat_transfer_ooc.h"
+#include "job_pool.h"
+#include "parareal.h"
+#include "server.h"
 using namespace std;
 using namespace heat_transfer;
 
+// Parses a list of probes given as "row:col,row:col,...", returning non-zero
+// at the first item that is not a probe
+static int ParseProbes(const string &list, vector<Probe> *probes) {
+    istringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        Probe probe;
+        int end = 0;
+        if (sscanf(item.c_str(), "%d:%d%n", &probe.row, &probe.col,
+                   &end) != 2 ||
+            end != (int)item.size()) {
+            fprintf(stderr, "Invalid probe %s\n", item.c_str());
+            return 1;
+        }
+        probes->push_back(probe);
+    }
+    if (probes->empty()) {
+        fprintf(stderr, "No probes in %s\n", list.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+// Reads ensemble members, one "coefficient [steps]" line each
+static vector<Member> ReadMembers(const string &path, int steps) {
+    vector<Member> members;
+    ifstream file(path.c_str());
+    string line;
+    while (getline(file, line)) {
+        Member member;
+        member.steps = steps;
+        if (sscanf(line.c_str(), "%lf %d", &member.coefficient,
+                   &member.steps) >= 1)
+            members.push_back(member);
+    }
+    return members;
+}
+
+// Reads jobs, one "height width steps [workers]" line each
+static vector<Job> ReadJobs(const string &path) {
+    vector<Job> jobs;
+    ifstream file(path.c_str());
+    string line;
+    while (getline(file, line)) {
+        Job job;
+        job.workers = 0;
+        if (sscanf(line.c_str(), "%d %d %d %d", &job.height, &job.width,
+                   &job.steps, &job.workers) >= 3)
+            jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// Reads a domain mask, one line per row with '#' (or '1') for the cells in
+// the domain, and scales it to the grid by sampling the nearest mask cell
+static vector<char> ReadMask(const string &path, int height, int width) {
+    vector<string> rows;
+    ifstream file(path.c_str());
+    string line;
+    size_t columns = 0;
+    while (getline(file, line)) {
+        rows.push_back(line);
+        columns = max(columns, line.size());
+    }
+    vector<char> mask;
+    if (rows.empty() || !columns)
+        return mask;
+    mask.resize((size_t)height * width);
+    for (int i = 0; i != height; ++i) {
+        const string &row = rows[(size_t)i * rows.size() / height];
+        for (int j = 0; j != width; ++j) {
+            size_t col = (size_t)j * columns / width;
+            mask[(size_t)i * width + j] =
+                col < row.size() && (row[col] == '#' || row[col] == '1');
+        }
+    }
+    return mask;
+}
+
+static const char *TypeName(float) {
+    return "float";
+}
+
+static const char *TypeName(double) {
+    return "double";
+}
+
+static const char *const kCodecNames[] = {"raw", "fp32", "delta"};
+static const char *const kPrecisionNames[] = {"double", "float", "mixed"};
+static const char *const kSnapshotCodecNames[] = {"raw", "xor", "delta"};
+static const char *const kLayoutNames[] = {"rows", "tiles", "morton"};
+
+// Index of name among the count names, or -1 if it is none of them
+static int FindName(const char *const *names, int count, const string &name) {
+    for (int k = 0; k != count; ++k)
+        if (name == names[k])
+            return k;
+    return -1;
+}
+
+// Rejects option, if set, with any of the space separated others that are
+// set. Returns non-zero, after printing the first of them, if so.
+static int RejectOptions(const set<string> &set_options, const string &option,
+                         const string &others) {
+    if (!set_options.count(option))
+        return 0;
+    istringstream ss(others);
+    string other;
+    while (ss >> other)
+        if (set_options.count(other)) {
+            fprintf(stderr, "%s cannot be used with %s\n", option.c_str(),
+                    other.c_str());
+            return 1;
+        }
+    return 0;
+}
+
+// Runs the simulation with the given storage and compute types and halo
+// codec after the double precision one with raw halos, on the same workers,
+// and reports the error of the final grid against the double one. The final
+// grid of the former is written to path, unless empty.
+template <typename Storage, typename Compute>
+static int CompareAgainstDouble(int height, int width, int steps,
+                                HALO_CODEC codec, double error_bound,
+                                const string &path) {
+    MPIWrapper world;
+    world.Init();
+    HeatTransfer reference;
+    BasicHeatTransfer<Storage, Compute> simulation;
+    reference.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+    simulation.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+    int err = simulation.SetHaloCodec(codec, error_bound);
+    if (err)
+        world.PrintRoot(stderr, "Invalid halo error bound\n");
+
+    if (!err) {
+        world.PrintRoot(stdout, "Storage: double, arithmetic: double, "
+                                "halos: raw\n");
+        reference.Run();
+        world.PrintRoot(stdout, "\nStorage: %s, arithmetic: %s, halos: %s\n",
+                        TypeName(Storage()), TypeName(Compute()),
+                        kCodecNames[codec]);
+        err = simulation.Run() || simulation.ReportError(reference);
+        if (!err && !path.empty())
+            err = simulation.WriteGrid(path.c_str());
+    }
+
+    simulation.Destroy();
+    reference.Destroy();
+    world.Destroy();
+    return err;
+}
+
+// Runs the simulation with the uniform diffusivity, then with the
+// diffusivities of the grid file at field_path, or unless given, a
+// checkerboard of 1 and diffusivity (see HeatMap::EnableDiffusivity), on the
+// same workers, and compares the throughput of the two updates. The final
+// grid of the latter is written to path, unless empty.
+static int CompareDiffusivity(int height, int width, int steps,
+                              double diffusivity, const string &field_path,
+                              const string &path) {
+    MPIWrapper world;
+    world.Init();
+    HeatTransfer uniform, materials;
+    uniform.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+    materials.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+    int err = field_path.empty()
+                  ? materials.EnableDiffusivity(CheckerboardDiffusivity(
+                        diffusivity, height, width))
+                  : materials.LoadDiffusivity(field_path);
+    if (err)
+        world.PrintRoot(stderr, "Invalid diffusivity, not positive or too "
+                                "large for a stable update\n");
+
+    if (!err) {
+        world.PrintRoot(stdout, "Uniform diffusivity\n");
+        uniform.Run();
+        if (field_path.empty())
+            world.PrintRoot(stdout,
+                            "\nCheckerboard of diffusivities 1 and %g\n",
+                            diffusivity);
+        else
+            world.PrintRoot(stdout, "\nDiffusivities of %s\n",
+                            field_path.c_str());
+        err = materials.Run();
+        world.PrintRoot(stdout,
+                        "\nThroughput: %.1f Mcells/s uniform, %.1f Mcells/s "
+                        "heterogeneous (%.2f)\n",
+                        uniform.throughput() / 1e6,
+                        materials.throughput() / 1e6,
+                        materials.throughput() / uniform.throughput());
+        if (!err && !path.empty())
+            err = materials.WriteGrid(path.c_str());
+    }
+
+    materials.Destroy();
+    uniform.Destroy();
+    world.Destroy();
+    return err;
+}
+
+// Runs the simulation on grids of the given height and of each of the given
+// widths, with unpadded rows and with the padded pitch of HeatMap::SetRowPitch,
+// and prints the throughput of both
+static int SweepWidths(int height, const string &list, int steps) {
+    MPIWrapper world;
+    world.Init();
+    vector<int> widths;
+    istringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        char *end;
+        long width = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end || width < 1 || width > INT_MAX) {
+            world.PrintRoot(stderr, "Invalid width %s\n", item.c_str());
+            world.Destroy();
+            return 1;
+        }
+        widths.push_back(width);
+    }
+
+    world.PrintRoot(stdout, "%8s %8s %8s %14s %14s %8s\n", "Width", "Unpadded",
+                    "Padded", "Unpadded", "Padded", "Ratio");
+    world.PrintRoot(stdout, "%8s %8s %8s %14s %14s\n", "", "pitch", "pitch",
+                    "Mcells/s", "Mcells/s");
+    int err = 0;
+    for (size_t w = 0; !err && w != widths.size(); ++w) {
+        int width = widths[w];
+        HeatTransfer unpadded, padded;
+        unpadded.SetRowPitch(1);
+        unpadded.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+        padded.InitWithCommunicator(MPI_COMM_WORLD, height, width, steps);
+        unpadded.SetOutput(NULL);
+        padded.SetOutput(NULL);
+        err = unpadded.Run() || padded.Run();
+        world.PrintRoot(stdout, "%8d %8u %8u %14.1f %14.1f %8.2f\n", width,
+                        unpadded.row_pitch(), padded.row_pitch(),
+                        unpadded.throughput() / 1e6, padded.throughput() / 1e6,
+                        padded.throughput() / unpadded.throughput());
+        padded.Destroy();
+        unpadded.Destroy();
+    }
+    world.Destroy();
+    return err;
+}
+
 int main(int argc, char *argv[]) {
     // Setup and parse arguments
     ArgumentParser parser("mpi_heat", "HeatTransfer implementation in MPI");
     parser.AddArgument("-h", "Grid height", true);
     parser.AddArgument("-w", "Grid width", true);
     parser.AddArgument("-s", "Time steps", true);
+    parser.AddArgument("-D", "Volume depth, for a 3D simulation", false);
+    parser.AddArgument("-B", "3D rows per band of the 2.5D blocking (default "
+                             "whole planes)",
+                       false);
+    parser.AddArgument("-O", "Keep the grid on disk, in scratch files in the "
+                             "given directory",
+                       false);
+    parser.AddArgument("-N", "Rows per band of the on-disk grid (default 64)",
+                       false);
+    parser.AddArgument("-F", "Steps fused per pass over the on-disk grid "
+                             "(default 8)",
+                       false);
+    parser.AddArgument("-l", "Grid sequencing levels (steady state)", false);
+    parser.AddArgument("-a", "Asynchronous relaxation (steady state), 0/1",
+                       false);
+    parser.AddArgument("-T", "Tile size for active-region tracking", false);
+    parser.AddArgument("-e", "Tile freezing threshold (default 1e-4)", false);
+    parser.AddArgument("-P", "Precision: double, float or mixed (float "
+                             "storage, double arithmetic)",
+                       false);
+    parser.AddArgument("-c", "Halo codec: raw, fp32 or delta", false);
+    parser.AddArgument("-b", "Halo delta codec error bound (default 1e-5)",
+                       false);
+    parser.AddArgument("-x", "Stencil: 5, 9 (isotropic) or 13 (fourth "
+                             "order) points",
+                       false);
+    parser.AddArgument("-d", "Diffusivity of the second material of a "
+                             "checkerboard, compared against uniform",
+                       false);
+    parser.AddArgument("-f", "Diffusivity grid file (see grid_file.h), "
+                             "compared against uniform",
+                       false);
+    parser.AddArgument("-L", "Grid layout: rows, tiles (8x8) or morton "
+                             "(Z-ordered tiles)",
+                       false);
+    parser.AddArgument("-M", "Domain mask file, a line per row with '#' "
+                             "for the cells in the domain",
+                       false);
+    parser.AddArgument("-R", "Row pitch in cells (default 0, padded to cache "
+                             "lines; 1 for unpadded rows)",
+                       false);
+    parser.AddArgument("-W", "Compare unpadded and padded rows on widths "
+                             "w1,w2,... (ignores -w)",
+                       false);
+    parser.AddArgument("-C", "Checkpoint file, written every -I steps", false);
+    parser.AddArgument("-I", "Steps between checkpoints (default 1000)",
+                       false);
+    parser.AddArgument("-U", "Resume from the given checkpoint file", false);
+    parser.AddArgument("-V", "Snapshot file prefix, a binary file per worker "
+                             "written every -n steps",
+                       false);
+    parser.AddArgument("-n", "Steps between snapshots (default 1000)", false);
+    parser.AddArgument("-Z", "Snapshot codec: raw, xor (lossless) or delta "
+                             "(error-bounded)",
+                       false);
+    parser.AddArgument("-z", "Snapshot delta codec error bound (default "
+                             "1e-5)",
+                       false);
+    parser.AddArgument("-H", "Read the snapshots back after the run and "
+                             "check them, 0/1",
+                       false);
+    parser.AddArgument("-G", "Image file prefix, a PPM image of the grid "
+                             "rendered every -Y steps",
+                       false);
+    parser.AddArgument("-Y", "Steps between images (default 1000)", false);
+    parser.AddArgument("-X", "Image resolution, HEIGHTxWIDTH (default "
+                             "512x512)",
+                       false);
+    parser.AddArgument("-Q", "Statistics file, the energy, min, max, mean "
+                             "and location of the max every -K steps",
+                       false);
+    parser.AddArgument("-K", "Steps between statistics (default 1000)",
+                       false);
+    parser.AddArgument("-i", "Initial condition grid file (eg. a checkpoint)",
+                       false);
+    parser.AddArgument("-r", "In-place update with rolling rows, 0/1", false);
+    parser.AddArgument("-m", "Simulate a mirrored quadrant only, 0/1", false);
+    parser.AddArgument("-o", "Write the final grid to file", false);
+    parser.AddArgument("-q", "Probe cells to query, row:col,...", false);
+    parser.AddArgument("-E", "Ensemble file, \"coefficient [steps]\" lines",
+                       false);
+    parser.AddArgument("-J", "Job list, \"height width steps [workers]\" "
+                             "lines (ignores -h, -w and -s)",
+                       false);
+    parser.AddArgument("-g", "Workers per job group (default 1)", false);
+    parser.AddArgument("-S", "Serve requests on UNIX socket path (ignores "
+                             "-h, -w and -s)",
+                       false);
+    parser.AddArgument("-p", "Parareal time slices", false);
+    parser.AddArgument("-k", "Parareal max iterations", false);
+    parser.AddArgument("-t", "Parareal tolerance", false);
     if (parser.Parse(argc, argv))
         exit(EXIT_FAILURE);
 
     int height = parser.GetValue<int>("-h");
     int width = parser.GetValue<int>("-w");
     int steps = parser.GetValue<int>("-s");
+    int levels = parser.GetValue<int>("-l", 1);
+    int slices = parser.GetValue<int>("-p", 0);
+    int async = parser.GetValue<int>("-a", 0);
+    int stencil = parser.GetValue<int>("-x", 0);
+    string layout = parser.GetValue<string>("-L", "");
+    string precision = parser.GetValue<string>("-P", "double");
+    string codec_name = parser.GetValue<string>("-c", "raw");
+
+    // The options set, those of a mode only when they select it
+    set<string> set_options;
+    const char *const kOptions[] = {"-M", "-T", "-q", "-C", "-U",
+                                    "-G", "-Q", "-V", "-i"};
+    for (size_t k = 0; k != sizeof(kOptions) / sizeof(kOptions[0]); ++k)
+        if (parser.IsSet(kOptions[k]))
+            set_options.insert(kOptions[k]);
+    if (parser.GetValue<int>("-m", 0))
+        set_options.insert("-m");
+    if (parser.GetValue<int>("-r", 0))
+        set_options.insert("-r");
+    if (parser.GetValue<int>("-R", 0))
+        set_options.insert("-R");
+    if (parser.GetValue<int>("-H", 0))
+        set_options.insert("-H");
+    if (async)
+        set_options.insert("-a");
+    if (levels > 1)
+        set_options.insert("-l");
+    if (stencil)
+        set_options.insert("-x");
+    if (!layout.empty())
+        set_options.insert("-L");
+    if (precision != "double")
+        set_options.insert("-P");
+    if (codec_name != "raw")
+        set_options.insert("-c");
+    // The modes other than the plain simulation, HeatTransfer::Run
+    const string modes = "-q -a -l -x -L";
+    // And the options of the plain simulation
+    const string plain_options = "-r -R -T -m -M -C -U -G -Q -V -H -i";
+
+    // Resident workers running requested simulations
+    if (parser.IsSet("-S")) {
+        Server server;
+        if (server.Init(parser.GetValue<string>("-S").c_str()))
+            exit(EXIT_FAILURE);
+        server.Run();
+        server.Destroy();
+        exit(EXIT_SUCCESS);
+    }
+
+    // Independent simulations on groups of workers
+    if (parser.IsSet("-J")) {
+        JobPool pool;
+        if (pool.Init(ReadJobs(parser.GetValue<string>("-J")),
+                      parser.GetValue<int>("-g", 1)))
+            exit(EXIT_FAILURE);
+        pool.Run();
+        pool.Destroy();
+        exit(EXIT_SUCCESS);
+    }
+
+    // Batches of small simulations, each worker running whole grids
+    if (parser.IsSet("-E")) {
+        Ensemble ensemble;
+        if (ensemble.Init(height, width,
+                          ReadMembers(parser.GetValue<string>("-E"), steps)))
+            exit(EXIT_FAILURE);
+        ensemble.Run(parser.GetValue<string>("-o", ""));
+        ensemble.Destroy();
+        exit(EXIT_SUCCESS);
+    }
+
+    // Volumes, with the seven-point stencil
+    if (parser.IsSet("-D")) {
+        HeatTransfer3D simulation;
+        simulation.Init(parser.GetValue<int>("-D"), height, width, steps);
+        int err = parser.IsSet("-B") &&
+                  simulation.SetBlocking(parser.GetValue<int>("-B"));
+        if (!err)
+            err = simulation.Run();
+        if (!err && parser.IsSet("-o"))
+            err = simulation.WriteGrid(parser.GetValue<string>("-o").c_str());
+        simulation.Destroy();
+        exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // Grids larger than memory, streamed from disk
+    if (parser.IsSet("-O")) {
+        OutOfCoreHeatTransfer simulation;
+        int err = simulation.Init(height, width, steps,
+                                  parser.GetValue<string>("-O"),
+                                  parser.GetValue<int>("-N", 64),
+                                  parser.GetValue<int>("-F", 8));
+        if (!err)
+            err = simulation.Run();
+        if (!err && parser.IsSet("-o"))
+            err = simulation.WriteGrid(parser.GetValue<string>("-o").c_str());
+        simulation.Destroy();
+        exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // Reduced precision or compressed halos, compared against double
+    // precision
+    if (RejectOptions(set_options, "-P", plain_options + " " + modes) ||
+        RejectOptions(set_options, "-c", plain_options + " " + modes))
+        exit(EXIT_FAILURE);
+    double error_bound = parser.GetValue<double>("-b", 1e-5);
+    int codec_index = FindName(kCodecNames, HALO_DELTA + 1, codec_name);
+    if (codec_index < 0) {
+        fprintf(stderr, "Unknown halo codec %s\n", codec_name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    HALO_CODEC codec = static_cast<HALO_CODEC>(codec_index);
+    if (FindName(kPrecisionNames, 3, precision) < 0) {
+        fprintf(stderr, "Unknown precision %s\n", precision.c_str());
+        exit(EXIT_FAILURE);
+    }
+    string path = parser.GetValue<string>("-o", "");
+    if (precision == "float")
+        exit(CompareAgainstDouble<float, float>(height, width, steps, codec,
+                                                error_bound, path)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+    if (precision == "mixed")
+        exit(CompareAgainstDouble<float, double>(height, width, steps, codec,
+                                                 error_bound, path)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+    if (codec != HALO_RAW)
+        exit(CompareAgainstDouble<double, double>(height, width, steps, codec,
+                                                  error_bound, path)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+
+    // Heterogeneous materials, compared against the uniform diffusivity
+    if (parser.IsSet("-d") || parser.IsSet("-f"))
+        exit(CompareDiffusivity(height, width, steps,
+                                parser.GetValue<double>("-d", 1.0),
+                                parser.GetValue<string>("-f", ""),
+                                parser.GetValue<string>("-o", ""))
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+
+    // Row padding, on a range of widths
+    if (parser.IsSet("-W"))
+        exit(SweepWidths(height, parser.GetValue<string>("-W"), steps)
+                 ? EXIT_FAILURE
+                 : EXIT_SUCCESS);
+
+    // Parallel-in-time integration over groups of workers
+    if (slices > 0) {
+        Parareal simulation;
+        if (simulation.Init(height, width, steps, slices,
+                            parser.GetValue<int>("-k", slices),
+                            parser.GetValue<double>("-t", 0.001)))
+            exit(EXIT_FAILURE);
+        simulation.Run();
+        simulation.Destroy();
+        exit(EXIT_SUCCESS);
+    }
 
     // Setup and run simulation with given arguments
     HeatTransfer simulation;
-    simulation.Init(height, width, steps);
-    simulation.Run();
+    simulation.SetInPlace(parser.GetValue<int>("-r", 0));
+    simulation.SetRowPitch(parser.GetValue<int>("-R", 0));
+    simulation.Init(height, width, steps, parser.GetValue<int>("-m", 0));
+    bool masked = parser.IsSet("-M");
+    int err, image_height = 512, image_width = 512;
+    vector<Probe> probes;
+    string snapshot_codec_name = parser.GetValue<string>("-Z", "raw");
+    int snapshot_codec = FindName(kSnapshotCodecNames, SNAPSHOT_DELTA + 1,
+                                  snapshot_codec_name);
+    if (!layout.empty() && FindName(kLayoutNames, 3, layout) < 0) {
+        fprintf(stderr, "Unknown layout %s\n", layout.c_str());
+        err = 1;
+    } else if (stencil && stencil != 5 && stencil != 9 && stencil != 13) {
+        fprintf(stderr, "Unknown stencil %d\n", stencil);
+        err = 1;
+    } else if (snapshot_codec < 0) {
+        fprintf(stderr, "Unknown snapshot codec %s\n",
+                snapshot_codec_name.c_str());
+        err = 1;
+    } else if (parser.IsSet("-q") &&
+               ParseProbes(parser.GetValue<string>("-q"), &probes))
+        err = 1;
+    else if (RejectOptions(set_options, "-r", "-T " + modes) ||
+               RejectOptions(set_options, "-R", modes) ||
+               RejectOptions(set_options, "-M", "-r -T " + modes) ||
+               RejectOptions(set_options, "-C", "-M -T " + modes) ||
+               RejectOptions(set_options, "-U", "-M -T -i " + modes) ||
+               RejectOptions(set_options, "-G", "-M -m " + modes) ||
+               RejectOptions(set_options, "-Q", "-M " + modes) ||
+               RejectOptions(set_options, "-V", modes) ||
+               RejectOptions(set_options, "-i", "-m -l"))
+        err = 1;
+    else if (parser.IsSet("-T") &&
+             simulation.EnableTiles(parser.GetValue<int>("-T"),
+                                    parser.GetValue<double>("-e", 1e-4)))
+        err = 1;
+    else if (parser.IsSet("-C") &&
+             simulation.EnableCheckpoints(parser.GetValue<string>("-C"),
+                                          parser.GetValue<int>("-I", 1000)))
+        err = 1;
+    else if (parser.IsSet("-G") && parser.IsSet("-X") &&
+             (sscanf(parser.GetValue<string>("-X").c_str(), "%dx%d",
+                     &image_height, &image_width) != 2 ||
+              image_height < 1 || image_width < 1)) {
+        fprintf(stderr, "The image resolution must be HEIGHTxWIDTH\n");
+        err = 1;
+    } else if (parser.IsSet("-G") &&
+               simulation.EnableRendering(parser.GetValue<string>("-G"),
+                                          parser.GetValue<int>("-Y", 1000),
+                                          image_height, image_width))
+        err = 1;
+    else if (parser.IsSet("-Q") &&
+             simulation.EnableStatistics(parser.GetValue<string>("-Q"),
+                                         parser.GetValue<int>("-K", 1000)))
+        err = 1;
+    else if (parser.IsSet("-V") &&
+             simulation.EnableSnapshots(
+                 parser.GetValue<string>("-V"),
+                 parser.GetValue<int>("-n", 1000),
+                 static_cast<SNAPSHOT_CODEC>(snapshot_codec),
+                 parser.GetValue<double>("-z", 1e-5)))
+        err = 1;
+    else if (parser.IsSet("-i") && simulation.LoadInitialCondition(
+                                       parser.GetValue<string>("-i")))
+        err = 1;
+    else if (parser.IsSet("-U") &&
+             simulation.Restart(parser.GetValue<string>("-U")))
+        err = 1;
+    else if (masked && simulation.EnableMask(ReadMask(
+                             parser.GetValue<string>("-M"), height, width)))
+        err = 1;
+    else if (parser.IsSet("-q"))
+        err = simulation.RunProbes(probes);
+    else if (async)
+        err = simulation.RunAsync();
+    else if (levels > 1)
+        err = simulation.RunNested(levels);
+    else if (stencil == 5)
+        err = simulation.RunStencil<FivePointStencil>();
+    else if (stencil == 9)
+        err = simulation.RunStencil<NinePointStencil>();
+    else if (stencil == 13)
+        err = simulation.RunStencil<FourthOrderStencil>();
+    else if (layout == "rows")
+        err = simulation.RunLayout<RowMajorLayout>();
+    else if (layout == "tiles")
+        err = simulation.RunLayout<TiledLayout>();
+    else if (layout == "morton")
+        err = simulation.RunLayout<MortonLayout>();
+    else
+        err = simulation.Run();
+    if (!err && parser.GetValue<int>("-H", 0))
+        err = simulation.CheckSnapshots();
+    if (!err && parser.IsSet("-o"))
+        err = simulation.WriteGrid(parser.GetValue<string>("-o").c_str());
 
     // Bye, bye...
     simulation.Destroy();
-    exit(EXIT_SUCCESS);
+    exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
 }
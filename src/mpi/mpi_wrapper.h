@@ -1,11 +1,17 @@
 #ifndef __MPI_WRAPPER_H_
 #define __MPI_WRAPPER_H_
 
+#include "grid_file.h"
 #include "macros.h"
+#include "statistics.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <mpi.h>
+#include <string>
+#include <vector>
 
 namespace heat_transfer {
 
@@ -24,15 +30,65 @@ enum TAG {
     UP_RECV
 };
 
-class MPIWrapper {
+// Tags of the message counts exchanged when an asynchronous run terminates
+enum COUNT_TAG {
+    LEFT_COUNT_SEND = 20,
+    UP_COUNT_SEND,
+    RIGHT_COUNT_SEND,
+    DOWN_COUNT_SEND,
+    RIGHT_COUNT_RECV = LEFT_COUNT_SEND,
+    DOWN_COUNT_RECV,
+    LEFT_COUNT_RECV,
+    UP_COUNT_RECV
+};
+
+// Encodings of the halos sent by MPIWrapper::Send, see
+// MPIWrapper::SetHaloCodec
+enum HALO_CODEC { HALO_RAW, HALO_FP32, HALO_DELTA };
+
+// MPI datatype of the grid storage types
+template <typename T> struct MPIDatatype;
+
+template <> struct MPIDatatype<double> {
+    static MPI_Datatype Get() {
+        return MPI_DOUBLE;
+    }
+};
+
+template <> struct MPIDatatype<float> {
+    static MPI_Datatype Get() {
+        return MPI_FLOAT;
+    }
+};
+
+/*
+ * Halos are transferred in the storage type T of the grid, see BasicHeatMap
+ */
+template <typename T> class BasicMPIWrapper {
   public:
-    MPIWrapper() {
+    BasicMPIWrapper() : reorder_(true) {
     }
 
+    /*
+     * Initializes MPI and attaches the wrapper to MPI_COMM_WORLD
+     */
     int Init() {
         MPI_Init(NULL, NULL);
-        MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
-        MPI_Comm_size(MPI_COMM_WORLD, &comm_sz_);
+        Init(MPI_COMM_WORLD);
+        owns_mpi_ = true;
+        return 0;
+    }
+
+    /*
+     * Attaches the wrapper to a communicator of an already initialized MPI
+     */
+    int Init(MPI_Comm comm) {
+        owns_mpi_ = false;
+        comm_ = comm;
+        topology_comm_ = MPI_COMM_NULL;
+        active_ = true;
+        MPI_Comm_rank(comm_, &rank_);
+        MPI_Comm_size(comm_, &comm_sz_);
 
         int n;
         MPI_Get_processor_name(processor_name_, &n);
@@ -42,14 +98,71 @@ class MPIWrapper {
         neighbors_[RIGHT] = MPI_PROC_NULL;
         neighbors_[BOTTOM] = MPI_PROC_NULL;
 
+        column_t_ = MPI_DATATYPE_NULL;
+        row_pitch_ = 0;
+        wide_row_t_ = wide_column_t_ = MPI_DATATYPE_NULL;
+        wide_radius_ = 0;
+        for (int ch = 0; ch != 4; ++ch) {
+            requests_[ch][IN] = requests_[ch][OUT] = MPI_REQUEST_NULL;
+            recv_addr_[ch] = NULL;
+        }
+        reduce_request_ = MPI_REQUEST_NULL;
+        checkpoint_file_ = MPI_FILE_NULL;
+        checkpoint_request_ = MPI_REQUEST_NULL;
+        SetHaloCodec(HALO_RAW, 0.0);
+        MPI_Type_contiguous(sizeof(GridStatistics) / sizeof(double),
+                            MPI_DOUBLE, &statistics_t_);
+        MPI_Type_commit(&statistics_t_);
+        MPI_Op_create(&BasicMPIWrapper::CombineStatistics, 1, &statistics_op_);
+
         return 0;
     }
 
     int Destroy() {
-        MPI_Finalize();
+        FinishCheckpoint();
+        if (statistics_op_ != MPI_OP_NULL)
+            MPI_Op_free(&statistics_op_);
+        if (statistics_t_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&statistics_t_);
+        if (column_t_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&column_t_);
+        FreeWideTypes();
+        if (topology_comm_ != MPI_COMM_NULL)
+            MPI_Comm_free(&topology_comm_);
+        if (owns_mpi_)
+            MPI_Finalize();
         return 0;
     }
 
+    /*
+     * Splits the wrapped communicator, as in MPI_Comm_split
+     */
+    int Split(int color, int key, MPI_Comm *comm) const {
+        return MPI_Comm_split(comm_, color, key, comm);
+    }
+
+    /*
+     * Whether a grid of the given dimensions can be distributed equally to
+     * the workers
+     */
+    bool CanCreateTopology(int height, int width) const {
+        int d[2] = {0, 0};
+        MPI_Dims_create(comm_sz_, 2, d);
+        return height > 0 && width > 0 && !(height % d[0]) && !(width % d[1]);
+    }
+
+    /*
+     * Whether MPI may renumber the workers in the topology (the default), in
+     * which case the root of the topology need not be the first worker of
+     * the wrapped communicator. Call before MPIWrapper::CreateTopology.
+     */
+    void SetReorder(bool reorder) {
+        reorder_ = reorder;
+    }
+
+    /*
+     * Creates the topology, replacing any previous one
+     */
     int CreateTopology(int height, int width) {
         int d[2] = {0, 0};
         MPI_Dims_create(comm_sz_, 2, d);
@@ -65,21 +178,28 @@ class MPIWrapper {
                     "Tried to split a %dx%d grid into a %dx%d topology\n",
                     height, width, d[0], d[1]);
             }
-            MPI_Barrier(MPI_COMM_WORLD);
-            MPI_Abort(MPI_COMM_WORLD, 1);
+            MPI_Barrier(comm_);
+            MPI_Abort(comm_, 1);
         }
 
         // Save the topology dimensions internally
         topology_height_ = d[0];
         topology_width_ = d[1];
+        topology_size_ = comm_sz_;
+        active_ = true;
+        coords_.clear();
 
         // Create topology
+        if (topology_comm_ != MPI_COMM_NULL) {
+            MPI_Comm_free(&topology_comm_);
+            MPI_Comm_rank(comm_, &rank_);
+        }
         const int periods[2] = {0, 0};  // No wrap
-        MPI_Cart_create(MPI_COMM_WORLD, // Input communicator
+        MPI_Cart_create(comm_,          // Input communicator
                         2,              // 2D topology
                         d,              // Topology dimensions
                         periods,        // No wrap
-                        1,              // Allow reordering
+                        reorder_,       // Allow reordering
                         &topology_comm_);
 
         // Determine worker's (possibly new) rank and topology coordinates
@@ -100,9 +220,166 @@ class MPIWrapper {
         return 0;
     }
 
-    int Send(const double *buf, CHANNEL ch, int tag) {
-        int count;
-        MPI_Datatype datatype;
+    /*
+     * ExcludeIdle: Leaves the workers that are not active out of the
+     * topology. Their neighbors no longer exchange halos with them, and the
+     * collectives only involve the active workers, renumbered in rank order.
+     * The idle workers must not use the wrapper afterwards, other than to
+     * destroy it.
+     */
+    int ExcludeIdle(bool active) {
+        int flag = active;
+        std::vector<int> flags(topology_size_);
+        MPI_Allgather(&flag, 1, MPI_INT, &flags[0], 1, MPI_INT,
+                      topology_comm_);
+        for (int ch = 0; ch != 4; ++ch)
+            if (HasNeighbor(static_cast<CHANNEL>(ch)) && !flags[neighbors_[ch]])
+                neighbors_[ch] = MPI_PROC_NULL;
+
+        // Coordinates of the active workers, by their new ranks
+        std::vector<int> coords;
+        for (int r = 0; r != topology_size_; ++r)
+            if (flags[r]) {
+                int d[2];
+                MPI_Cart_coords(topology_comm_, r, 2, d);
+                coords.insert(coords.end(), d, d + 2);
+            }
+
+        MPI_Comm comm;
+        MPI_Comm_split(topology_comm_, active ? 0 : MPI_UNDEFINED, rank_,
+                       &comm);
+        if (active) {
+            MPI_Group group, active_group;
+            MPI_Comm_group(topology_comm_, &group);
+            MPI_Comm_group(comm, &active_group);
+            int neighbors[4];
+            MPI_Group_translate_ranks(group, 4, neighbors_, active_group,
+                                      neighbors);
+            std::copy(neighbors, neighbors + 4, neighbors_);
+            MPI_Group_free(&group);
+            MPI_Group_free(&active_group);
+            MPI_Comm_rank(comm, &rank_);
+        }
+        MPI_Comm_free(&topology_comm_);
+        topology_comm_ = comm;
+        topology_size_ = coords.size() / 2;
+        coords_.swap(coords);
+        active_ = active;
+        return 0;
+    }
+
+    /*
+     * Changes the block dimensions used for halo transfers, eg. when moving
+     * between the levels of a grid sequence on the same topology
+     */
+    int SetBlockDimensions(int block_height, int block_width) {
+        block_height_ = block_height;
+        block_width_ = block_width;
+        return CreateTypes();
+    }
+
+    /*
+     * Sets the distance between the rows of the grids whose halos are
+     * transferred, in cells (see HeatMap::SetRowPitch). Zero stands for the
+     * row length with halos.
+     */
+    int SetRowPitch(int pitch) {
+        row_pitch_ = pitch;
+        return topology_comm_ != MPI_COMM_NULL ? CreateTypes() : 0;
+    }
+
+    /*
+     * ExchangeWideHalos: Blocking halo exchange of a grid whose halos are
+     * radius cells wide on every side (rows of block width + 2 * radius),
+     * given the address of its first halo cell. Rows are exchanged first, so
+     * that with corners set the columns can include the halo rows, passing
+     * the corners on to the diagonal neighbors in two hops.
+     */
+    int ExchangeWideHalos(T *grid, int radius, bool corners) {
+        if (radius != wide_radius_ || corners != wide_corners_)
+            CreateWideTypes(radius, corners);
+        int row = block_width_ + 2 * radius;
+        T *block = grid + radius * row + radius; // First block cell
+
+        // Top rows up, bottom halo from below, and the other way around
+        MPI_Sendrecv(block, 1, wide_row_t_, neighbors_[TOP], UP_SEND,
+                     block + block_height_ * row, 1, wide_row_t_,
+                     neighbors_[BOTTOM], DOWN_RECV, topology_comm_,
+                     MPI_STATUS_IGNORE);
+        MPI_Sendrecv(block + (block_height_ - radius) * row, 1, wide_row_t_,
+                     neighbors_[BOTTOM], DOWN_SEND, block - radius * row, 1,
+                     wide_row_t_, neighbors_[TOP], UP_RECV, topology_comm_,
+                     MPI_STATUS_IGNORE);
+
+        // Left columns to the left, right halo from the right, and back
+        T *first = corners ? block - radius * row : block;
+        MPI_Sendrecv(first, 1, wide_column_t_, neighbors_[LEFT], LEFT_SEND,
+                     first + block_width_, 1, wide_column_t_,
+                     neighbors_[RIGHT], RIGHT_RECV, topology_comm_,
+                     MPI_STATUS_IGNORE);
+        MPI_Sendrecv(first + block_width_ - radius, 1, wide_column_t_,
+                     neighbors_[RIGHT], RIGHT_SEND, first - radius, 1,
+                     wide_column_t_, neighbors_[LEFT], LEFT_RECV,
+                     topology_comm_, MPI_STATUS_IGNORE);
+        return 0;
+    }
+
+    /*
+     * SetHaloCodec: Selects how MPIWrapper::Send encodes the halos, which
+     * MPIWrapper::Wait decodes on receipt:
+     *  - HALO_RAW sends the values as they are stored,
+     *  - HALO_FP32 truncates them to float,
+     *  - HALO_DELTA quantizes the difference from the previous halo of the
+     *    channel in steps of twice the error bound, sent as 16 or 32-bit
+     *    integers (or raw, when they do not fit). The sender tracks the
+     *    values decoded by the receiver, so the error does not accumulate
+     *    over the steps.
+     * Every worker must select the same codec. Resets the statistics of
+     * MPIWrapper::PrintHaloStatistics.
+     */
+    int SetHaloCodec(HALO_CODEC codec, double error_bound) {
+        if (codec == HALO_DELTA && !(error_bound > 0.0))
+            return 1;
+        codec_ = codec;
+        error_bound_ = error_bound;
+        raw_bytes_ = encoded_bytes_ = drift_ = 0.0;
+        for (int ch = 0; ch != 4; ++ch) {
+            send_reference_[ch].clear();
+            recv_reference_[ch].clear();
+        }
+        return 0;
+    }
+
+    HALO_CODEC halo_codec() const {
+        return codec_;
+    }
+
+    /*
+     * Reports the compression ratio of the halos sent by all workers, and the
+     * largest difference between a halo value and its decoded value
+     */
+    int PrintHaloStatistics(FILE *fp) const {
+        double raw = 0.0, encoded = 0.0, drift = 0.0;
+        ReduceSum(&raw_bytes_, &raw);
+        ReduceSum(&encoded_bytes_, &encoded);
+        ReduceMax(&drift_, &drift);
+        return PrintRoot(fp,
+                         "Halo compression: %.2f (%.0f of %.0f bytes), "
+                         "max drift: %.3e\n",
+                         encoded > 0.0 ? raw / encoded : 1.0, encoded, raw,
+                         drift);
+    }
+
+    int Send(const T *buf, CHANNEL ch, int tag) {
+        if (codec_ != HALO_RAW) {
+            if (this->HasNeighbor(ch))
+                MPI_Isend(&send_bytes_[ch][0], EncodeHalo(buf, ch), MPI_BYTE,
+                          neighbors_[ch], tag, topology_comm_,
+                          &requests_[ch][OUT]);
+            return 0;
+        }
+        int count = 0;
+        MPI_Datatype datatype = MPIDatatype<T>::Get();
         // Only send if there is a neighbor out there
         if (this->HasNeighbor(ch)) {
             if (ch == LEFT || ch == RIGHT) {
@@ -111,7 +388,7 @@ class MPIWrapper {
             }
             if (ch == TOP || ch == BOTTOM) {
                 count = block_width_;
-                datatype = MPI_DOUBLE;
+                datatype = MPIDatatype<T>::Get();
             }
             MPI_Isend(buf,                  // outgoing buffer
                       count,                // how many elements?
@@ -124,9 +401,20 @@ class MPIWrapper {
         return 0;
     }
 
-    int Receive(double *buf, CHANNEL ch, int tag) {
-        int count;
-        MPI_Datatype datatype;
+    int Receive(T *buf, CHANNEL ch, int tag) {
+        if (codec_ != HALO_RAW) {
+            // Decoded into buf by MPIWrapper::Wait
+            if (this->HasNeighbor(ch)) {
+                recv_addr_[ch] = buf;
+                recv_bytes_[ch].resize(MaxEncodedSize(ch));
+                MPI_Irecv(&recv_bytes_[ch][0], MaxEncodedSize(ch), MPI_BYTE,
+                          neighbors_[ch], tag, topology_comm_,
+                          &requests_[ch][IN]);
+            }
+            return 0;
+        }
+        int count = 0;
+        MPI_Datatype datatype = MPIDatatype<T>::Get();
         // Only receive if there is a neighbor out there
         if (this->HasNeighbor(ch)) {
             if (ch == LEFT || ch == RIGHT) {
@@ -135,7 +423,7 @@ class MPIWrapper {
             }
             if (ch == TOP || ch == BOTTOM) {
                 count = block_width_;
-                datatype = MPI_DOUBLE;
+                datatype = MPIDatatype<T>::Get();
             }
             MPI_Irecv(buf,                 // incoming buffer
                       count,               // how many elements?
@@ -148,14 +436,124 @@ class MPIWrapper {
         return 0;
     }
 
+    /*
+     * Blocking point-to-point transfers, for messages that do not follow the
+     * neighbors of the topology (eg. between rank groups). Like the
+     * collectives, they run on the topology once created, so that dest and
+     * source are ranks as given by MPIWrapper::rank.
+     */
+    int SendTo(const double *buf, int count, int dest, int tag) const {
+        return MPI_Send(buf, count, MPI_DOUBLE, dest, tag, Comm());
+    }
+
+    int ReceiveFrom(double *buf, int count, int source, int tag) const {
+        return MPI_Recv(buf, count, MPI_DOUBLE, source, tag, Comm(),
+                        MPI_STATUS_IGNORE);
+    }
+
+    int SendTo(const int *buf, int count, int dest, int tag) const {
+        return MPI_Send(buf, count, MPI_INT, dest, tag, Comm());
+    }
+
+    /*
+     * Source may be MPI_ANY_SOURCE, in which case the actual source is
+     * returned in actual_source (if given)
+     */
+    int ReceiveFrom(int *buf, int count, int source, int tag,
+                    int *actual_source = NULL) const {
+        MPI_Status status;
+        int ret = MPI_Recv(buf, count, MPI_INT, source, tag, Comm(), &status);
+        if (actual_source != NULL)
+            *actual_source = status.MPI_SOURCE;
+        return ret;
+    }
+
+    /*
+     * Broadcasts count values from the root worker
+     */
+    int Broadcast(int *buf, int count) const {
+        return MPI_Bcast(buf, count, MPI_INT, 0, Comm());
+    }
+
     int Wait(CHANNEL ch) {
         if (this->HasNeighbor(ch)) {
             MPI_Wait(&requests_[ch][OUT], &status_[ch][OUT]);
             MPI_Wait(&requests_[ch][IN], &status_[ch][IN]);
         }
+        if (recv_addr_[ch] != NULL) {
+            DecodeHalo(ch);
+            recv_addr_[ch] = NULL;
+        }
         return 0;
     }
 
+    /*
+     * Non-blocking transfers of contiguous buffers, completed by polling with
+     * MPIWrapper::Test (used by the asynchronous iteration)
+     */
+    int PostSend(const T *buf, int count, CHANNEL ch, int tag) {
+        return MPI_Isend(buf, count, MPIDatatype<T>::Get(), neighbors_[ch],
+                         tag, topology_comm_, &requests_[ch][OUT]);
+    }
+
+    int PostReceive(T *buf, int count, CHANNEL ch, int tag) {
+        return MPI_Irecv(buf, count, MPIDatatype<T>::Get(), neighbors_[ch],
+                         tag, topology_comm_, &requests_[ch][IN]);
+    }
+
+    /*
+     * Returns whether the last transfer on the channel has completed
+     */
+    bool Test(CHANNEL ch, DIRECTION dir) {
+        int flag = 1;
+        if (requests_[ch][dir] != MPI_REQUEST_NULL)
+            MPI_Test(&requests_[ch][dir], &flag, &status_[ch][dir]);
+        return flag;
+    }
+
+    int Wait(CHANNEL ch, DIRECTION dir) {
+        return MPI_Wait(&requests_[ch][dir], &status_[ch][dir]);
+    }
+
+    /*
+     * Blocks until a receive, a send on the channels set in sending or the
+     * non-blocking convergence reduction completes, which MPIWrapper::Test
+     * or MPIWrapper::TestReduceConvergenceCheck then reports
+     */
+    int WaitAny(const bool *sending) {
+        MPI_Request *pending[9], requests[9];
+        int count = 0, index = 0;
+        pending[count++] = &reduce_request_;
+        for (int ch = 0; ch != 4; ++ch) {
+            pending[count++] = &requests_[ch][IN];
+            if (sending[ch])
+                pending[count++] = &requests_[ch][OUT];
+        }
+        for (int k = 0; k != count; ++k)
+            requests[k] = *pending[k];
+        int err = MPI_Waitany(count, requests, &index, MPI_STATUS_IGNORE);
+        for (int k = 0; k != count; ++k)
+            *pending[k] = requests[k];
+        return err;
+    }
+
+    int Cancel(CHANNEL ch, DIRECTION dir) {
+        if (requests_[ch][dir] == MPI_REQUEST_NULL)
+            return 0;
+        MPI_Cancel(&requests_[ch][dir]);
+        return MPI_Wait(&requests_[ch][dir], &status_[ch][dir]);
+    }
+
+    /*
+     * Sends count to the neighbor on the channel and returns the neighbor's
+     */
+    int ExchangeCount(CHANNEL ch, int count, int send_tag, int recv_tag,
+                      int *neighbor_count) const {
+        return MPI_Sendrecv(&count, 1, MPI_INT, neighbors_[ch], send_tag,
+                            neighbor_count, 1, MPI_INT, neighbors_[ch],
+                            recv_tag, topology_comm_, MPI_STATUS_IGNORE);
+    }
+
     int ReduceTime(const double *local_time, double *global_time) const {
         return MPI_Reduce(local_time,  // send buffer
                           global_time, // recv buffer
@@ -163,7 +561,25 @@ class MPIWrapper {
                           MPI_DOUBLE,  // datatype (double)
                           MPI_MAX,     // operator
                           0,           // root
-                          topology_comm_);
+                          Comm());
+    }
+
+    int ReduceMax(const double *local_value, double *global_value) const {
+        return MPI_Allreduce(local_value,  // send buffer
+                             global_value, // recv buffer
+                             1,            // count
+                             MPI_DOUBLE,   // datatype (double)
+                             MPI_MAX,      // operator
+                             Comm());
+    }
+
+    int ReduceSum(const double *local_value, double *global_value) const {
+        return MPI_Allreduce(local_value,  // send buffer
+                             global_value, // recv buffer
+                             1,            // count
+                             MPI_DOUBLE,   // datatype (double)
+                             MPI_SUM,      // operator
+                             Comm());
     }
 
     int ReduceConvergenceCheck(const int *local_flag, int *global_flag) const {
@@ -172,18 +588,189 @@ class MPIWrapper {
                              1,           // count
                              MPI_INT,     // datatype (int-bool)
                              MPI_MIN,     // operator
-                             topology_comm_);
+                             Comm());
+    }
+
+    /*
+     * ReduceStatistics: Combines the statistics of the blocks into those of
+     * the grid on the root worker, in a single reduction with
+     * GridStatistics::Combine as its operation
+     */
+    int ReduceStatistics(const GridStatistics *local_statistics,
+                         GridStatistics *global_statistics) const {
+        return MPI_Reduce(local_statistics,  // send buffer
+                          global_statistics, // recv buffer
+                          1,                 // count
+                          statistics_t_,     // datatype (GridStatistics)
+                          statistics_op_,    // operator
+                          0,                 // root
+                          Comm());
+    }
+
+    /*
+     * Gathers count values from every worker to the root, ordered by rank
+     */
+    int Gather(const double *buf, int count, double *all) const {
+        return MPI_Gather(buf, count, MPI_DOUBLE, all, count, MPI_DOUBLE, 0,
+                          Comm());
+    }
+
+    /*
+     * Topology coordinates of any worker
+     */
+    int Coords(int rank, int *coord_x, int *coord_y) const {
+        if (!coords_.empty()) {
+            // Some workers have been excluded
+            *coord_x = coords_[2 * rank];
+            *coord_y = coords_[2 * rank + 1];
+            return 0;
+        }
+        int d[2];
+        MPI_Cart_coords(topology_comm_, rank, 2, d);
+        *coord_x = d[0];
+        *coord_y = d[1];
+        return 0;
     }
 
     /*
-     * Only use after creating topology via MPIWrapper::CreateTopology
+     * StartCheckpoint: Starts writing the blocks of the workers (as double,
+     * without halos) and the step reached into a checkpoint at path, a grid
+     * file of the global grid (see grid_file.h). Each worker writes through
+     * a file view of its block in the grid, so the file does not depend on
+     * the topology. The collective write proceeds in the background until
+     * MPIWrapper::FinishCheckpoint (or the next checkpoint), and block must
+     * be left untouched until then. The file is written under a temporary
+     * name, renamed once complete, so that a run dying meanwhile leaves the
+     * previous checkpoint intact.
      */
+    int StartCheckpoint(const char *path, const double *block, int step) {
+        FinishCheckpoint();
+        checkpoint_path_ = path;
+        std::string temporary = checkpoint_path_ + ".tmp";
+        if (MPI_File_open(Comm(), temporary.c_str(),
+                          MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                          &checkpoint_file_) != MPI_SUCCESS) {
+            PrintRoot(stderr, "Cannot open %s for writing\n",
+                      temporary.c_str());
+            checkpoint_file_ = MPI_FILE_NULL;
+            return 1;
+        }
+        MPI_File_set_size(checkpoint_file_,
+                          GRID_FILE_HEADER + (MPI_Offset)GridHeight() *
+                                                  GridWidth() *
+                                                  sizeof(double));
+        if (!rank_) {
+            int header[4] = {GRID_FILE_MAGIC, GridHeight(), GridWidth(),
+                             step};
+            MPI_File_write_at(checkpoint_file_, 0, header, 4, MPI_INT,
+                              MPI_STATUS_IGNORE);
+        }
+        SetBlockView(checkpoint_file_);
+        return MPI_File_iwrite_all(checkpoint_file_, block,
+                                   block_height_ * block_width_, MPI_DOUBLE,
+                                   &checkpoint_request_);
+    }
+
+    /*
+     * Whether a checkpoint can be written at path, by creating (and removing)
+     * the temporary file of MPIWrapper::StartCheckpoint. Returns non-zero if
+     * not, the root worker printing why.
+     */
+    int ProbeCheckpoint(const char *path) const {
+        std::string temporary = std::string(path) + ".tmp";
+        MPI_File file;
+        if (MPI_File_open(Comm(), temporary.c_str(),
+                          MPI_MODE_CREATE | MPI_MODE_WRONLY |
+                              MPI_MODE_DELETE_ON_CLOSE,
+                          MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+            PrintRoot(stderr, "Cannot open %s for writing\n",
+                      temporary.c_str());
+            return 1;
+        }
+        MPI_File_close(&file);
+        return 0;
+    }
+
+    /*
+     * Completes the checkpoint in progress, if any
+     */
+    int FinishCheckpoint() {
+        if (checkpoint_file_ == MPI_FILE_NULL)
+            return 0;
+        MPI_Wait(&checkpoint_request_, MPI_STATUS_IGNORE);
+        MPI_File_close(&checkpoint_file_);
+        if (!rank_)
+            std::rename((checkpoint_path_ + ".tmp").c_str(),
+                        checkpoint_path_.c_str());
+        return 0;
+    }
+
+    /*
+     * ReadCheckpoint: Reads the blocks of the workers from a checkpoint,
+     * written on any topology, and the step it was taken at. Returns non-zero
+     * when the file cannot be read or holds a grid of other dimensions.
+     */
+    int ReadCheckpoint(const char *path, double *block, int *step) const {
+        MPI_File file;
+        if (MPI_File_open(Comm(), path, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                          &file) != MPI_SUCCESS) {
+            PrintRoot(stderr, "Cannot open %s for reading\n", path);
+            return 1;
+        }
+        int header[4] = {0, 0, 0, 0};
+        if (!rank_)
+            MPI_File_read_at(file, 0, header, 4, MPI_INT, MPI_STATUS_IGNORE);
+        Broadcast(header, 4);
+        MPI_Offset size = 0;
+        MPI_File_get_size(file, &size);
+        if (header[0] != GRID_FILE_MAGIC || header[1] != GridHeight() ||
+            header[2] != GridWidth() ||
+            size < GRID_FILE_HEADER + (MPI_Offset)GridHeight() * GridWidth() *
+                                          (MPI_Offset)sizeof(double)) {
+            PrintRoot(stderr, "%s is not a checkpoint of a %dx%d grid\n",
+                      path, GridHeight(), GridWidth());
+            MPI_File_close(&file);
+            return 1;
+        }
+        SetBlockView(file);
+        int local_err = MPI_File_read_all(file, block,
+                                          block_height_ * block_width_,
+                                          MPI_DOUBLE,
+                                          MPI_STATUS_IGNORE) != MPI_SUCCESS;
+        int err = 0;
+        MPI_Allreduce(&local_err, &err, 1, MPI_INT, MPI_MAX, Comm());
+        MPI_File_close(&file);
+        if (err) {
+            PrintRoot(stderr, "Cannot read the grid of %s\n", path);
+            return 1;
+        }
+        *step = header[3];
+        return 0;
+    }
+
+    /*
+     * Non-blocking version of MPIWrapper::ReduceConvergenceCheck, completed by
+     * polling with MPIWrapper::TestReduceConvergenceCheck. The flags must stay
+     * valid until then.
+     */
+    int StartReduceConvergenceCheck(const int *local_flag, int *global_flag) {
+        return MPI_Iallreduce(local_flag, global_flag, 1, MPI_INT, MPI_MIN,
+                              topology_comm_, &reduce_request_);
+    }
+
+    bool TestReduceConvergenceCheck() {
+        int flag = 1;
+        if (reduce_request_ != MPI_REQUEST_NULL)
+            MPI_Test(&reduce_request_, &flag, MPI_STATUS_IGNORE);
+        return flag;
+    }
+
     int Barrier() const {
-        return MPI_Barrier(topology_comm_);
+        return MPI_Barrier(Comm());
     }
 
     int PrintRoot(FILE *fp, const char *format, ...) const {
-        if (rank_ == 0) {
+        if (rank_ == 0 && fp != NULL) {
             va_list argptr;
             va_start(argptr, format);
             std::vfprintf(fp, format, argptr);
@@ -208,6 +795,21 @@ class MPIWrapper {
         return comm_sz_;
     }
 
+    /*
+     * Number of workers in the topology, less any excluded
+     */
+    int topology_size() const {
+        return topology_size_;
+    }
+
+    /*
+     * Whether the worker takes part in the topology, see
+     * MPIWrapper::ExcludeIdle
+     */
+    bool active() const {
+        return active_;
+    }
+
     const char *processor_name() const {
         return processor_name_;
     }
@@ -233,6 +835,12 @@ class MPIWrapper {
     }
 
   private:
+    // Collectives run on the topology, or on the wrapped communicator when no
+    // topology has been created
+    MPI_Comm Comm() const {
+        return topology_comm_ != MPI_COMM_NULL ? topology_comm_ : comm_;
+    }
+
     int AssignNeighbors() {
         // Assign upper and lower neighbors
         MPI_Cart_shift(topology_comm_, 0, 1, neighbors_ + TOP,
@@ -243,20 +851,223 @@ class MPIWrapper {
         return 0;
     }
 
+    // Dimensions of the grid the blocks make up
+    int GridHeight() const {
+        return topology_height_ * block_height_;
+    }
+
+    int GridWidth() const {
+        return topology_width_ * block_width_;
+    }
+
+    // Sets the view of a checkpoint file to the block of the worker in the
+    // global grid, past the header
+    void SetBlockView(MPI_File file) const {
+        int sizes[2] = {GridHeight(), GridWidth()};
+        int subsizes[2] = {block_height_, block_width_};
+        int starts[2] = {topology_coord_x_ * block_height_,
+                         topology_coord_y_ * block_width_};
+        MPI_Datatype block_t;
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                                 MPI_DOUBLE, &block_t);
+        MPI_Type_commit(&block_t);
+        MPI_File_set_view(file, GRID_FILE_HEADER, MPI_DOUBLE, block_t,
+                          "native", MPI_INFO_NULL);
+        MPI_Type_free(&block_t);
+    }
+
+    unsigned int HaloLength(CHANNEL ch) const {
+        return (ch == LEFT || ch == RIGHT) ? block_height_ : block_width_;
+    }
+
+    // Distance between consecutive halo values in the grid
+    unsigned int HaloStride(CHANNEL ch) const {
+        return (ch == LEFT || ch == RIGHT) ? RowPitch() : 1;
+    }
+
+    // Encoded halos start with their format, followed by the values
+    int MaxEncodedSize(CHANNEL ch) const {
+        return sizeof(int) + HaloLength(ch) * sizeof(double);
+    }
+
+    // Formats of the encoded halos
+    enum FORMAT { FORMAT_RAW, FORMAT_FP32, FORMAT_DELTA16, FORMAT_DELTA32 };
+
+    // Encodes the halo into the send buffer of the channel, returning its
+    // size in bytes
+    int EncodeHalo(const T *buf, CHANNEL ch) {
+        unsigned int n = HaloLength(ch), stride = HaloStride(ch);
+        std::vector<char> &bytes = send_bytes_[ch];
+        bytes.resize(MaxEncodedSize(ch));
+        char *payload = &bytes[sizeof(int)];
+        int format = FORMAT_RAW, size = sizeof(int);
+
+        if (codec_ == HALO_FP32) {
+            format = FORMAT_FP32;
+            for (unsigned int k = 0; k != n; ++k) {
+                float val = buf[k * stride];
+                std::memcpy(payload + k * sizeof(val), &val, sizeof(val));
+                drift_ = std::max(drift_,
+                                  std::fabs(val - (double)buf[k * stride]));
+            }
+            size += n * sizeof(float);
+        } else {
+            std::vector<double> &reference = send_reference_[ch];
+            if (reference.size() != n)
+                reference.assign(n, 0.0);
+            // Quantized differences, in the narrowest integers they fit, or
+            // raw values when no integers narrower than them do
+            double max_delta = 0.0;
+            for (unsigned int k = 0; k != n; ++k)
+                max_delta =
+                    std::max(max_delta, std::fabs(Quantize(buf[k * stride],
+                                                           reference[k])));
+            if (max_delta <= 32767.0) {
+                format = FORMAT_DELTA16;
+                size += EncodeDeltas<short>(buf, ch, payload);
+            } else if (max_delta <= 2147483647.0 && sizeof(int) < sizeof(T)) {
+                format = FORMAT_DELTA32;
+                size += EncodeDeltas<int>(buf, ch, payload);
+            } else {
+                for (unsigned int k = 0; k != n; ++k) {
+                    T val = buf[k * stride];
+                    std::memcpy(payload + k * sizeof(val), &val, sizeof(val));
+                    reference[k] = val;
+                }
+                size += n * sizeof(T);
+            }
+        }
+        std::memcpy(&bytes[0], &format, sizeof(format));
+        raw_bytes_ += n * sizeof(T);
+        encoded_bytes_ += size;
+        return size;
+    }
+
+    // Difference of a value from its reference, in steps of twice the error
+    // bound
+    double Quantize(double val, double reference) const {
+        return std::floor((val - reference) / (2.0 * error_bound_) + 0.5);
+    }
+
+    // Encodes the quantized differences of the halo as integers of type I,
+    // updating the reference values the receiver decodes
+    template <typename I>
+    int EncodeDeltas(const T *buf, CHANNEL ch, char *payload) {
+        unsigned int n = HaloLength(ch), stride = HaloStride(ch);
+        std::vector<double> &reference = send_reference_[ch];
+        for (unsigned int k = 0; k != n; ++k) {
+            I delta = (I)Quantize(buf[k * stride], reference[k]);
+            std::memcpy(payload + k * sizeof(delta), &delta, sizeof(delta));
+            reference[k] += delta * (2.0 * error_bound_);
+            drift_ = std::max(drift_,
+                              std::fabs(reference[k] - buf[k * stride]));
+        }
+        return n * sizeof(I);
+    }
+
+    // Decodes the halo received on the channel into its place in the grid
+    void DecodeHalo(CHANNEL ch) {
+        unsigned int n = HaloLength(ch), stride = HaloStride(ch);
+        const char *payload = &recv_bytes_[ch][sizeof(int)];
+        T *halo = recv_addr_[ch];
+        int format = FORMAT_RAW;
+        std::memcpy(&format, &recv_bytes_[ch][0], sizeof(format));
+        std::vector<double> &reference = recv_reference_[ch];
+        if (reference.size() != n)
+            reference.assign(n, 0.0);
+
+        if (format == FORMAT_DELTA16) {
+            DecodeDeltas<short>(payload, ch);
+        } else if (format == FORMAT_DELTA32) {
+            DecodeDeltas<int>(payload, ch);
+        } else if (format == FORMAT_FP32) {
+            for (unsigned int k = 0; k != n; ++k) {
+                float val;
+                std::memcpy(&val, payload + k * sizeof(val), sizeof(val));
+                halo[k * stride] = val;
+            }
+        } else {
+            for (unsigned int k = 0; k != n; ++k) {
+                T val;
+                std::memcpy(&val, payload + k * sizeof(val), sizeof(val));
+                reference[k] = val;
+                halo[k * stride] = val;
+            }
+        }
+    }
+
+    template <typename I> void DecodeDeltas(const char *payload, CHANNEL ch) {
+        unsigned int n = HaloLength(ch), stride = HaloStride(ch);
+        std::vector<double> &reference = recv_reference_[ch];
+        T *halo = recv_addr_[ch];
+        for (unsigned int k = 0; k != n; ++k) {
+            I delta;
+            std::memcpy(&delta, payload + k * sizeof(delta), sizeof(delta));
+            reference[k] += delta * (2.0 * error_bound_);
+            halo[k * stride] = reference[k];
+        }
+    }
+
     int CreateTypes() {
-        MPI_Type_vector(block_height_, 1, block_width_ + 2, MPI_DOUBLE,
+        if (column_t_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&column_t_);
+        MPI_Type_vector(block_height_, 1, RowPitch(), MPIDatatype<T>::Get(),
                         &column_t_);
         MPI_Type_commit(&column_t_);
+        FreeWideTypes();
         return 0;
     }
 
-    int rank_;    // Current process rank
-    int comm_sz_; // Communicator size
+    int RowPitch() const {
+        return row_pitch_ ? row_pitch_ : block_width_ + 2;
+    }
+
+    // Types of radius rows (columns) of a grid with halos of that width
+    int CreateWideTypes(int radius, bool corners) {
+        FreeWideTypes();
+        int row = block_width_ + 2 * radius;
+        int rows = corners ? block_height_ + 2 * radius : block_height_;
+        MPI_Type_vector(radius, block_width_, row, MPIDatatype<T>::Get(),
+                        &wide_row_t_);
+        MPI_Type_commit(&wide_row_t_);
+        MPI_Type_vector(rows, radius, row, MPIDatatype<T>::Get(),
+                        &wide_column_t_);
+        MPI_Type_commit(&wide_column_t_);
+        wide_radius_ = radius;
+        wide_corners_ = corners;
+        return 0;
+    }
+
+    void FreeWideTypes() {
+        if (wide_row_t_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&wide_row_t_);
+        if (wide_column_t_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&wide_column_t_);
+        wide_radius_ = 0;
+    }
+
+    // The operation of MPIWrapper::ReduceStatistics
+    static void CombineStatistics(void *in, void *inout, int *len,
+                                  MPI_Datatype *) {
+        const GridStatistics *other = static_cast<GridStatistics *>(in);
+        GridStatistics *statistics = static_cast<GridStatistics *>(inout);
+        for (int k = 0; k != *len; ++k)
+            statistics[k].Combine(other[k]);
+    }
+
+    bool owns_mpi_; // Whether MPI was initialized by this wrapper
+    MPI_Comm comm_; // Communicator the topology is created from
+    int rank_;      // Current process rank
+    int comm_sz_;   // Communicator size
     char processor_name_[MPI_MAX_PROCESSOR_NAME];
 
-    int topology_height_; // Cartesian topology height
-    int topology_width_;  // Cartesian topology width
-    int topology_comm_;   // Cartesian topology communicator
+    int topology_height_;     // Cartesian topology height
+    int topology_width_;      // Cartesian topology width
+    MPI_Comm topology_comm_;  // Cartesian topology communicator
+    int topology_size_;       // Workers in the topology
+    bool reorder_;            // Whether MPI may renumber the workers
+    bool active_;             // Whether the worker is in the topology
+    std::vector<int> coords_; // Of the workers, once some are excluded
 
     int topology_coord_x_; // Worker's topology X coordinate
     int topology_coord_y_; // Worker's topology Y coordinate
@@ -266,12 +1077,43 @@ class MPIWrapper {
     int neighbors_[4];           // Worker's neighbors
     MPI_Request requests_[4][2]; // Worker requests
     MPI_Status status_[4][2];    // Worker statuses
+    MPI_Request reduce_request_; // Non-blocking convergence reduction
+    MPI_Datatype statistics_t_;  // GridStatistics
+    MPI_Op statistics_op_;       // GridStatistics::Combine
+
+    // Checkpoint in progress, see MPIWrapper::StartCheckpoint
+    MPI_File checkpoint_file_;
+    MPI_Request checkpoint_request_;
+    std::string checkpoint_path_;
 
     MPI_Datatype column_t_; // MPI datatype to *send* columns LEFT/RIGHT
+    int row_pitch_;         // Of the grids, zero for the row length
+
+    // Types of MPIWrapper::ExchangeWideHalos, for the given radius
+    MPI_Datatype wide_row_t_;
+    MPI_Datatype wide_column_t_;
+    int wide_radius_; // Zero when not created
+    bool wide_corners_;
+
+    // Halo compression, see MPIWrapper::SetHaloCodec
+    HALO_CODEC codec_;
+    double error_bound_;
+    std::vector<char> send_bytes_[4]; // Encoded halos, per channel
+    std::vector<char> recv_bytes_[4];
+    T *recv_addr_[4];                 // Where received halos are decoded
 
-    DISALLOW_COPY_AND_ASSIGN(MPIWrapper);
+    std::vector<double> send_reference_[4]; // Halos last decoded by neighbors
+    std::vector<double> recv_reference_[4]; // Halos last decoded
+
+    double raw_bytes_;     // Halo bytes before encoding
+    double encoded_bytes_; // Halo bytes sent
+    double drift_;         // Largest error of a decoded halo value
+
+    DISALLOW_COPY_AND_ASSIGN(BasicMPIWrapper);
 };
 
+typedef BasicMPIWrapper<double> MPIWrapper;
+
 } // namespace heat_transfer
 
 #endif // __MPI_WRAPPER_H_
@@ -0,0 +1,252 @@
+#ifndef __MPI_WRAPPER_3D_H_
+#define __MPI_WRAPPER_3D_H_
+
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <cstdarg>
+#include <cstdio>
+#include <mpi.h>
+
+namespace heat_transfer {
+
+// Faces of a 3D block. The first three face the lower coordinates of the
+// depth, height and width dimensions, and face f + 3 is opposite face f.
+enum FACE {
+    FACE_FRONT,
+    FACE_TOP,
+    FACE_LEFT,
+    FACE_BACK,
+    FACE_BOTTOM,
+    FACE_RIGHT
+};
+
+// Tags of the face halos, by the face they are sent from
+enum FACE_TAG { FACE_TAG_BASE = 30 };
+
+/*
+ * MPIWrapper3D: The MPIWrapper of volumes, distributed over a 3D Cartesian
+ * topology. A block is stored plane by plane (depth), row by row, with halos
+ * one cell wide on every side, and its faces are transferred with subarray
+ * datatypes of the whole block.
+ */
+class MPIWrapper3D {
+  public:
+    MPIWrapper3D() {
+    }
+
+    /*
+     * Initializes MPI and attaches the wrapper to MPI_COMM_WORLD
+     */
+    int Init() {
+        MPI_Init(NULL, NULL);
+        Init(MPI_COMM_WORLD);
+        owns_mpi_ = true;
+        return 0;
+    }
+
+    /*
+     * Attaches the wrapper to a communicator of an already initialized MPI
+     */
+    int Init(MPI_Comm comm) {
+        owns_mpi_ = false;
+        comm_ = comm;
+        topology_comm_ = MPI_COMM_NULL;
+        MPI_Comm_rank(comm_, &rank_);
+        MPI_Comm_size(comm_, &comm_sz_);
+        for (int f = 0; f != 6; ++f) {
+            neighbors_[f] = MPI_PROC_NULL;
+            face_t_[f][IN] = face_t_[f][OUT] = MPI_DATATYPE_NULL;
+            requests_[f][IN] = requests_[f][OUT] = MPI_REQUEST_NULL;
+        }
+        return 0;
+    }
+
+    int Destroy() {
+        FreeTypes();
+        if (topology_comm_ != MPI_COMM_NULL)
+            MPI_Comm_free(&topology_comm_);
+        if (owns_mpi_)
+            MPI_Finalize();
+        return 0;
+    }
+
+    /*
+     * Creates the topology, splitting each dimension of the volume equally
+     */
+    int CreateTopology(int depth, int height, int width) {
+        int d[3] = {0, 0, 0}, n[3] = {depth, height, width};
+        MPI_Dims_create(comm_sz_, 3, d);
+
+        // Check whether we can equally distribute the volume to the workers
+        if (depth % d[0] || height % d[1] || width % d[2]) {
+            if (!rank_)
+                std::fprintf(stderr,
+                             "Tried to split a %dx%dx%d volume into a "
+                             "%dx%dx%d topology\n",
+                             depth, height, width, d[0], d[1], d[2]);
+            MPI_Barrier(comm_);
+            MPI_Abort(comm_, 1);
+        }
+
+        const int periods[3] = {0, 0, 0}; // No wrap
+        MPI_Cart_create(comm_, 3, d, periods, 1, &topology_comm_);
+        MPI_Comm_rank(topology_comm_, &rank_);
+        for (int k = 0; k != 3; ++k) {
+            topology_dims_[k] = d[k];
+            block_dims_[k] = n[k] / d[k];
+        }
+        MPI_Cart_coords(topology_comm_, rank_, 3, coords_);
+
+        // Assign the neighbors of both sides of each dimension
+        for (int k = 0; k != 3; ++k)
+            MPI_Cart_shift(topology_comm_, k, 1, neighbors_ + k,
+                           neighbors_ + k + 3);
+
+        CreateTypes();
+        return 0;
+    }
+
+    /*
+     * Posts the transfer of a face of the block to the neighbor on that
+     * side, and the receipt of the neighbor's face into the halo
+     */
+    int Exchange(double *block, FACE f) {
+        if (!HasNeighbor(f))
+            return 0;
+        MPI_Isend(block, 1, face_t_[f][OUT], neighbors_[f],
+                  FACE_TAG_BASE + f, topology_comm_, &requests_[f][OUT]);
+        MPI_Irecv(block, 1, face_t_[f][IN], neighbors_[f],
+                  FACE_TAG_BASE + Opposite(f), topology_comm_,
+                  &requests_[f][IN]);
+        return 0;
+    }
+
+    int Wait(FACE f) {
+        MPI_Wait(&requests_[f][OUT], MPI_STATUS_IGNORE);
+        MPI_Wait(&requests_[f][IN], MPI_STATUS_IGNORE);
+        return 0;
+    }
+
+    int ReduceTime(const double *local_time, double *global_time) const {
+        return MPI_Reduce(local_time, global_time, 1, MPI_DOUBLE, MPI_MAX, 0,
+                          topology_comm_);
+    }
+
+    int ReduceConvergenceCheck(const int *local_flag, int *global_flag) const {
+        return MPI_Allreduce(local_flag, global_flag, 1, MPI_INT, MPI_MIN,
+                             topology_comm_);
+    }
+
+    /*
+     * Gathers count values from every worker to the root, ordered by rank
+     */
+    int Gather(const double *buf, int count, double *all) const {
+        return MPI_Gather(buf, count, MPI_DOUBLE, all, count, MPI_DOUBLE, 0,
+                          topology_comm_);
+    }
+
+    /*
+     * Topology coordinates of any worker
+     */
+    int Coords(int rank, int *coords) const {
+        return MPI_Cart_coords(topology_comm_, rank, 3, coords);
+    }
+
+    int Barrier() const {
+        return MPI_Barrier(topology_comm_);
+    }
+
+    int PrintRoot(FILE *fp, const char *format, ...) const {
+        if (rank_ == 0 && fp != NULL) {
+            va_list argptr;
+            va_start(argptr, format);
+            std::vfprintf(fp, format, argptr);
+            va_end(argptr);
+        }
+        return 0;
+    }
+
+    bool HasNeighbor(FACE f) const {
+        return neighbors_[f] != MPI_PROC_NULL;
+    }
+
+    static FACE Opposite(FACE f) {
+        return static_cast<FACE>((f + 3) % 6);
+    }
+
+    int rank() const {
+        return rank_;
+    }
+
+    int communication_size() const {
+        return comm_sz_;
+    }
+
+    // Topology dimensions, block dimensions and topology coordinates of the
+    // worker, by dimension (depth, height, width)
+    int topology_dim(int k) const {
+        return topology_dims_[k];
+    }
+
+    int block_dim(int k) const {
+        return block_dims_[k];
+    }
+
+    int coord(int k) const {
+        return coords_[k];
+    }
+
+  private:
+    // Creates the subarray types of the faces and of their halos
+    int CreateTypes() {
+        FreeTypes();
+        int sizes[3], subsizes[3], starts[3];
+        for (int f = 0; f != 6; ++f)
+            for (int dir = IN; dir <= OUT; ++dir) {
+                for (int k = 0; k != 3; ++k) {
+                    sizes[k] = block_dims_[k] + 2;
+                    subsizes[k] = block_dims_[k];
+                    starts[k] = 1;
+                }
+                int k = f % 3;
+                bool lower = f < 3;
+                subsizes[k] = 1;
+                if (dir == OUT)
+                    starts[k] = lower ? 1 : block_dims_[k];
+                else
+                    starts[k] = lower ? 0 : block_dims_[k] + 1;
+                MPI_Type_create_subarray(3, sizes, subsizes, starts,
+                                         MPI_ORDER_C, MPI_DOUBLE,
+                                         &face_t_[f][dir]);
+                MPI_Type_commit(&face_t_[f][dir]);
+            }
+        return 0;
+    }
+
+    void FreeTypes() {
+        for (int f = 0; f != 6; ++f)
+            for (int dir = IN; dir <= OUT; ++dir)
+                if (face_t_[f][dir] != MPI_DATATYPE_NULL)
+                    MPI_Type_free(&face_t_[f][dir]);
+    }
+
+    bool owns_mpi_; // Whether MPI was initialized by this wrapper
+    MPI_Comm comm_; // Wrapped communicator
+    int rank_;      // Worker's rank
+    int comm_sz_;   // Communicator size
+
+    MPI_Comm topology_comm_; // Cartesian topology communicator
+    int topology_dims_[3];
+    int block_dims_[3];
+    int coords_[3]; // Worker's topology coordinates
+
+    int neighbors_[6];           // Worker's neighbors, per face
+    MPI_Datatype face_t_[6][2];  // Faces received (IN) and sent (OUT)
+    MPI_Request requests_[6][2]; // Transfers in flight, per face
+
+    DISALLOW_COPY_AND_ASSIGN(MPIWrapper3D);
+};
+
+} // namespace heat_transfer
+
+#endif // __MPI_WRAPPER_3D_H_
@@ -0,0 +1,220 @@
+#ifndef __PARAREAL_H_
+#define __PARAREAL_H_
+
+#include "heat_map.h"
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * Parareal: parallel-in-time integration of the heat transfer simulation.
+ *
+ * The world communicator is split into groups of equal size, one per time
+ * slice, and each group decomposes the grid in space as HeatTransfer does.
+ * The fine propagator is the regular HeatMap stepping, while the coarse one
+ * takes half the steps with twice the time step (coefficient 0.2, which is
+ * still stable). Slice states travel between groups over a "time"
+ * communicator connecting the ranks that own the same block in every group.
+ */
+class Parareal {
+  public:
+    Parareal() {
+    }
+
+    int Init(int height, int width, int steps, int slices, int iterations,
+             double tolerance) {
+        steps_ = steps;
+        slices_ = slices;
+        iterations_ = iterations < slices ? iterations : slices;
+        tolerance_ = tolerance;
+        world_.Init();
+
+        // Space-only topology over all workers, used for the reference run
+        world_.CreateTopology(height, width);
+        if (world_.communication_size() % slices_) {
+            world_.PrintRoot(stderr, "Cannot split %d workers into %d slices\n",
+                             world_.communication_size(), slices_);
+            world_.Destroy();
+            return 1;
+        }
+
+        // Assign workers to time slices and create a topology per slice
+        slice_ = world_.rank() / (world_.communication_size() / slices_);
+        world_.Split(slice_, world_.rank(), &space_comm_);
+        space_.Init(space_comm_);
+        space_.CreateTopology(height, width);
+        world_.Split(space_.rank(), slice_, &time_comm_);
+        time_.Init(time_comm_);
+
+        // Steps of this slice, spreading the remainder over the first slices
+        slice_steps_ = steps_ / slices_ + (slice_ < steps_ % slices_);
+
+        heat_map_.Init(space_.block_height(), space_.block_width(), &space_);
+        return 0;
+    }
+
+    int Destroy() {
+        heat_map_.Destroy();
+        space_.Destroy();
+        time_.Destroy();
+        MPI_Comm_free(&space_comm_);
+        MPI_Comm_free(&time_comm_);
+        world_.Destroy();
+        return 0;
+    }
+
+    /*
+     * Parareal::Run - executes the Parareal iteration, followed by a
+     * space-only run on all workers to compare against
+     */
+    int Run() {
+        unsigned int n = heat_map_.block_size();
+        std::vector<double> u(n), u_new(n), fine(n), coarse(n), coarse_new(n),
+            end(n);
+        double time_start, local_time, parareal_time, space_time;
+        double fine_time = 0.0, diff, global_diff = 0.0;
+        int k;
+
+        world_.Barrier();
+        time_start = MPI_Wtime();
+
+        // Initial prediction by a serial coarse sweep
+        heat_map_.CopyBlock(&u[0]);
+        ReceiveSlice(&u[0]);
+        Coarse(&u[0], &coarse[0]);
+        SendSlice(&coarse[0]);
+        end = coarse;
+
+        for (k = 0; k != iterations_; ++k) {
+            // Fine propagation of all slices in parallel
+            double fine_start = MPI_Wtime();
+            Fine(&u[0], &fine[0]);
+            fine_time += MPI_Wtime() - fine_start;
+
+            // Serial correction sweep: U' = G(U'_prev) + F(U) - G(U)
+            u_new = u;
+            ReceiveSlice(&u_new[0]);
+            Coarse(&u_new[0], &coarse_new[0]);
+            diff = 0.0;
+            for (unsigned int i = 0; i != n; ++i) {
+                double val = coarse_new[i] + fine[i] - coarse[i];
+                diff = std::max(diff, std::fabs(val - end[i]));
+                end[i] = val;
+            }
+            SendSlice(&end[0]);
+            u.swap(u_new);
+            coarse.swap(coarse_new);
+
+            // Stop when the slice end states no longer change
+            world_.ReduceMax(&diff, &global_diff);
+            if (global_diff < tolerance_) {
+                ++k;
+                break;
+            }
+        }
+
+        local_time = MPI_Wtime() - time_start;
+        world_.ReduceTime(&local_time, &parareal_time);
+        // The final state is the end of the last slice
+        double parareal_sum =
+            Checksum(&end[0], n * (slice_ == slices_ - 1));
+        world_.ReduceTime(&fine_time, &local_time);
+
+        // Reference: space-only parallelism over all workers
+        HeatMap reference;
+        reference.Init(world_.block_height(), world_.block_width(), &world_);
+        std::vector<double> ref(reference.block_size());
+        world_.Barrier();
+        time_start = MPI_Wtime();
+        Propagate(&reference, steps_);
+        local_time = MPI_Wtime() - time_start;
+        world_.ReduceTime(&local_time, &space_time);
+        reference.CopyBlock(&ref[0]);
+        double space_sum = Checksum(&ref[0], ref.size());
+        reference.Destroy();
+
+        world_.PrintRoot(stdout,
+                         "Parareal: %d iterations, %d slices, last "
+                         "correction %g\n"
+                         "Parareal time:   %.2f sec (fine %.2f sec)\n"
+                         "Space-only time: %.2f sec\n"
+                         "Speedup: %.2f\n"
+                         "Checksum: %.10e (space-only %.10e)\n",
+                         k, slices_, global_diff, parareal_time, local_time,
+                         space_time, space_time / parareal_time, parareal_sum,
+                         space_sum);
+        return 0;
+    }
+
+  private:
+    void Propagate(HeatMap *map, int steps) {
+        for (int i = 0; i != steps; ++i) {
+            map->ExchangeMessages();
+            map->StandaloneUpdate();
+            map->WaitForMessages();
+            map->CollaborativeUpdate();
+            map->ExchangeGrids();
+        }
+    }
+
+    void Fine(const double *in, double *out) {
+        heat_map_.LoadBlock(in);
+        heat_map_.SetCoefficient(0.1);
+        Propagate(&heat_map_, slice_steps_);
+        heat_map_.CopyBlock(out);
+    }
+
+    void Coarse(const double *in, double *out) {
+        heat_map_.LoadBlock(in);
+        heat_map_.SetCoefficient(0.2);
+        Propagate(&heat_map_, slice_steps_ / 2);
+        heat_map_.SetCoefficient(0.1);
+        Propagate(&heat_map_, slice_steps_ % 2);
+        heat_map_.CopyBlock(out);
+    }
+
+    // The first slice starts from the initial condition
+    void ReceiveSlice(double *buf) {
+        if (slice_)
+            time_.ReceiveFrom(buf, heat_map_.block_size(), slice_ - 1, 0);
+    }
+
+    void SendSlice(const double *buf) {
+        if (slice_ != slices_ - 1)
+            time_.SendTo(buf, heat_map_.block_size(), slice_ + 1, 0);
+    }
+
+    // Sum of the given cells over all workers
+    double Checksum(const double *block, unsigned int n) const {
+        double local_sum = 0.0, global_sum = 0.0;
+        for (unsigned int i = 0; i != n; ++i)
+            local_sum += block[i];
+        world_.ReduceSum(&local_sum, &global_sum);
+        return global_sum;
+    }
+
+    int steps_;        // The total number of simulation steps
+    int slices_;       // Number of time slices (worker groups)
+    int iterations_;   // Maximum number of Parareal iterations
+    double tolerance_; // Maximum correction for convergence
+
+    int slice_;       // Time slice of the worker
+    int slice_steps_; // Simulation steps of the slice
+
+    HeatMap heat_map_;
+    MPIWrapper world_; // All workers
+    MPIWrapper space_; // Workers of the same slice
+    MPIWrapper time_;  // Workers owning the same block in every slice
+    MPI_Comm space_comm_;
+    MPI_Comm time_comm_;
+
+    DISALLOW_COPY_AND_ASSIGN(Parareal);
+};
+
+} // namespace heat_transfer
+
+#endif // __PARAREAL_H_
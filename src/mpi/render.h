@@ -0,0 +1,279 @@
+#ifndef __RENDER_H_
+#define __RENDER_H_
+
+#include "macros.h"
+#include <algorithm>
+#include <cstdio>
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+namespace heat_transfer {
+
+// Tags of the tiles sent up the compositing tree, see Renderer::Composite
+enum RENDER_TAG { RENDER_RECT = 40, RENDER_SUMS };
+
+/*
+ * Renderer: Renders the grid in situ, into images of a lower resolution.
+ * Each pixel is the average of the cells that fall in it. Every worker sums
+ * the cells of its block into the pixels they fall in, its tile of the
+ * image, and the tiles are composited up a binary tree of the workers, each
+ * merge covering the bounding rectangle of the two. So no worker ever holds
+ * or sends more than the image, whatever the size of the grid. The root
+ * worker maps the image to colors and writes it as a PPM file,
+ * <prefix>.<step>.ppm.
+ */
+class Renderer {
+  public:
+    Renderer()
+        : image_height_(0), image_width_(0), frames_(0),
+          composite_time_(0.0) {
+    }
+
+    /*
+     * Sets up the tile of the worker, whose block and topology are taken
+     * from the given MPIWrapper, in images of the given resolution (at most
+     * that of the grid)
+     */
+    template <typename W>
+    int Init(const std::string &prefix, int image_height, int image_width,
+             const W &mpi_wrapper) {
+        prefix_ = prefix;
+        block_height_ = mpi_wrapper.block_height();
+        block_width_ = mpi_wrapper.block_width();
+        grid_height_ = mpi_wrapper.topology_height() * block_height_;
+        grid_width_ = mpi_wrapper.topology_width() * block_width_;
+        image_height_ = std::max(1, std::min(image_height, grid_height_));
+        image_width_ = std::max(1, std::min(image_width, grid_width_));
+        off_x_ = mpi_wrapper.topology_coord_x() * block_height_;
+        off_y_ = mpi_wrapper.topology_coord_y() * block_width_;
+
+        tile_.row = Pixel(off_x_, grid_height_, image_height_);
+        tile_.rows = Pixel(off_x_ + block_height_ - 1, grid_height_,
+                           image_height_) -
+                     tile_.row + 1;
+        tile_.col = Pixel(off_y_, grid_width_, image_width_);
+        tile_.cols = Pixel(off_y_ + block_width_ - 1, grid_width_,
+                           image_width_) -
+                     tile_.col + 1;
+        tile_.sums.assign(tile_.rows * tile_.cols, 0.0);
+        column_pixels_.resize(block_width_);
+        for (int j = 0; j != block_width_; ++j)
+            column_pixels_[j] =
+                Pixel(off_y_ + j, grid_width_, image_width_) - tile_.col;
+        return 0;
+    }
+
+    /*
+     * Adds row i (0-based) of the block to the tile
+     */
+    template <typename T> void AddRow(int i, const T *row) {
+        double *sums =
+            &tile_.sums[(Pixel(off_x_ + i, grid_height_, image_height_) -
+                         tile_.row) *
+                        tile_.cols];
+        for (int j = 0; j != block_width_; ++j)
+            sums[column_pixels_[j]] += row[j];
+    }
+
+    /*
+     * Renderer::Composite - composites the tiles the workers added their
+     * blocks to into the image of the given step, which the root worker
+     * writes, and clears them for the next one. Returns non-zero on the
+     * root worker if the image could not be written.
+     */
+    template <typename W> int Composite(int step, const W &mpi_wrapper) {
+        double time_start = MPI_Wtime();
+        int rank = mpi_wrapper.rank();
+        int workers = mpi_wrapper.topology_size();
+        Tile image;
+        image.row = tile_.row;
+        image.col = tile_.col;
+        image.rows = tile_.rows;
+        image.cols = tile_.cols;
+        image.sums.swap(tile_.sums);
+
+        // At level l, the workers at odd multiples of 2^l send their image
+        // to the one 2^l below
+        for (int level = 1; level < workers; level *= 2) {
+            if (rank % (2 * level)) {
+                int rect[4] = {image.row, image.col, image.rows, image.cols};
+                mpi_wrapper.SendTo(rect, 4, rank - level, RENDER_RECT);
+                mpi_wrapper.SendTo(&image.sums[0], image.rows * image.cols,
+                                   rank - level, RENDER_SUMS);
+                break;
+            }
+            if (rank + level < workers) {
+                Tile tile;
+                int rect[4];
+                mpi_wrapper.ReceiveFrom(rect, 4, rank + level, RENDER_RECT);
+                tile.row = rect[0];
+                tile.col = rect[1];
+                tile.rows = rect[2];
+                tile.cols = rect[3];
+                tile.sums.resize(tile.rows * tile.cols);
+                mpi_wrapper.ReceiveFrom(&tile.sums[0], tile.rows * tile.cols,
+                                        rank + level, RENDER_SUMS);
+                Merge(tile, &image);
+            }
+        }
+
+        tile_.sums.assign(tile_.rows * tile_.cols, 0.0);
+        composite_time_ += MPI_Wtime() - time_start;
+        ++frames_;
+        return rank ? 0 : WriteImage(&image, step);
+    }
+
+    int image_height() const {
+        return image_height_;
+    }
+
+    int image_width() const {
+        return image_width_;
+    }
+
+    int frames() const {
+        return frames_;
+    }
+
+    /*
+     * Time spent compositing the tiles, and writing the images on the root
+     * worker excluded
+     */
+    double composite_time() const {
+        return composite_time_;
+    }
+
+  private:
+    // A rectangle of pixels, and the sums of the cells in them
+    struct Tile {
+        int row, col, rows, cols;
+        std::vector<double> sums;
+    };
+
+    // The pixel of a cell, along a dimension of size cells in the grid and
+    // pixels in the image
+    static int Pixel(int cell, int cells, int pixels) {
+        return (long long)cell * pixels / cells;
+    }
+
+    // The first cell of a pixel, along a dimension as in Renderer::Pixel
+    static int FirstCell(int pixel, int cells, int pixels) {
+        return ((long long)pixel * cells + pixels - 1) / pixels;
+    }
+
+    // Adds the tile to the image, growing the image to their bounding
+    // rectangle
+    static void Merge(const Tile &tile, Tile *image) {
+        int row = std::min(image->row, tile.row);
+        int col = std::min(image->col, tile.col);
+        int rows = std::max(image->row + image->rows, tile.row + tile.rows) -
+                   row;
+        int cols = std::max(image->col + image->cols, tile.col + tile.cols) -
+                   col;
+        if (row != image->row || col != image->col || rows != image->rows ||
+            cols != image->cols) {
+            Tile grown;
+            grown.row = row;
+            grown.col = col;
+            grown.rows = rows;
+            grown.cols = cols;
+            grown.sums.assign(rows * cols, 0.0);
+            AddTile(*image, &grown);
+            image->sums.swap(grown.sums);
+            image->row = row;
+            image->col = col;
+            image->rows = rows;
+            image->cols = cols;
+        }
+        AddTile(tile, image);
+    }
+
+    // Adds the tile to the image, which covers it
+    static void AddTile(const Tile &tile, Tile *image) {
+        for (int i = 0; i != tile.rows; ++i) {
+            const double *src = &tile.sums[i * tile.cols];
+            double *dst = &image->sums[(tile.row - image->row + i) *
+                                           image->cols +
+                                       tile.col - image->col];
+            for (int j = 0; j != tile.cols; ++j)
+                dst[j] += src[j];
+        }
+    }
+
+    // Averages the sums of the image, which covers the whole of it, and
+    // writes it with the colors of its range of values
+    int WriteImage(Tile *image, int step) const {
+        std::vector<double> &pixels = image->sums;
+        for (int i = 0; i != image_height_; ++i) {
+            int cell_rows = FirstCell(i + 1, grid_height_, image_height_) -
+                            FirstCell(i, grid_height_, image_height_);
+            for (int j = 0; j != image_width_; ++j)
+                pixels[i * image_width_ + j] /=
+                    (double)cell_rows *
+                    (FirstCell(j + 1, grid_width_, image_width_) -
+                     FirstCell(j, grid_width_, image_width_));
+        }
+        double min = *std::min_element(pixels.begin(), pixels.end());
+        double max = *std::max_element(pixels.begin(), pixels.end());
+
+        char path[4096];
+        std::snprintf(path, sizeof(path), "%s.%06d.ppm", prefix_.c_str(),
+                      step);
+        FILE *fp = std::fopen(path, "wb");
+        if (fp == NULL) {
+            std::fprintf(stderr, "Cannot open %s for writing\n", path);
+            return 1;
+        }
+        std::fprintf(fp, "P6\n%d %d\n255\n", image_width_, image_height_);
+        std::vector<unsigned char> rgb(3 * image_width_);
+        for (int i = 0; i != image_height_; ++i) {
+            for (int j = 0; j != image_width_; ++j)
+                Color(max > min ? (pixels[i * image_width_ + j] - min) /
+                                      (max - min)
+                                : 0.0,
+                      &rgb[3 * j]);
+            std::fwrite(&rgb[0], 1, rgb.size(), fp);
+        }
+        return std::fclose(fp) != 0;
+    }
+
+    // The color map, from blue through cyan, green and yellow to red, of a
+    // value in [0, 1]
+    static void Color(double val, unsigned char *rgb) {
+        static const unsigned char stops[5][3] = {{0, 0, 255},
+                                                  {0, 255, 255},
+                                                  {0, 255, 0},
+                                                  {255, 255, 0},
+                                                  {255, 0, 0}};
+        double pos = val * 4.0;
+        int s = std::min(3, (int)pos);
+        double frac = pos - s;
+        for (int c = 0; c != 3; ++c)
+            rgb[c] = (unsigned char)(stops[s][c] +
+                                     frac * (stops[s + 1][c] - stops[s][c]) +
+                                     0.5);
+    }
+
+    std::string prefix_;
+    int block_height_;
+    int block_width_;
+    int grid_height_;
+    int grid_width_;
+    int image_height_;
+    int image_width_;
+    int off_x_; // Global row offset of the block
+    int off_y_; // Global column offset of the block
+
+    Tile tile_;                      // Of the block
+    std::vector<int> column_pixels_; // Tile column of each block column
+
+    int frames_;
+    double composite_time_;
+
+    DISALLOW_COPY_AND_ASSIGN(Renderer);
+};
+
+} // namespace heat_transfer
+
+#endif // __RENDER_H_
@@ -0,0 +1,226 @@
+#ifndef __SERVER_H_
+#define __SERVER_H_
+
+#include "heat_transfer.h"
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace heat_transfer {
+
+// Simulation request, as broadcast from the root worker
+enum REQUEST_FIELD {
+    REQ_COMMAND,
+    REQ_HEIGHT,
+    REQ_WIDTH,
+    REQ_STEPS,
+    REQ_LEVELS,
+    REQ_ASYNC,
+    REQ_TILES,
+    REQ_FIELDS
+};
+
+enum REQUEST_COMMAND { CMD_RUN, CMD_QUIT };
+
+/*
+ * Server: keeps the workers resident and runs the simulations requested on a
+ * local UNIX socket, one client at a time, so that short runs do not pay for
+ * MPI startup, topology creation and grid allocation every time. The topology
+ * and the grids are reused while the grid dimensions stay the same.
+ *
+ * A request is a single line:
+ *
+ *     height width steps [levels=N] [async=1] [tiles=N]
+ *
+ * or "quit" to shut the server down. The root worker's reports and errors
+ * are streamed back on the connection, eg.
+ *
+ *     echo "512 512 1000" | socat - UNIX-CONNECT:/tmp/heat.sock
+ */
+class Server {
+  public:
+    Server() : listen_fd_(-1), started_(false) {
+    }
+
+    int Init(const char *path) {
+        mpi_wrapper_.Init();
+        int ok = 1;
+        if (!mpi_wrapper_.rank())
+            ok = Listen(path);
+        mpi_wrapper_.Broadcast(&ok, 1);
+        if (!ok) {
+            mpi_wrapper_.Destroy();
+            return 1;
+        }
+        return 0;
+    }
+
+    int Destroy() {
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+            unlink(path_);
+        }
+        if (started_)
+            simulation_.Destroy();
+        mpi_wrapper_.Destroy();
+        return 0;
+    }
+
+    /*
+     * Server::Run - serves requests until told to quit
+     */
+    int Run() {
+        for (;;) {
+            int request[REQ_FIELDS] = {0};
+            FILE *client = NULL;
+            if (!mpi_wrapper_.rank())
+                client = Accept(request);
+            mpi_wrapper_.Broadcast(request, REQ_FIELDS);
+            if (request[REQ_COMMAND] == CMD_QUIT) {
+                if (client != NULL)
+                    std::fclose(client);
+                break;
+            }
+            Serve(request, client);
+        }
+        return 0;
+    }
+
+  private:
+    int Listen(const char *path) {
+        std::snprintf(path_, sizeof(path_), "%s", path);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path_);
+        unlink(path_);
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0 ||
+            bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listen_fd_, 8) < 0) {
+            std::perror(path_);
+            return 0;
+        }
+        // A client that disconnects fails the writes to it, instead of
+        // killing the server
+        std::signal(SIGPIPE, SIG_IGN);
+        std::printf("Listening on %s\n", path_);
+        std::fflush(stdout);
+        return 1;
+    }
+
+    /*
+     * Waits for a client with a valid request, which is parsed into request.
+     * Invalid requests are answered with an error and the connection closed.
+     */
+    FILE *Accept(int *request) {
+        for (;;) {
+            int fd = accept(listen_fd_, NULL, NULL);
+            if (fd < 0)
+                continue;
+            FILE *client = fdopen(fd, "r+");
+            char line[256];
+            if (std::fgets(line, sizeof(line), client) == NULL) {
+                std::fclose(client);
+                continue;
+            }
+            if (!std::strncmp(line, "quit", 4)) {
+                request[REQ_COMMAND] = CMD_QUIT;
+                return client;
+            }
+            if (Parse(line, request))
+                return client;
+            std::fprintf(client, "Invalid request: %s", line);
+            std::fclose(client);
+        }
+    }
+
+    bool Parse(const char *line, int *request) const {
+        request[REQ_COMMAND] = CMD_RUN;
+        request[REQ_LEVELS] = 1;
+        int n = 0;
+        if (std::sscanf(line, "%d %d %d%n", &request[REQ_HEIGHT],
+                        &request[REQ_WIDTH], &request[REQ_STEPS], &n) != 3)
+            return false;
+        // Solver options
+        char option[64];
+        int value, m;
+        for (line += n; std::sscanf(line, " %63[a-z]=%d%n", option, &value,
+                                    &m) == 2;
+             line += m) {
+            if (!std::strcmp(option, "levels"))
+                request[REQ_LEVELS] = value;
+            else if (!std::strcmp(option, "async"))
+                request[REQ_ASYNC] = value;
+            else if (!std::strcmp(option, "tiles") && value >= 0)
+                request[REQ_TILES] = value;
+            else
+                return false;
+        }
+        return request[REQ_STEPS] > 0 &&
+               mpi_wrapper_.CanCreateTopology(request[REQ_HEIGHT],
+                                              request[REQ_WIDTH]);
+    }
+
+    int Serve(const int *request, FILE *client) {
+        double time_start = MPI_Wtime();
+        bool reused = false;
+        if (started_) {
+            reused = simulation_.Reset(request[REQ_HEIGHT], request[REQ_WIDTH],
+                                       request[REQ_STEPS]);
+        } else {
+            // The root of the topology reports, so it must be the first
+            // worker, which the client is connected to
+            simulation_.SetReorder(false);
+            simulation_.InitWithCommunicator(
+                MPI_COMM_WORLD, request[REQ_HEIGHT], request[REQ_WIDTH],
+                request[REQ_STEPS]);
+            started_ = true;
+        }
+        simulation_.SetOutput(client);
+        simulation_.SetErrorOutput(client);
+        mpi_wrapper_.PrintRoot(client, "Setup: %.4f sec%s\n",
+                               MPI_Wtime() - time_start,
+                               reused ? " (reused)" : "");
+
+        // Errors, such as that of the tiles, go to the client
+        if (simulation_.EnableTiles(request[REQ_TILES], 1e-4) == 0) {
+            if (request[REQ_ASYNC])
+                simulation_.RunAsync();
+            else if (request[REQ_LEVELS] > 1)
+                simulation_.RunNested(request[REQ_LEVELS]);
+            else
+                simulation_.Run();
+        }
+
+        // Only the client is dropped if it went away during the run
+        if (client != NULL) {
+            if (std::fflush(client) || std::ferror(client))
+                std::fprintf(stderr, "Lost the client of %dx%d, %d steps\n",
+                             request[REQ_HEIGHT], request[REQ_WIDTH],
+                             request[REQ_STEPS]);
+            std::fclose(client);
+        }
+        simulation_.SetOutput(stdout);
+        simulation_.SetErrorOutput(stderr);
+        return 0;
+    }
+
+    char path_[108]; // Socket path
+    int listen_fd_;  // Listening socket of the root worker
+    bool started_;   // Whether the simulation has been set up
+
+    HeatTransfer simulation_;
+    MPIWrapper mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+} // namespace heat_transfer
+
+#endif // __SERVER_H_
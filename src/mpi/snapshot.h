@@ -0,0 +1,443 @@
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+
+#include "macros.h"
+#include "snapshot_codec.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * Snapshot files: one per worker, <prefix>.<rank>, holding a frame per
+ * snapshot. A frame is a header of SNAPSHOT_HEADER bytes, starting with the
+ * ints indexed below (and, at SNAPSHOT_BOUND_OFFSET, the error bound of the
+ * codec, a double), then the block of the worker row by row, encoded with
+ * the codec of the frame (see SnapshotCodec), padded to a multiple of
+ * SNAPSHOT_ALIGN bytes. A frame takes SNAPSHOT_FRAME_PAGES times
+ * SNAPSHOT_ALIGN bytes, the next one starting right after it; raw frames
+ * are all the same size.
+ */
+enum SNAPSHOT_FIELD {
+    SNAPSHOT_MAGIC_FIELD,
+    SNAPSHOT_STEP,
+    SNAPSHOT_GRID_HEIGHT,
+    SNAPSHOT_GRID_WIDTH,
+    SNAPSHOT_TOPOLOGY_HEIGHT,
+    SNAPSHOT_TOPOLOGY_WIDTH,
+    SNAPSHOT_COORD_X,
+    SNAPSHOT_COORD_Y,
+    SNAPSHOT_BLOCK_HEIGHT,
+    SNAPSHOT_BLOCK_WIDTH,
+    SNAPSHOT_CODEC_FIELD,
+    SNAPSHOT_FRAME_PAGES,
+    SNAPSHOT_FIELDS
+};
+
+enum SNAPSHOT_FORMAT {
+    SNAPSHOT_MAGIC = 0x48545350,
+    SNAPSHOT_ALIGN = 4096,
+    SNAPSHOT_HEADER = SNAPSHOT_ALIGN,
+    SNAPSHOT_BOUND_OFFSET = 64
+};
+
+/*
+ * SnapshotWriter: Writes snapshots of the block of a worker from a
+ * background thread, so that the simulation only waits for the copy of the
+ * block. There are two staging frames: the simulation fills one while the
+ * thread writes the other, and only waits when it comes back to a frame
+ * still being written. Frames are written whole, with a single aligned
+ * write each, bypassing the page cache (O_DIRECT) where the file system
+ * allows. With a codec other than SNAPSHOT_RAW, the thread also encodes the
+ * frames, into a frame of its own, which frees the staging frame before the
+ * write.
+ */
+class SnapshotWriter {
+  public:
+    SnapshotWriter()
+        : file_(-1), frame_size_(0), encoded_(NULL), frames_submitted_(0),
+          frames_written_(0), next_(0), offset_(0), stop_(false),
+          running_(false), write_time_(0.0), encode_time_(0.0),
+          bytes_written_(0.0) {
+        for (int f = 0; f != 2; ++f) {
+            frames_[f] = NULL;
+            state_[f] = FRAME_FREE;
+        }
+    }
+
+    /*
+     * Creates the snapshot file of the worker, whose block and topology are
+     * taken from the given MPIWrapper, and starts the writing thread, which
+     * encodes the frames with the given codec. Returns non-zero on failure.
+     */
+    template <typename W>
+    int Init(const std::string &prefix, const W &mpi_wrapper,
+             SNAPSHOT_CODEC codec, double error_bound) {
+        int block_height = mpi_wrapper.block_height();
+        int block_width = mpi_wrapper.block_width();
+        if (codec_.Init(codec, error_bound,
+                        (size_t)block_height * block_width)) {
+            std::fprintf(stderr, "The snapshot delta codec needs a positive "
+                                 "error bound\n");
+            return 1;
+        }
+
+        std::ostringstream path;
+        path << prefix << "." << mpi_wrapper.rank();
+        path_ = path.str();
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+        file_ = open(path_.c_str(), flags | O_DIRECT, 0644);
+        if (file_ < 0 && errno == EINVAL)
+#endif
+            file_ = open(path_.c_str(), flags, 0644);
+        if (file_ < 0) {
+            std::fprintf(stderr, "Cannot open %s for writing: %s\n",
+                         path_.c_str(), std::strerror(errno));
+            return 1;
+        }
+
+        size_t data = (size_t)block_height * block_width * sizeof(double);
+        frame_size_ = SNAPSHOT_HEADER + Padded(data);
+        if (codec != SNAPSHOT_RAW) {
+            void *frame;
+            if (posix_memalign(&frame, SNAPSHOT_ALIGN,
+                               SNAPSHOT_HEADER +
+                                   Padded(codec_.MaxEncodedSize())))
+                return 1;
+            encoded_ = static_cast<char *>(frame);
+        }
+        for (int f = 0; f != 2; ++f) {
+            void *frame;
+            if (posix_memalign(&frame, SNAPSHOT_ALIGN, frame_size_))
+                return 1;
+            std::memset(frame, 0, frame_size_);
+            frames_[f] = static_cast<char *>(frame);
+            int *header = reinterpret_cast<int *>(frames_[f]);
+            header[SNAPSHOT_MAGIC_FIELD] = SNAPSHOT_MAGIC;
+            header[SNAPSHOT_GRID_HEIGHT] =
+                mpi_wrapper.topology_height() * block_height;
+            header[SNAPSHOT_GRID_WIDTH] =
+                mpi_wrapper.topology_width() * block_width;
+            header[SNAPSHOT_TOPOLOGY_HEIGHT] = mpi_wrapper.topology_height();
+            header[SNAPSHOT_TOPOLOGY_WIDTH] = mpi_wrapper.topology_width();
+            header[SNAPSHOT_COORD_X] = mpi_wrapper.topology_coord_x();
+            header[SNAPSHOT_COORD_Y] = mpi_wrapper.topology_coord_y();
+            header[SNAPSHOT_BLOCK_HEIGHT] = block_height;
+            header[SNAPSHOT_BLOCK_WIDTH] = block_width;
+            header[SNAPSHOT_CODEC_FIELD] = SNAPSHOT_RAW;
+            header[SNAPSHOT_FRAME_PAGES] = frame_size_ / SNAPSHOT_ALIGN;
+            std::memcpy(frames_[f] + SNAPSHOT_BOUND_OFFSET, &error_bound,
+                        sizeof(error_bound));
+        }
+
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&changed_, NULL);
+        stop_ = false;
+        if (pthread_create(&thread_, NULL, &SnapshotWriter::Main, this))
+            return 1;
+        running_ = true;
+        return 0;
+    }
+
+    /*
+     * Writes the snapshots still staged and stops the thread
+     */
+    int Destroy() {
+        if (running_) {
+            pthread_mutex_lock(&mutex_);
+            stop_ = true;
+            pthread_cond_broadcast(&changed_);
+            pthread_mutex_unlock(&mutex_);
+            pthread_join(thread_, NULL);
+            pthread_cond_destroy(&changed_);
+            pthread_mutex_destroy(&mutex_);
+            running_ = false;
+        }
+        for (int f = 0; f != 2; ++f) {
+            std::free(frames_[f]);
+            frames_[f] = NULL;
+        }
+        std::free(encoded_);
+        encoded_ = NULL;
+        if (file_ >= 0) {
+            close(file_);
+            file_ = -1;
+        }
+        return 0;
+    }
+
+    /*
+     * Returns the staging buffer of the next snapshot, to be filled with the
+     * block as in HeatMap::CopyBlock, waiting for it to be written first if
+     * it still holds an earlier one
+     */
+    double *Stage() {
+        pthread_mutex_lock(&mutex_);
+        while (state_[next_] != FRAME_FREE)
+            pthread_cond_wait(&changed_, &mutex_);
+        pthread_mutex_unlock(&mutex_);
+        return reinterpret_cast<double *>(frames_[next_] + SNAPSHOT_HEADER);
+    }
+
+    /*
+     * Hands the staged snapshot of the given step to the thread
+     */
+    void Submit(int step) {
+        reinterpret_cast<int *>(frames_[next_])[SNAPSHOT_STEP] = step;
+        pthread_mutex_lock(&mutex_);
+        state_[next_] = FRAME_QUEUED;
+        ++frames_submitted_;
+        pthread_cond_broadcast(&changed_);
+        pthread_mutex_unlock(&mutex_);
+        next_ = 1 - next_;
+    }
+
+    /*
+     * Waits until the snapshots submitted so far have been written
+     */
+    void Flush() {
+        pthread_mutex_lock(&mutex_);
+        while (frames_written_ != frames_submitted_)
+            pthread_cond_wait(&changed_, &mutex_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    /*
+     * Snapshots written, the time the thread spent writing and encoding
+     * them, and the bytes written. Call after SnapshotWriter::Flush.
+     */
+    int frames_written() const {
+        return frames_written_;
+    }
+
+    double write_time() const {
+        return write_time_;
+    }
+
+    double encode_time() const {
+        return encode_time_;
+    }
+
+    double bytes_written() const {
+        return bytes_written_;
+    }
+
+    const SnapshotCodec &codec() const {
+        return codec_;
+    }
+
+    size_t frame_size() const {
+        return frame_size_;
+    }
+
+    // The snapshot file of the worker
+    const std::string &path() const {
+        return path_;
+    }
+
+  private:
+    enum FRAME_STATE { FRAME_FREE, FRAME_QUEUED, FRAME_WRITING };
+
+    static void *Main(void *writer) {
+        static_cast<SnapshotWriter *>(writer)->WriteFrames();
+        return NULL;
+    }
+
+    // The thread: writes the frames in the order they are submitted, until
+    // stopped with none left
+    void WriteFrames() {
+        int f = 0;
+        pthread_mutex_lock(&mutex_);
+        for (;;) {
+            while (state_[f] != FRAME_QUEUED && !stop_)
+                pthread_cond_wait(&changed_, &mutex_);
+            if (state_[f] != FRAME_QUEUED)
+                break;
+            state_[f] = FRAME_WRITING;
+            pthread_mutex_unlock(&mutex_);
+
+            const char *frame = frames_[f];
+            size_t size = frame_size_;
+            double time_start = Now();
+            if (encoded_ != NULL) {
+                size = EncodeFrame(frames_[f]);
+                frame = encoded_;
+                encode_time_ += Now() - time_start;
+                pthread_mutex_lock(&mutex_);
+                state_[f] = FRAME_FREE;
+                pthread_cond_broadcast(&changed_);
+                pthread_mutex_unlock(&mutex_);
+                time_start = Now();
+            }
+            WriteFrame(frame, size);
+            write_time_ += Now() - time_start;
+
+            pthread_mutex_lock(&mutex_);
+            if (encoded_ == NULL)
+                state_[f] = FRAME_FREE;
+            ++frames_written_;
+            pthread_cond_broadcast(&changed_);
+            f = 1 - f;
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    // Seconds on a monotonic clock (MPI_Wtime is for the MPI thread only)
+    static double Now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    static size_t Padded(size_t size) {
+        return (size + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+    }
+
+    // Encodes the staged frame into the frame of the thread, returning its
+    // size
+    size_t EncodeFrame(const char *frame) {
+        SNAPSHOT_CODEC codec;
+        size_t data = codec_.Encode(
+            reinterpret_cast<const double *>(frame + SNAPSHOT_HEADER),
+            encoded_ + SNAPSHOT_HEADER, &codec);
+        size_t size = SNAPSHOT_HEADER + Padded(data);
+        std::memset(encoded_ + SNAPSHOT_HEADER + data, 0,
+                    size - SNAPSHOT_HEADER - data);
+        std::memcpy(encoded_, frame, SNAPSHOT_HEADER);
+        int *header = reinterpret_cast<int *>(encoded_);
+        header[SNAPSHOT_CODEC_FIELD] = codec;
+        header[SNAPSHOT_FRAME_PAGES] = size / SNAPSHOT_ALIGN;
+        return size;
+    }
+
+    // Appends the frame to the file
+    void WriteFrame(const char *frame, size_t size) {
+        size_t written = 0;
+        while (written != size) {
+            ssize_t n = pwrite(file_, frame + written, size - written,
+                               offset_ + written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                std::perror("Snapshot write");
+                return;
+            }
+            written += n;
+        }
+        offset_ += size;
+        bytes_written_ += size;
+    }
+
+    std::string path_;
+    int file_;
+    size_t frame_size_; // Bytes of a staging frame, header and padding
+                        // included
+    char *frames_[2];   // Staging frames, aligned
+    FRAME_STATE state_[2];
+    SnapshotCodec codec_;
+    char *encoded_;        // Frame of the thread, unless raw
+    int frames_submitted_; // By the simulation
+    int frames_written_;   // By the thread, and frames in the file
+    int next_;             // Frame staged next
+    off_t offset_;         // Of the next frame in the file
+
+    pthread_t thread_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t changed_; // Signalled on every change of state_ or stop_
+    bool stop_;
+    bool running_;
+    double write_time_; // Of the thread
+    double encode_time_;
+    double bytes_written_;
+
+    DISALLOW_COPY_AND_ASSIGN(SnapshotWriter);
+};
+
+/*
+ * SnapshotReader: Reads the frames of a snapshot file back, in order,
+ * decoding them with a SnapshotCodec of its own
+ */
+class SnapshotReader {
+  public:
+    SnapshotReader() : file_(NULL), size_(0), frames_(0) {
+    }
+
+    ~SnapshotReader() {
+        if (file_ != NULL)
+            std::fclose(file_);
+    }
+
+    /*
+     * Opens the snapshot file at path, of blocks of size values. Returns
+     * non-zero if it cannot be read.
+     */
+    int Open(const std::string &path, size_t size) {
+        file_ = std::fopen(path.c_str(), "rb");
+        if (file_ == NULL) {
+            std::fprintf(stderr, "Cannot open %s for reading: %s\n",
+                         path.c_str(), std::strerror(errno));
+            return 1;
+        }
+        size_ = size;
+        return 0;
+    }
+
+    /*
+     * Reads and decodes the next frame into block, and its step into *step.
+     * Sets *end instead, leaving block as it is, when there are no more.
+     * Returns non-zero on a frame that is truncated or corrupt.
+     */
+    int Read(double *block, int *step, bool *end) {
+        frame_.resize(SNAPSHOT_HEADER);
+        size_t got = std::fread(&frame_[0], 1, SNAPSHOT_HEADER, file_);
+        *end = got == 0 && std::feof(file_);
+        if (*end)
+            return 0;
+        const int *header = reinterpret_cast<const int *>(&frame_[0]);
+        int pages = header[SNAPSHOT_FRAME_PAGES];
+        SNAPSHOT_CODEC codec = static_cast<SNAPSHOT_CODEC>(
+            header[SNAPSHOT_CODEC_FIELD]);
+        // A frame has a page of data at least
+        if (got != SNAPSHOT_HEADER ||
+            header[SNAPSHOT_MAGIC_FIELD] != SNAPSHOT_MAGIC || pages < 2 ||
+            codec < SNAPSHOT_RAW || codec > SNAPSHOT_DELTA)
+            return 1;
+        *step = header[SNAPSHOT_STEP];
+        if (!frames_++) {
+            // The codec given only matters to the encoder
+            double error_bound;
+            std::memcpy(&error_bound, &frame_[SNAPSHOT_BOUND_OFFSET],
+                        sizeof(error_bound));
+            codec_.Init(SNAPSHOT_RAW, error_bound, size_);
+        }
+
+        size_t data = (size_t)pages * SNAPSHOT_ALIGN - SNAPSHOT_HEADER;
+        frame_.resize(data);
+        if (std::fread(&frame_[0], 1, data, file_) != data)
+            return 1;
+        return codec_.Decode(&frame_[0], data, codec, block);
+    }
+
+  private:
+    FILE *file_;
+    size_t size_;             // Of a block, in values
+    int frames_;              // Read so far
+    std::vector<char> frame_; // The frame being read
+    SnapshotCodec codec_;     // The decoder
+
+    DISALLOW_COPY_AND_ASSIGN(SnapshotReader);
+};
+
+} // namespace heat_transfer
+
+#endif // __SNAPSHOT_H_
@@ -0,0 +1,278 @@
+#ifndef __SNAPSHOT_CODEC_H_
+#define __SNAPSHOT_CODEC_H_
+
+#include "macros.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+namespace heat_transfer {
+
+// Encodings of the snapshots, see SnapshotCodec
+enum SNAPSHOT_CODEC { SNAPSHOT_RAW, SNAPSHOT_XOR, SNAPSHOT_DELTA };
+
+/*
+ * SnapshotCodec: Compresses the successive snapshots of a block, each
+ * against the previous one:
+ *  - SNAPSHOT_RAW stores the values as they are,
+ *  - SNAPSHOT_XOR stores the bits of each value XORed with those of the
+ *    previous snapshot, losslessly,
+ *  - SNAPSHOT_DELTA quantizes the difference from the previous snapshot in
+ *    steps of twice the error bound, as 64-bit integers (zigzag coded, so
+ *    that small differences of either sign have their high bytes zero). The
+ *    encoder tracks the values the decoder reconstructs, so the error does
+ *    not accumulate over the snapshots. A snapshot falls back to
+ *    SNAPSHOT_XOR if its differences do not fit (eg. the first, against
+ *    zero), or if a value would be reconstructed beyond the bound, which
+ *    happens where the bound is finer than the resolution of the values.
+ * The 64-bit words are then shuffled into byte planes, most significant
+ * first, where the bytes that do not change are runs of zeros, and the
+ * planes are run-length coded: a varint of (length << 1 | zero) either
+ * stands for length zero bytes or precedes length literal bytes.
+ * A decoder is a SnapshotCodec that decodes the snapshots in order.
+ */
+class SnapshotCodec {
+  public:
+    SnapshotCodec()
+        : codec_(SNAPSHOT_RAW), error_bound_(0.0), max_error_(0.0) {
+    }
+
+    /*
+     * Selects the codec, for snapshots of size values. Returns non-zero on
+     * an error bound SNAPSHOT_DELTA cannot use.
+     */
+    int Init(SNAPSHOT_CODEC codec, double error_bound, size_t size) {
+        if (codec == SNAPSHOT_DELTA && !(error_bound > 0.0))
+            return 1;
+        codec_ = codec;
+        error_bound_ = error_bound;
+        max_error_ = 0.0;
+        reference_.assign(size, 0.0);
+        planes_.resize(codec == SNAPSHOT_RAW ? 0 : size * sizeof(Word));
+        return 0;
+    }
+
+    /*
+     * The size of the largest encoded snapshot, in bytes
+     */
+    size_t MaxEncodedSize() const {
+        size_t size = reference_.size() * sizeof(Word);
+        return size + 3 * (size / kMaxLiteral + 1);
+    }
+
+    /*
+     * SnapshotCodec::Encode - encodes the snapshot into out, returning its
+     * size in bytes, and the codec it was encoded with in *codec (the one to
+     * decode it with)
+     */
+    size_t Encode(const double *block, char *out, SNAPSHOT_CODEC *codec) {
+        size_t n = reference_.size();
+        *codec = codec_;
+        if (codec_ == SNAPSHOT_RAW) {
+            std::memcpy(out, block, n * sizeof(double));
+            return n * sizeof(double);
+        }
+        if (codec_ == SNAPSHOT_DELTA) {
+            double step = 2.0 * error_bound_;
+            deltas_.resize(n);
+            for (size_t k = 0; k != n; ++k) {
+                double steps = (block[k] - reference_[k]) / step;
+                // Zigzag coded, the quantized differences must fit in 63 bits
+                if (!(std::fabs(steps) < 4611686018427387904.0)) {
+                    *codec = SNAPSHOT_XOR;
+                    break;
+                }
+                deltas_[k] = Round(steps);
+                double decoded = reference_[k] + deltas_[k] * step;
+                if (!(std::fabs(decoded - block[k]) <= error_bound_)) {
+                    *codec = SNAPSHOT_XOR;
+                    break;
+                }
+            }
+        }
+
+        for (size_t k = 0; k != n; ++k) {
+            Word word;
+            if (*codec == SNAPSHOT_DELTA) {
+                long long delta = deltas_[k];
+                reference_[k] += delta * (2.0 * error_bound_);
+                max_error_ = std::max(max_error_,
+                                      std::fabs(reference_[k] - block[k]));
+                word = ((Word)delta << 1) ^ (Word)(delta >> 63);
+            } else {
+                word = Bits(block[k]) ^ Bits(reference_[k]);
+                reference_[k] = block[k];
+            }
+            for (size_t p = 0; p != sizeof(Word); ++p)
+                planes_[p * n + k] =
+                    (unsigned char)(word >> (8 * (sizeof(Word) - 1 - p)));
+        }
+        return Pack(&planes_[0], planes_.size(),
+                    reinterpret_cast<unsigned char *>(out));
+    }
+
+    /*
+     * SnapshotCodec::Decode - decodes the snapshot of the given size in
+     * bytes, encoded with codec, into block. Returns non-zero if it is
+     * corrupt.
+     */
+    int Decode(const char *in, size_t size, SNAPSHOT_CODEC codec,
+               double *block) {
+        size_t n = reference_.size();
+        if (codec == SNAPSHOT_RAW) {
+            if (size < n * sizeof(double))
+                return 1;
+            std::memcpy(block, in, n * sizeof(double));
+            std::copy(block, block + n, reference_.begin());
+            return 0;
+        }
+        planes_.resize(n * sizeof(Word));
+        if (Unpack(reinterpret_cast<const unsigned char *>(in), size,
+                   &planes_[0], planes_.size()))
+            return 1;
+        for (size_t k = 0; k != n; ++k) {
+            Word word = 0;
+            for (size_t p = 0; p != sizeof(Word); ++p)
+                word = word << 8 | planes_[p * n + k];
+            if (codec == SNAPSHOT_DELTA) {
+                long long delta =
+                    (long long)(word >> 1) ^ -(long long)(word & 1);
+                reference_[k] += delta * (2.0 * error_bound_);
+            } else {
+                word ^= Bits(reference_[k]);
+                std::memcpy(&reference_[k], &word, sizeof(word));
+            }
+            block[k] = reference_[k];
+        }
+        return 0;
+    }
+
+    SNAPSHOT_CODEC codec() const {
+        return codec_;
+    }
+
+    double error_bound() const {
+        return error_bound_;
+    }
+
+    /*
+     * The largest difference of a value decoded from the value encoded
+     */
+    double max_error() const {
+        return max_error_;
+    }
+
+  private:
+    typedef unsigned long long Word;
+
+    static const size_t kMaxLiteral = 1 << 20;
+    // Zero runs shorter than this are cheaper as literals
+    static const size_t kMinZeroRun = 4;
+
+    static Word Bits(double val) {
+        Word word;
+        std::memcpy(&word, &val, sizeof(word));
+        return word;
+    }
+
+    // Difference of a value from its reference, in steps of twice the error
+    // bound, rounded to the nearest (without a call to floor, which would
+    // dominate the encoding)
+    static long long Round(double steps) {
+        return (long long)(steps < 0.0 ? steps - 0.5 : steps + 0.5);
+    }
+
+    static size_t PutVarint(size_t val, unsigned char *out) {
+        size_t size = 0;
+        for (; val >= 0x80; val >>= 7)
+            out[size++] = (unsigned char)(val | 0x80);
+        out[size++] = (unsigned char)val;
+        return size;
+    }
+
+    // Run-length codes size bytes into out, returning the encoded size
+    static size_t Pack(const unsigned char *in, size_t size,
+                       unsigned char *out) {
+        size_t k = 0, literal = 0, packed = 0;
+        while (k != size) {
+            if (in[k]) {
+                ++k;
+                continue;
+            }
+            size_t run = k;
+            Word word = 0;
+            while (run + sizeof(word) <= size &&
+                   (std::memcpy(&word, in + run, sizeof(word)), !word))
+                run += sizeof(word);
+            while (run != size && !in[run])
+                ++run;
+            if (run - k >= kMinZeroRun) {
+                packed += PackLiteral(in + literal, k - literal, out + packed);
+                packed += PutVarint((run - k) << 1 | 1, out + packed);
+                literal = run;
+            }
+            k = run;
+        }
+        return packed + PackLiteral(in + literal, size - literal, out + packed);
+    }
+
+    // Literals are cut to kMaxLiteral bytes, so that their varint takes up
+    // to 3 bytes and a zero run never costs more than it saves
+    static size_t PackLiteral(const unsigned char *in, size_t size,
+                              unsigned char *out) {
+        size_t packed = 0;
+        for (size_t k = 0; k != size;) {
+            size_t length = std::min(size - k, (size_t)kMaxLiteral);
+            packed += PutVarint(length << 1, out + packed);
+            std::memcpy(out + packed, in + k, length);
+            packed += length;
+            k += length;
+        }
+        return packed;
+    }
+
+    // Decodes the run-length code of size bytes into the out_size bytes of
+    // out. Returns non-zero if they do not match.
+    static int Unpack(const unsigned char *in, size_t size, unsigned char *out,
+                      size_t out_size) {
+        size_t k = 0, unpacked = 0;
+        while (unpacked != out_size) {
+            size_t val = 0;
+            for (int shift = 0;; shift += 7) {
+                if (k == size || shift >= 64)
+                    return 1;
+                val |= (size_t)(in[k] & 0x7f) << shift;
+                if (!(in[k++] & 0x80))
+                    break;
+            }
+            size_t length = val >> 1;
+            if (length > out_size - unpacked)
+                return 1;
+            if (val & 1) {
+                std::memset(out + unpacked, 0, length);
+            } else {
+                if (length > size - k)
+                    return 1;
+                std::memcpy(out + unpacked, in + k, length);
+                k += length;
+            }
+            unpacked += length;
+        }
+        return 0;
+    }
+
+    SNAPSHOT_CODEC codec_;
+    double error_bound_;
+    double max_error_;
+    std::vector<double> reference_;     // The previous snapshot, as decoded
+    std::vector<unsigned char> planes_; // The byte planes of a snapshot
+    std::vector<long long> deltas_;     // Quantized differences of one
+
+    DISALLOW_COPY_AND_ASSIGN(SnapshotCodec);
+};
+
+} // namespace heat_transfer
+
+#endif // __SNAPSHOT_CODEC_H_
@@ -0,0 +1,47 @@
+#ifndef __STATISTICS_H_
+#define __STATISTICS_H_
+
+#include <cfloat>
+
+namespace heat_transfer {
+
+/*
+ * GridStatistics: Statistics of (a part of) the grid, accumulated by the
+ * update sweep, see HeatMap::CollectStatistics. All doubles, so that they
+ * travel as a single MPI datatype.
+ */
+struct GridStatistics {
+    double cells;
+    double sum; // The total energy, at unit heat capacity
+    double min;
+    double max;
+    double max_row; // Global coordinates of the max, the first in row-major
+    double max_col; // order if there are several
+
+    GridStatistics()
+        : cells(0.0), sum(0.0), min(DBL_MAX), max(-DBL_MAX), max_row(0.0),
+          max_col(0.0) {
+    }
+
+    /*
+     * Combines the statistics of another part of the grid into these
+     */
+    void Combine(const GridStatistics &other) {
+        cells += other.cells;
+        sum += other.sum;
+        if (other.min < min)
+            min = other.min;
+        if (other.max > max ||
+            (other.max == max &&
+             (other.max_row < max_row ||
+              (other.max_row == max_row && other.max_col < max_col)))) {
+            max = other.max;
+            max_row = other.max_row;
+            max_col = other.max_col;
+        }
+    }
+};
+
+} // namespace heat_transfer
+
+#endif // __STATISTICS_H_
@@ -0,0 +1,231 @@
+#ifndef __STENCIL_H_
+#define __STENCIL_H_
+
+#include "macros.h"
+#include "mpi_wrapper.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace heat_transfer {
+
+/*
+ * Stencil descriptors: the points of a discrete Laplacian as (row, column)
+ * offsets, with their weights in units of 1 / h^2. kRadius is the halo width
+ * they need, and kCorners whether they reach into the diagonal neighbors.
+ */
+
+// Second order, the stencil of HeatMap
+struct FivePointStencil {
+    enum { kRadius = 1, kCorners = 0, kPoints = 5 };
+
+    static int Row(int k) {
+        static const int rows[kPoints] = {0, -1, 1, 0, 0};
+        return rows[k];
+    }
+
+    static int Col(int k) {
+        static const int cols[kPoints] = {0, 0, 0, -1, 1};
+        return cols[k];
+    }
+
+    static double Weight(int k) {
+        static const double weights[kPoints] = {-4.0, 1.0, 1.0, 1.0, 1.0};
+        return weights[k];
+    }
+};
+
+// Second order, with isotropic truncation error
+struct NinePointStencil {
+    enum { kRadius = 1, kCorners = 1, kPoints = 9 };
+
+    static int Row(int k) {
+        static const int rows[kPoints] = {0, -1, 1, 0, 0, -1, -1, 1, 1};
+        return rows[k];
+    }
+
+    static int Col(int k) {
+        static const int cols[kPoints] = {0, 0, 0, -1, 1, -1, 1, -1, 1};
+        return cols[k];
+    }
+
+    static double Weight(int k) {
+        static const double weights[kPoints] = {
+            -20.0 / 6, 4.0 / 6, 4.0 / 6, 4.0 / 6, 4.0 / 6,
+            1.0 / 6,   1.0 / 6, 1.0 / 6, 1.0 / 6};
+        return weights[k];
+    }
+};
+
+// Fourth order, within the 13-point diamond of radius two, whose diagonal
+// points have zero weights (stable up to coefficient 0.1875)
+struct FourthOrderStencil {
+    enum { kRadius = 2, kCorners = 0, kPoints = 9 };
+
+    static int Row(int k) {
+        static const int rows[kPoints] = {0, -1, 1, 0, 0, -2, 2, 0, 0};
+        return rows[k];
+    }
+
+    static int Col(int k) {
+        static const int cols[kPoints] = {0, 0, 0, -1, 1, 0, 0, -2, 2};
+        return cols[k];
+    }
+
+    static double Weight(int k) {
+        static const double weights[kPoints] = {
+            -5.0,       4.0 / 3,    4.0 / 3,    4.0 / 3,   4.0 / 3,
+            -1.0 / 12, -1.0 / 12, -1.0 / 12, -1.0 / 12};
+        return weights[k];
+    }
+};
+
+/*
+ * Weighted sum of the first K points of the stencil around a cell, expanded
+ * at compile time
+ */
+template <typename Stencil, typename Compute, int K> struct StencilSum {
+    template <typename Storage>
+    static Compute Apply(const Storage *cell, int row) {
+        return StencilSum<Stencil, Compute, K - 1>::Apply(cell, row) +
+               static_cast<Compute>(Stencil::Weight(K - 1)) *
+                   (cell + Stencil::Row(K - 1) * row)[Stencil::Col(K - 1)];
+    }
+};
+
+template <typename Stencil, typename Compute>
+struct StencilSum<Stencil, Compute, 0> {
+    template <typename Storage>
+    static Compute Apply(const Storage *, int) {
+        return 0;
+    }
+};
+
+/*
+ * StencilMap: The grid block of a worker, updated with the given stencil.
+ *
+ * The halos are Stencil::kRadius cells wide and, for stencils with corners,
+ * exchanged with the diagonal neighbors too (see
+ * MPIWrapper::ExchangeWideHalos). The sum over the points of the stencil is
+ * expanded at compile time (see StencilSum), so that the update has the
+ * weights and offsets as constants and vectorizes along the rows.
+ */
+template <typename Stencil, typename Storage = double,
+          typename Compute = Storage>
+class StencilMap {
+  public:
+    StencilMap() : working_grid_(0), coefficient_(0.1) {
+        for (int i = 0; i != 2; ++i)
+            grids_[i] = NULL;
+        mpi_wrapper_ = NULL;
+    }
+
+    int Init(int block_height, int block_width,
+             BasicMPIWrapper<Storage> *mpi_wrapper) {
+        block_height_ = block_height;
+        block_width_ = block_width;
+        mpi_wrapper_ = mpi_wrapper;
+        working_grid_ = 0;
+        row_ = block_width_ + 2 * Stencil::kRadius;
+
+        int size = (block_height_ + 2 * Stencil::kRadius) * row_;
+        for (int g = 0; g != 2; ++g) {
+            grids_[g] = new Storage[size];
+            std::fill(grids_[g], grids_[g] + size, Storage(0));
+        }
+        return 0;
+    }
+
+    int Destroy() {
+        for (int i = 0; i != 2; ++i)
+            if (grids_[i] != NULL) {
+                delete[] grids_[i];
+                grids_[i] = NULL;
+            }
+        return 0;
+    }
+
+    int ExchangeHalos() {
+        return mpi_wrapper_->ExchangeWideHalos(grids_[working_grid_],
+                                               Stencil::kRadius,
+                                               Stencil::kCorners);
+    }
+
+    int Update() {
+        const Compute coefficient = coefficient_;
+        const int row = row_, width = block_width_;
+        for (int i = 0; i != block_height_; ++i) {
+            const Storage *in = Cell(working_grid_, i, 0);
+            Storage *out = Cell(1 - working_grid_, i, 0);
+            for (int j = 0; j != width; ++j) {
+                Compute laplacian =
+                    StencilSum<Stencil, Compute, Stencil::kPoints>::Apply(
+                        in + j, row);
+                out[j] = static_cast<Storage>(in[j] + coefficient * laplacian);
+            }
+        }
+        return 0;
+    }
+
+    int CheckConvergence(int *converged) const {
+        *converged = 1;
+        for (int i = 0; i != block_height_; ++i) {
+            const Storage *val1 = Cell(working_grid_, i, 0);
+            const Storage *val2 = Cell(1 - working_grid_, i, 0);
+            for (int j = 0; j != block_width_; ++j)
+                if (!(std::fabs(val1[j] - val2[j]) <= 0.001f)) {
+                    *converged = 0;
+                    return 0;
+                }
+        }
+        return 0;
+    }
+
+    void ExchangeGrids() {
+        working_grid_ = 1 - working_grid_;
+    }
+
+    /*
+     * CopyBlock, LoadBlock: As HeatMap::CopyBlock and HeatMap::LoadBlock
+     */
+    int CopyBlock(double *buf) const {
+        for (int i = 0; i != block_height_; ++i)
+            buf = std::copy(Cell(working_grid_, i, 0),
+                            Cell(working_grid_, i, block_width_), buf);
+        return 0;
+    }
+
+    int LoadBlock(const double *buf) {
+        for (int i = 0; i != block_height_; ++i, buf += block_width_)
+            std::copy(buf, buf + block_width_, Cell(working_grid_, i, 0));
+        return 0;
+    }
+
+    void SetCoefficient(double coefficient) {
+        coefficient_ = coefficient;
+    }
+
+  private:
+    // Block cell (i, j) of a grid, in 0-based block coordinates
+    Storage *Cell(int grid, int i, int j) const {
+        return grids_[grid] + (i + Stencil::kRadius) * row_ + j +
+               Stencil::kRadius;
+    }
+
+    Storage *grids_[2];
+    int working_grid_;
+
+    int block_height_;
+    int block_width_;
+    int row_; // Row length, with halos
+
+    double coefficient_; // Diffusion coefficient of the update
+
+    BasicMPIWrapper<Storage> *mpi_wrapper_;
+
+    DISALLOW_COPY_AND_ASSIGN(StencilMap);
+};
+
+} // namespace heat_transfer
+
+#endif // __STENCIL_H_
@@ -0,0 +1,134 @@
+#!/bin/sh
+# Checks that mpi_heat rejects the combinations of options it does not
+# support, with an error and a non-zero exit status, and that the runs whose
+# results it checks itself succeed. Run by make check.
+
+MPIRUN=${MPIRUN:-mpirun}
+failures=0
+
+# expect_same <description> <workers> <mpi_heat arguments...>, whose grid
+# must match the reference grid
+expect_same() {
+    description=$1
+    workers=$2
+    shift 2
+    rm -f $grid
+    if $MPIRUN -np $workers ./mpi_heat "$@" -o $grid >/dev/null 2>&1 &&
+        cmp -s $grid $reference; then
+        echo "ok: $description matches the reference"
+    else
+        echo "FAIL: $description does not match the reference"
+        failures=$((failures + 1))
+    fi
+}
+# expect_rejected <description> <mpi_heat arguments...>
+expect_rejected() {
+    expect_rejected_on 1 "$@"
+}
+
+# expect_rejected_on <workers> <description> <mpi_heat arguments...>
+expect_rejected_on() {
+    workers=$1
+    description=$2
+    shift 2
+    if $MPIRUN -np $workers ./mpi_heat "$@" >/dev/null 2>&1; then
+        echo "FAIL: $description was accepted"
+        failures=$((failures + 1))
+    else
+        echo "ok: $description is rejected"
+    fi
+}
+
+# expect_accepted <description> <mpi_heat arguments...>, on 4 workers
+expect_accepted() {
+    description=$1
+    shift
+    if $MPIRUN -np 4 ./mpi_heat "$@" >/dev/null 2>&1; then
+        echo "ok: $description succeeds"
+    else
+        echo "FAIL: $description failed"
+        failures=$((failures + 1))
+    fi
+}
+
+expect_rejected "probes of a mirrored quadrant" -h 32 -w 32 -s 10 -m 1 \
+    -q 30:30
+expect_rejected "probes within a mirrored quadrant" -h 32 -w 32 -s 10 -m 1 \
+    -q 5:5
+expect_rejected "a malformed probe" -h 32 -w 32 -s 10 -q 5:5,5x5
+expect_rejected "a probe of a trailing text" -h 32 -w 32 -s 10 -q 5:5abc
+expect_rejected "a probe out of the grid" -h 32 -w 32 -s 10 -q 0:3
+expect_rejected "asynchronous iteration of a mirrored quadrant" -h 32 -w 32 \
+    -s 10 -m 1 -a 1
+expect_rejected "grid sequencing of a mirrored quadrant" -h 32 -w 32 -s 10 \
+    -m 1 -l 2
+expect_rejected "an unknown halo codec" -h 32 -w 32 -s 10 -c fp16
+expect_rejected "an unknown precision" -h 32 -w 32 -s 10 -P half
+expect_rejected "tiles of a reduced precision" -h 32 -w 32 -s 10 -P float \
+    -T 4
+expect_rejected "checkpoints of compressed halos" -h 32 -w 32 -s 10 -c delta \
+    -C /tmp/heat_checkpoint
+expect_rejected "a band of no rows" -h 16 -w 16 -s 10 -D 16 -B 0
+expect_rejected "an unknown layout" -h 32 -w 32 -s 10 -L hilbert
+expect_rejected "an unknown stencil" -h 32 -w 32 -s 10 -x 7
+expect_rejected "snapshots of grid sequencing" -h 32 -w 32 -s 10 -l 2 \
+    -V /tmp/heat_snapshots
+expect_rejected "an unknown snapshot codec" -h 32 -w 32 -s 10 \
+    -V /tmp/heat_snapshots -Z zstd
+expect_rejected "images of a mirrored quadrant" -h 32 -w 32 -s 10 -m 1 \
+    -G /tmp/heat_image
+expect_rejected "an unstable diffusivity" -h 32 -w 32 -s 10 -d 4
+expect_rejected "a negative tile size" -h 32 -w 32 -s 10 -T -1
+expect_rejected "tiles of the in-place update" -h 32 -w 32 -s 10 -r 1 -T 4
+expect_rejected "the in-place update of a stencil" -h 32 -w 32 -s 10 -r 1 -x 5
+expect_rejected "a width that is not a number" -h 16 -w 16 -s 10 -W 16,abc
+expect_rejected "a negative width" -h 16 -w 16 -s 10 -W 8,-4
+expect_rejected "checkpoints to a missing directory" -h 32 -w 32 -s 100 \
+    -C /nonexistent_dir/checkpoint -I 10
+expect_rejected "images to a missing directory" -h 32 -w 32 -s 100 \
+    -G /nonexistent_dir/image -Y 10
+expect_rejected "a missing ensemble" -h 16 -w 16 -s 10 \
+    -E /nonexistent_dir/ensemble
+expect_rejected_on 2 "a missing job list" -h 8 -w 8 -s 10 \
+    -J /nonexistent_dir/jobs
+
+mask=/tmp/heat_check_mask.$$
+printf '#\n' >$mask
+expect_accepted "a mask" -h 32 -w 32 -s 10 -M $mask
+expect_rejected "a mask of the in-place update" -h 32 -w 32 -s 10 -M $mask \
+    -r 1
+expect_rejected "tiles of a mask" -h 32 -w 32 -s 10 -M $mask -T 4
+rm -f $mask
+snapshots=/tmp/heat_check_snapshots.$$
+expect_accepted "reading xor snapshots back" -h 32 -w 32 -s 100 -n 10 \
+    -V $snapshots -Z xor -H 1
+expect_accepted "reading delta snapshots back" -h 32 -w 32 -s 100 -n 10 \
+    -V $snapshots -Z delta -H 1
+expect_accepted "reading delta snapshots finer than the values back" -h 32 \
+    -w 32 -s 100 -n 10 -V $snapshots -Z delta -z 1e-12 -H 1
+rm -f $snapshots.*
+
+# The updates, layouts and storage of the grid give the same results as the
+# plain run, and so do restarts on other numbers of workers
+reference=/tmp/heat_check_reference.$$
+grid=/tmp/heat_check_grid.$$
+checkpoint=/tmp/heat_check_checkpoint.$$
+scratch=/tmp/heat_check_scratch.$$
+grid_size="-h 48 -w 48"
+$MPIRUN -np 4 ./mpi_heat $grid_size -s 300 -o $reference >/dev/null 2>&1
+expect_same "the in-place update" 4 $grid_size -s 300 -r 1
+expect_same "the five-point stencil" 4 $grid_size -s 300 -x 5
+for layout in rows tiles morton; do
+    expect_same "the $layout layout" 4 $grid_size -s 300 -L $layout
+done
+mkdir -p $scratch
+expect_same "the on-disk grid" 4 $grid_size -s 300 -O $scratch -N 8 -F 4
+rm -rf $scratch
+$MPIRUN -np 4 ./mpi_heat $grid_size -s 150 -C $checkpoint -I 100 \
+    >/dev/null 2>&1
+expect_same "a restart on 1 worker" 1 $grid_size -s 300 -U $checkpoint
+expect_same "a restart on 6 workers" 6 $grid_size -s 300 -U $checkpoint
+expect_same "a run seeded from a checkpoint" 4 $grid_size -s 200 \
+    -i $checkpoint
+rm -f $reference $grid $checkpoint
+exit $failures